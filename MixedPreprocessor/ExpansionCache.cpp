@@ -0,0 +1,156 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "ExpansionCache.hpp"
+#include "MemoryAccounting.hpp"
+
+
+template <typename T>
+static void AppendBytes(std::string &Key, const T &Value) {
+    Key.append(reinterpret_cast<const char *>(&Value), sizeof(Value));
+}
+
+
+unsigned ExpansionCache::getGeneration(const IdentifierInfo *II) const {
+    auto It = Generations.find(II);
+    return It == Generations.end() ? 0 : It->second;
+}
+
+bool ExpansionCache::isValid(Entry &E) {
+    if (E.ValidatedAt == Generation) {
+        return true;
+    }
+
+    for (auto &Dependency : E.Dependencies) {
+        if (getGeneration(Dependency.first) != Dependency.second) {
+            return false;
+        }
+    }
+
+    E.ValidatedAt = Generation;
+    return true;
+}
+
+std::string ExpansionCache::getKey(
+        const MacroInfo *MI,
+        const std::vector<std::vector<MixedToken>> &Args,
+        ExpansionStack_id_t ExpansionStack) {
+    std::string Key;
+
+    AppendBytes(Key, MI);
+    AppendBytes(Key, ExpansionStack);
+
+    for (auto &Arg : Args) {
+        // Every argument ends with an eof, which separates them.
+        for (auto &MixedTok : Arg) {
+            if (MixedTok.getKind() == MixedToken::MTK_Arg) {
+                Key.push_back('A');
+                AppendBytes(Key, MixedTok.getArgNum());
+                Key.push_back(MixedTok.isExpanded());
+                continue;
+            } else if (MixedTok.isStringify()) {
+                Key.push_back(MixedTok.getKind() == MixedToken::MTK_StringifyArg ? 'S' : 'Q');
+                AppendBytes(Key, MixedTok.getKind() == MixedToken::MTK_StringifyArg ? MixedTok.getArgNum()
+                                                                                   : MixedTok.getSequence());
+                Key.push_back(MixedTok.isCharify() | MixedTok.isExpanded() << 1);
+                AppendBytes(Key, MixedTok.getSpacing());
+                continue;
+            }
+
+            const Token &Tok = MixedTok.getTok();
+
+            Key.push_back('T');
+            AppendBytes(Key, static_cast<unsigned short>(Tok.getKind()));
+            Key.push_back(Tok.isAtStartOfLine() | Tok.hasLeadingSpace() << 1);
+
+            if (Tok.isOneOf(tok::eof, tok::eod)) {
+                continue;
+            }
+
+            if (IdentifierInfo *II = Tok.getIdentifierInfo()) {
+                AppendBytes(Key, II);
+            } else {
+                StringRef Spelling = PP.getSpelling(Tok, SpellingBuffer);
+
+                AppendBytes(Key, static_cast<unsigned>(Spelling.size()));
+                Key.append(Spelling.data(), Spelling.size());
+            }
+        }
+    }
+
+    return Key;
+}
+
+const std::vector<MixedToken> * ExpansionCache::lookup(
+        const std::string &Key, Dependencies_t &Dependencies) {
+    auto It = Entries.find(Key);
+    if (It == Entries.end()) {
+        return nullptr;
+    }
+
+    if (!isValid(It->second)) {
+        erase(It);
+        return nullptr;
+    }
+
+    Uses.splice(Uses.begin(), Uses, It->second.Use);
+
+    for (auto &Dependency : It->second.Dependencies) {
+        Dependencies.push_back(Dependency.first);
+    }
+
+    return &It->second.Result;
+}
+
+void ExpansionCache::insert(
+        const std::string &Key,
+        const std::vector<MixedToken> &Result,
+        Dependencies_t::const_iterator DependenciesBegin,
+        Dependencies_t::const_iterator DependenciesEnd) {
+    Entry E;
+    E.ValidatedAt = Generation;
+    E.Result = Result;
+
+    for (auto It = DependenciesBegin; It != DependenciesEnd; ++It) {
+        E.Dependencies.emplace_back(*It, getGeneration(*It));
+    }
+
+    E.Bytes = sizeof(std::string) + Key.size() + sizeof(Entry) + 2 * NodeOverhead +
+              getVectorBytes(E.Result) + getVectorBytes(E.Dependencies);
+    Bytes += E.Bytes;
+
+    auto It = Entries.find(Key);
+    if (It != Entries.end()) {
+        Bytes -= It->second.Bytes;
+        E.Use = It->second.Use;
+        Uses.splice(Uses.begin(), Uses, E.Use);
+        It->second = std::move(E);
+    } else {
+        It = Entries.emplace(Key, std::move(E)).first;
+        It->second.Use = Uses.insert(Uses.begin(), &It->first);
+    }
+}
+
+void ExpansionCache::erase(std::unordered_map<std::string, Entry>::iterator It) {
+    Bytes -= It->second.Bytes;
+    Uses.erase(It->second.Use);
+    Entries.erase(It);
+}
+
+size_t ExpansionCache::evict(size_t ToFree) {
+    size_t Freed = 0;
+    size_t Dropped = 0;
+    while (Freed < ToFree && !Uses.empty()) {
+        auto It = Entries.find(*Uses.back());
+        Freed += It->second.Bytes;
+        erase(It);
+        ++Dropped;
+    }
+    return Dropped;
+}
+
+void ExpansionCache::invalidate(const IdentifierInfo *II) {
+    ++Generations[II];
+    ++Generation;
+}
@@ -0,0 +1,104 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_EXPANSIONCACHE_HPP
+#define MIXED_PREPROCESSOR_EXPANSIONCACHE_HPP
+
+
+#include "ExpansionStack.hpp"
+#include "MixedToken.hpp"
+
+#include "clang/Basic/IdentifierTable.h"
+#include "clang/Lex/MacroInfo.h"
+#include "clang/Lex/Preprocessor.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace clang;
+
+
+// Results of whole macro invocations.
+//
+// An entry is keyed on the macro, the spellings and kinds of the collected
+// arguments and the expansion stack, and owns a copy of the result.  It also
+// remembers every identifier whose macro definition was consulted while the
+// result was computed.  Defining or undefining such an identifier makes the
+// entry stale; stale entries are dropped when they are next looked up.
+//
+// Entries may also be evicted, the least recently used first, to keep the
+// engine within its memory budget.
+class ExpansionCache {
+public:
+    typedef std::vector<const IdentifierInfo *> Dependencies_t;
+
+private:
+    struct Entry {
+        std::vector<MixedToken> Result;
+        std::vector<std::pair<const IdentifierInfo *, unsigned>> Dependencies;
+        unsigned ValidatedAt;
+        size_t Bytes;
+        // Position in Uses.
+        std::list<const std::string *>::iterator Use;
+    };
+
+    Preprocessor &PP;
+
+    std::unordered_map<std::string, Entry> Entries;
+    // Keys of Entries, the most recently used first.
+    std::list<const std::string *> Uses;
+    // Estimated bytes held by Entries.
+    size_t Bytes;
+
+    // Number of times each identifier has been (un)defined.
+    llvm::DenseMap<const IdentifierInfo *, unsigned> Generations;
+    // Number of times any identifier has been (un)defined.
+    unsigned Generation;
+
+    SmallString<64> SpellingBuffer;
+
+    unsigned getGeneration(const IdentifierInfo *II) const;
+
+    bool isValid(Entry &E);
+
+    void erase(std::unordered_map<std::string, Entry>::iterator It);
+
+public:
+    explicit ExpansionCache(Preprocessor &PP) : PP(PP), Bytes(0), Generation(0) {}
+    ExpansionCache(const ExpansionCache &) = delete;
+    ExpansionCache & operator=(const ExpansionCache &) = delete;
+
+    std::string getKey(
+            const MacroInfo *MI,
+            const std::vector<std::vector<MixedToken>> &Args,
+            ExpansionStack_id_t ExpansionStack);
+
+    // Returns the cached result, or nullptr.  On a hit, the dependencies of
+    // the entry are appended to Dependencies.
+    const std::vector<MixedToken> * lookup(const std::string &Key, Dependencies_t &Dependencies);
+
+    void insert(
+            const std::string &Key,
+            const std::vector<MixedToken> &Result,
+            Dependencies_t::const_iterator DependenciesBegin,
+            Dependencies_t::const_iterator DependenciesEnd);
+
+    // Called whenever II is defined or undefined.
+    void invalidate(const IdentifierInfo *II);
+
+    // Drops the least recently used entries until at least Bytes have been
+    // freed or the cache is empty.  Returns the number of entries dropped.
+    size_t evict(size_t Bytes);
+
+    size_t getBytes() const { return Bytes; }
+};
+
+
+#endif //MIXED_PREPROCESSOR_EXPANSIONCACHE_HPP
@@ -0,0 +1,82 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "ExpansionStack.hpp"
+#include "MemoryAccounting.hpp"
+
+#include <algorithm>
+
+
+ExpansionStackTable::ExpansionStackTable() : StacksBytes(0) {
+    Stacks.emplace_back();
+    Interned.emplace(Stacks.back(), EmptyExpansionStack);
+}
+
+ExpansionStack_id_t ExpansionStackTable::intern(std::vector<const MacroInfo *> &&Members) {
+    auto It = Interned.find(Members);
+    if (It != Interned.end()) {
+        return It->second;
+    }
+
+    ExpansionStack_id_t Stack = Stacks.size();
+    // Members are held twice, as a stack and as a key of Interned.
+    StacksBytes += 2 * (sizeof(Members) + Members.size() * sizeof(const MacroInfo *)) + NodeOverhead;
+    Interned.emplace(Members, Stack);
+    Stacks.push_back(std::move(Members));
+    return Stack;
+}
+
+ExpansionStack_id_t ExpansionStackTable::push(ExpansionStack_id_t Stack, const MacroInfo *MI) {
+    auto Key = std::make_pair(Stack, MI);
+
+    auto It = Pushed.find(Key);
+    if (It != Pushed.end()) {
+        return It->second;
+    }
+
+    const std::vector<const MacroInfo *> &Members = Stacks[Stack];
+    auto Pos = std::lower_bound(Members.begin(), Members.end(), MI);
+
+    ExpansionStack_id_t Res = Stack;
+    if (Pos == Members.end() || *Pos != MI) {
+        std::vector<const MacroInfo *> NewMembers;
+        NewMembers.reserve(Members.size() + 1);
+        NewMembers.insert(NewMembers.end(), Members.begin(), Pos);
+        NewMembers.push_back(MI);
+        NewMembers.insert(NewMembers.end(), Pos, Members.end());
+
+        Res = intern(std::move(NewMembers));
+    }
+
+    Pushed[Key] = Res;
+    return Res;
+}
+
+bool ExpansionStackTable::contains(ExpansionStack_id_t Stack, const MacroInfo *MI) const {
+    const std::vector<const MacroInfo *> &Members = Stacks[Stack];
+    return std::binary_search(Members.begin(), Members.end(), MI);
+}
+
+bool ExpansionStackTable::intersects(ExpansionStack_id_t LHS, ExpansionStack_id_t RHS) const {
+    if (LHS == EmptyExpansionStack || RHS == EmptyExpansionStack) {
+        return false;
+    }
+    if (LHS == RHS) {
+        return true;
+    }
+
+    // Members are sorted.
+    auto L = Stacks[LHS].begin(), LEnd = Stacks[LHS].end();
+    auto R = Stacks[RHS].begin(), REnd = Stacks[RHS].end();
+    while (L != LEnd && R != REnd) {
+        if (*L < *R) {
+            ++L;
+        } else if (*R < *L) {
+            ++R;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
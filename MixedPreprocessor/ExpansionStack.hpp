@@ -0,0 +1,61 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_EXPANSIONSTACK_HPP
+#define MIXED_PREPROCESSOR_EXPANSIONSTACK_HPP
+
+
+#include "clang/Lex/MacroInfo.h"
+
+#include "llvm/ADT/DenseMap.h"
+
+#include <map>
+#include <utility>
+#include <vector>
+
+using namespace clang;
+
+
+// Expansion stacks are sets of macros and are referred to by a small id.
+typedef unsigned ExpansionStack_id_t;
+
+const ExpansionStack_id_t EmptyExpansionStack = 0;
+
+
+// Interns expansion stacks as immutable, hash-consed sets.
+//
+// Equal sets always get the same id, so stacks are compared and stored as
+// plain integers.  The results of push are memoized: once a combination has
+// been seen, it costs a single hash lookup and no allocation.
+class ExpansionStackTable {
+    std::vector<std::vector<const MacroInfo *>> Stacks;
+    std::map<std::vector<const MacroInfo *>, ExpansionStack_id_t> Interned;
+
+    llvm::DenseMap<std::pair<ExpansionStack_id_t, const MacroInfo *>, ExpansionStack_id_t> Pushed;
+
+    // Estimated bytes held by Stacks and Interned.
+    size_t StacksBytes;
+
+    ExpansionStack_id_t intern(std::vector<const MacroInfo *> &&Members);
+
+public:
+    ExpansionStackTable();
+
+    // Returns the stack with MI added.
+    ExpansionStack_id_t push(ExpansionStack_id_t Stack, const MacroInfo *MI);
+
+    // Whether MI is a member of the stack, nothing is interned.
+    bool contains(ExpansionStack_id_t Stack, const MacroInfo *MI) const;
+
+    // Whether the stacks have a member in common, nothing is interned.
+    bool intersects(ExpansionStack_id_t LHS, ExpansionStack_id_t RHS) const;
+
+    // Estimated bytes held by the table.
+    size_t getBytes() const {
+        return StacksBytes + Pushed.getMemorySize();
+    }
+};
+
+
+#endif //MIXED_PREPROCESSOR_EXPANSIONSTACK_HPP
@@ -0,0 +1,99 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "ExpansionTrace.hpp"
+
+#include "llvm/Support/Format.h"
+
+
+static void printJSONString(llvm::raw_ostream &OS, StringRef String) {
+    OS << '"';
+    for (char C : String) {
+        if (C == '"' || C == '\\') {
+            OS << '\\' << C;
+        } else if (static_cast<unsigned char>(C) < 0x20) {
+            OS << llvm::format("\\u%04x", static_cast<unsigned char>(C));
+        } else {
+            OS << C;
+        }
+    }
+    OS << '"';
+}
+
+
+ExpansionTrace::ExpansionTrace() : Origin(std::chrono::steady_clock::now()) {
+    Events.reserve(1 << 16);
+}
+
+size_t ExpansionTrace::begin(const char *Name, const IdentifierInfo *Macro, SourceLocation Loc) {
+    Event E;
+    E.Name = Name;
+    E.Macro = Macro;
+    E.Loc = Loc;
+    E.Start = now();
+    E.Duration = 0;
+    E.TokensIn = -1;
+    E.TokensOut = -1;
+
+    Events.push_back(E);
+    return Events.size() - 1;
+}
+
+void ExpansionTrace::end(size_t Index, bool KeepLeaf) {
+    if (!KeepLeaf && Index + 1 == Events.size()) {
+        Events.pop_back();
+        return;
+    }
+
+    Events[Index].Duration = now() - Events[Index].Start;
+}
+
+void ExpansionTrace::write(llvm::raw_ostream &OS, SourceManager &SM) const {
+    OS << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+
+    bool First = true;
+    for (auto &E : Events) {
+        OS << (First ? "" : ",\n");
+        First = false;
+
+        OS << "{\"name\": \"" << E.Name << "\", \"cat\": \"mixed\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1"
+           << llvm::format(", \"ts\": %.3f, \"dur\": %.3f", E.Start / 1e3, E.Duration / 1e3)
+           << ", \"args\": {";
+
+        bool FirstArg = true;
+        auto Separator = [&]() -> llvm::raw_ostream & {
+            OS << (FirstArg ? "" : ", ");
+            FirstArg = false;
+            return OS;
+        };
+
+        if (E.Macro) {
+            Separator() << "\"macro\": ";
+            printJSONString(OS, E.Macro->getName());
+        }
+
+        if (E.Loc.isValid()) {
+            PresumedLoc PLoc = SM.getPresumedLoc(SM.getExpansionLoc(E.Loc));
+            if (!PLoc.isInvalid()) {
+                std::string Location;
+                llvm::raw_string_ostream LocationOS(Location);
+                LocationOS << PLoc.getFilename() << ":" << PLoc.getLine() << ":" << PLoc.getColumn();
+
+                Separator() << "\"loc\": ";
+                printJSONString(OS, LocationOS.str());
+            }
+        }
+
+        if (E.TokensIn >= 0) {
+            Separator() << "\"tokens_in\": " << E.TokensIn;
+        }
+        if (E.TokensOut >= 0) {
+            Separator() << "\"tokens_out\": " << E.TokensOut;
+        }
+
+        OS << "}}";
+    }
+
+    OS << "\n]}\n";
+}
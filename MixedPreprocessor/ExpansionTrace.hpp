@@ -0,0 +1,101 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_EXPANSIONTRACE_HPP
+#define MIXED_PREPROCESSOR_EXPANSIONTRACE_HPP
+
+
+#include "clang/Basic/IdentifierTable.h"
+#include "clang/Basic/SourceLocation.h"
+#include "clang/Basic/SourceManager.h"
+
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+using namespace clang;
+
+
+// Nested spans of one MixedComputations, written as Chrome trace events.
+//
+// Events are buffered in memory and only formatted by write: a span costs
+// two clock reads and a vector append.  Like MacroStatistics, the engine
+// only holds a pointer to the trace, null unless tracing was asked for.
+class ExpansionTrace {
+public:
+    struct Event {
+        const char *Name;
+        const IdentifierInfo *Macro;
+        SourceLocation Loc;
+        uint64_t Start;
+        uint64_t Duration;
+        // Negative if not applicable.
+        int64_t TokensIn;
+        int64_t TokensOut;
+    };
+
+private:
+    std::vector<Event> Events;
+    std::chrono::steady_clock::time_point Origin;
+
+    uint64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - Origin).count();
+    }
+
+public:
+    ExpansionTrace();
+
+    size_t begin(const char *Name, const IdentifierInfo *Macro, SourceLocation Loc);
+
+    // With KeepLeaf unset, a span without nested spans is dropped.
+    void end(size_t Index, bool KeepLeaf);
+
+    Event & get(size_t Index) { return Events[Index]; }
+
+    void write(llvm::raw_ostream &OS, SourceManager &SM) const;
+};
+
+
+// Records a span of Trace, if not null, for its lifetime.
+class TraceSpan {
+    ExpansionTrace *Trace;
+    size_t Index;
+    bool KeepLeaf;
+
+public:
+    TraceSpan(ExpansionTrace *Trace, const char *Name, const IdentifierInfo *Macro = nullptr,
+              SourceLocation Loc = SourceLocation(), bool KeepLeaf = true) :
+            Trace(Trace), Index(0), KeepLeaf(KeepLeaf) {
+        if (Trace) {
+            Index = Trace->begin(Name, Macro, Loc);
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan & operator=(const TraceSpan &) = delete;
+
+    ~TraceSpan() {
+        if (Trace) {
+            Trace->end(Index, KeepLeaf);
+        }
+    }
+
+    void setTokensIn(size_t N) {
+        if (Trace) {
+            Trace->get(Index).TokensIn = N;
+        }
+    }
+
+    void setTokensOut(size_t N) {
+        if (Trace) {
+            Trace->get(Index).TokensOut = N;
+        }
+    }
+};
+
+
+#endif //MIXED_PREPROCESSOR_EXPANSIONTRACE_HPP
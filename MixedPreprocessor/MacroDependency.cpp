@@ -3,48 +3,60 @@
 
 
 #include "MacroDependency.hpp"
+#include "MixedComputations.hpp"
 
 
-void MacroDependency::AddDependencies(const MacroInfo *MI, const std::unordered_set<const MacroInfo *> &dependency) {
-    if (graph_to.find(MI) != graph_to.end()) {
-        graph_to[MI].insert(dependency.begin(), dependency.end());
-    } else {
-        graph_to[MI] = dependency;
-    }
+void MacroDependency::AddDependencies(
+        const MacroInfo *MI,
+        ExpansionCache::Dependencies_t::const_iterator Begin,
+        ExpansionCache::Dependencies_t::const_iterator End) {
+    DeleteDependencies(MI);
 
-	for (const auto &to : graph_to[MI]) {
-		graph_from[to].insert(MI);
-	}
+    graph_to[MI].assign(Begin, End);
+
+    for (const auto &to : graph_to[MI]) {
+        graph_from[to].insert(MI);
+    }
 }
 
-void MacroDependency::DeleteDependencies(const MacroInfo *MI){
-    if (graph_to.find(MI) != graph_to.end()) {
-        for (const auto &to : graph_to[MI]) {
-            graph_from[to].erase(MI);
+void MacroDependency::DeleteDependencies(const MacroInfo *MI) {
+    auto It = graph_to.find(MI);
+    if (It == graph_to.end()) {
+        return;
+    }
+
+    for (const auto &to : It->second) {
+        auto From = graph_from.find(to);
+        From->second.erase(MI);
+        if (From->second.empty()) {
+            graph_from.erase(From);
         }
     }
+
+    graph_to.erase(It);
 }
 
-void MacroDependency::PreprocessDependent(const MacroInfo *MI, std::unordered_set<const MacroInfo *> &updated) {
-	updated.insert(MI);
+const ExpansionCache::Dependencies_t & MacroDependency::getDependencies(const MacroInfo *MI) {
+    return graph_to[MI];
+}
 
-    /*
+void MacroDependency::Remove(const MacroInfo *MI) {
     DeleteDependencies(MI);
-    if (MC.isDefined(MI)) {
-        AddDependencies(MI, MC.Preprocess(MI));
-    }
-     */
-
-	for (auto const &from : graph_from[MI]) {
-		if (updated.find(from) == updated.end()) {
-            PreprocessDependent(from, updated);
-		}
-	}
 }
 
-void MacroDependency::Update(const MacroInfo *MI) {
+void MacroDependency::Update(const IdentifierInfo *II) {
+    auto It = graph_from.find(II);
+    if (It == graph_from.end()) {
+        return;
+    }
+
+    // Dependencies are transitively closed, the direct dependents are all
+    // there is to update.
     std::unordered_set<const MacroInfo *> updated;
-    PreprocessDependent(MI, updated);
-    updated.clear();
-    //ComputeDependent(MI, updated);
+    updated.swap(It->second);
+
+    for (const auto &from : updated) {
+        DeleteDependencies(from);
+        MC.DropPreComputed(from);
+    }
 }
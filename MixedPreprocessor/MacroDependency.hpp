@@ -6,8 +6,9 @@
 #define MIXED_PREPROCESSOR_MACRODEPENDENCY_HPP
 
 
-#include "MixedComputations.hpp"
+#include "ExpansionCache.hpp"
 
+#include "clang/Basic/IdentifierTable.h"
 #include "clang/Lex/MacroInfo.h"
 
 #include <unordered_map>
@@ -19,21 +20,36 @@ using namespace clang;
 class MixedComputations;
 
 
+// Dependencies of PreComputed bodies on macro names.
+//
+// graph_to holds, for every PreComputed macro, the identifiers whose
+// definitions were consulted while its body was computed, the ones consulted
+// by the macros it expanded included.  The set is therefore transitively
+// closed, and the dependents of a name in graph_from are all the bodies that
+// have to be recomputed once the name is (re)defined.
 class MacroDependency {
-	MixedComputations &MC;
+    MixedComputations &MC;
 
-    std::unordered_map<const MacroInfo *, std::unordered_set<const MacroInfo *>> graph_to;
-    std::unordered_map<const MacroInfo *, std::unordered_set<const MacroInfo *>> graph_from;
+    std::unordered_map<const MacroInfo *, ExpansionCache::Dependencies_t> graph_to;
+    std::unordered_map<const IdentifierInfo *, std::unordered_set<const MacroInfo *>> graph_from;
 
-	void AddDependencies(const MacroInfo *MI, const std::unordered_set<const MacroInfo *> &dependency);
-	void DeleteDependencies(const MacroInfo *MI);
-
-	void PreprocessDependent(const MacroInfo *MI, std::unordered_set<const MacroInfo *> &updated);
+    void DeleteDependencies(const MacroInfo *MI);
 
 public:
     MacroDependency(MixedComputations &MC) : MC(MC) {}
 
-	void Update(const MacroInfo *MI);
+    void AddDependencies(
+            const MacroInfo *MI,
+            ExpansionCache::Dependencies_t::const_iterator Begin,
+            ExpansionCache::Dependencies_t::const_iterator End);
+
+    const ExpansionCache::Dependencies_t & getDependencies(const MacroInfo *MI);
+
+    // Drops MI from the graph, its dependents are not affected.
+    void Remove(const MacroInfo *MI);
+
+    // Invalidates the PreComputed bodies of every macro depending on II.
+    void Update(const IdentifierInfo *II);
 };
 
 
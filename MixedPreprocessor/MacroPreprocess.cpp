@@ -5,311 +5,519 @@
 #include "MixedComputations.hpp"
 
 #include "clang/Lex/LexDiagnostic.h"
+#include "clang/Lex/MacroArgs.h"
 
+#include <cstdint>
+#include <iterator>
 
 
-MixedToken_ptr_t NextToken(std::vector<MixedToken_ptr_t>::const_iterator TokenIt,
-                           const std::list<MixedToken_ptr_t> &List,
-                           std::list<MixedToken_ptr_t>::iterator ListIt) {
-    if (List.end() == std::next(ListIt)) {
-        return *TokenIt;
+
+static void TrimEof(std::vector<MixedToken> &Tokens) {
+    while (!Tokens.empty() && Tokens.back().isOneOf(tok::eof, tok::eod)) {
+        Tokens.pop_back();
     }
-    return *std::next(ListIt);
 }
 
-void EraseNextToken(std::vector<MixedToken_ptr_t>::const_iterator &TokenIt,
-                    std::list<MixedToken_ptr_t> &List,
-                    std::list<MixedToken_ptr_t>::iterator ListIt) {
-    if (List.end() == std::next(ListIt)) {
-        ++TokenIt;
-    } else {
-        List.erase(std::next(ListIt));
+
+MixedComputations::BodyShape MixedComputations::ClassifyBody(const std::vector<MixedToken> &Body) {
+    // A body cut short by an unbalanced parenthesis is left to Preprocess.
+    if (Body.empty() || Body.back().isNot(tok::eof)) {
+        return BS_Rescan;
     }
-}
 
+    bool HasArgs = false;
+    bool HasPastes = false;
+    bool NeedsRescan = false;
+    unsigned NumParens = 0;
 
-std::vector<MixedToken_ptr_t> MixedComputations::Preprocess(
-        const MacroInfo *MI,
-        std::vector<MixedToken_ptr_t>::const_iterator &TokenIt,
-        MixedMacroArgs &MA,
-        const std::unordered_set<const MacroInfo *> &ExpansionStack,
-        bool inArgument) {
-    assert(!MI || isDefined(MI));
+    for (auto &Tok : Body) {
+        if (Tok.getKind() == MixedToken::MTK_Arg) {
+            HasArgs = true;
+        } else if (Tok.isStringify()) {
+            NeedsRescan = true;
+        } else if (Tok.is(tok::hashhash)) {
+            HasPastes = true;
+        } else if (Tok.is(tok::hash) || Tok.is(tok::hashat)) {
+            NeedsRescan = true;
+        } else if (Tok.is(tok::l_paren)) {
+            ++NumParens;
+        } else if (Tok.is(tok::r_paren)) {
+            if (!NumParens) {
+                NeedsRescan = true;
+            } else {
+                --NumParens;
+            }
+        } else if (Tok.isAnyIdentifier() && !Tok.getTok().isExpandDisabled() &&
+                   getMacroInfo(Tok.getIdentifierInfo())) {
+            NeedsRescan = true;
+        }
+    }
 
-    std::list<MixedToken_ptr_t> res;
-    std::list<MixedToken_ptr_t>::iterator to_proceed = res.begin();
+    if (HasPastes) {
+        return BS_Paste;
+    } else if (NeedsRescan) {
+        return BS_Rescan;
+    }
+    return HasArgs ? BS_Substitution : BS_Constant;
+}
 
+bool MixedComputations::SubstituteArgs(
+        const std::vector<MixedToken> &Body, MixedMacroArgs &MA, std::vector<MixedToken> &Result) {
     unsigned NumParens = 0;
 
-    while (1) {
-        if (to_proceed == res.end()) {
-            to_proceed = res.insert(res.end(), *(TokenIt++));
-        }
+    for (auto &Tok : Body) {
+        if (Tok.getKind() != MixedToken::MTK_Arg) {
+            assert(!Tok.isStringify());
 
-        if ((*to_proceed)->isOneOf(tok::eof, tok::eof)) {
-            break;
+            if (Tok.is(tok::l_paren)) {
+                ++NumParens;
+            } else if (Tok.is(tok::r_paren)) {
+                // Closes a parenthesis opened by an argument.
+                if (!NumParens) {
+                    return false;
+                }
+                --NumParens;
+            }
+            Result.push_back(Tok);
+            continue;
         }
 
-        if (!(*to_proceed)->isCommonToken() && (*to_proceed)->isExpanded()) {
-            std::vector<MixedToken_ptr_t> Expanded = (*to_proceed)->getExpanded(MA);
+        const std::vector<MixedToken> &Expanded = MA.getExpanded(Tok.getArgNum(), Tok.getExpansionStack());
 
-            while (!Expanded.empty() && (*Expanded.back()).isOneOf(tok::eof, tok::eod)) {
-                Expanded.pop_back();
-            }
+        // The same checks as ClassifyBody, Preprocess would rescan them.
+        auto End = Expanded.end();
+        while (End != Expanded.begin() && std::prev(End)->isOneOf(tok::eof, tok::eod)) {
+            --End;
+        }
 
-            if (Expanded.size() == 0) {
-                auto Next = std::next(to_proceed);
-                res.erase(to_proceed);
-                to_proceed = Next;
-            } else {
-                auto Next = res.insert(to_proceed, Expanded.begin(), Expanded.end());
-                res.erase(to_proceed);
-                to_proceed = Next;
+        for (auto It = Expanded.begin(); It != End; ++It) {
+            if (!It->isCommonToken()) {
+                if (It->isExpanded()) {
+                    return false;
+                }
+            } else if (It->is(tok::hashhash) || It->is(tok::hash) || It->is(tok::hashat)) {
+                return false;
+            } else if (It->is(tok::l_paren)) {
+                ++NumParens;
+            } else if (It->is(tok::r_paren)) {
+                if (!NumParens) {
+                    return false;
+                }
+                --NumParens;
+            } else if (It->isAnyIdentifier()) {
+                IdentifierInfo *II = It->getIdentifierInfo();
+                Dependencies.push_back(II);
+                if (!It->getTok().isExpandDisabled() && getMacroInfo(II)) {
+                    return false;
+                }
             }
+        }
 
-            continue;
+        Result.insert(Result.end(), Expanded.begin(), End);
+    }
+
+    return true;
+}
+
+bool MixedComputations::PreprocessStep(
+        const MacroInfo *MI,
+        TokenRewriter &Tokens,
+        MixedMacroArgs &MA,
+        ExpansionStack_id_t ExpansionStack,
+        bool inArgument,
+        unsigned &NumParens) {
+    MixedToken Curr = Tokens.peek();
+
+    if (Curr.isOneOf(tok::eof, tok::eod)) {
+        return false;
+    }
+
+    if (!Curr.isCommonToken() && Curr.isExpanded()) {
+        // The left operand of ## is not expanded.
+        if (Tokens.peek(1).is(tok::hashhash)) {
+            Tokens.advance();
+            return true;
         }
 
-        if ((*to_proceed)->is(tok::l_paren)) {
-            ++NumParens;
-        } else if ((*to_proceed)->is(tok::r_paren)) {
-            if (!NumParens) {
-                break;
+        if (Curr.getKind() == MixedToken::MTK_Arg) {
+            const std::vector<MixedToken> *Expanded = MA.findExpanded(Curr.getArgNum(), Curr.getExpansionStack());
+            if (!Expanded) {
+                // Scanned again once the argument is expanded.
+                pushArgExpansion(MA, Curr.getArgNum(), Curr.getExpansionStack());
+                return true;
             }
 
-            --NumParens;
-        } else if ((*to_proceed)->is(tok::comma)) {
-            if (!NumParens && inArgument) {
-                break;
+            auto End = Expanded->end();
+            while (End != Expanded->begin() && std::prev(End)->isOneOf(tok::eof, tok::eod)) {
+                --End;
             }
+
+            Tokens.take();
+            Tokens.push(Expanded->data(), Expanded->data() + (End - Expanded->begin()));
+
+            return true;
         }
 
-        if ((*to_proceed)->isAnyIdentifier() /*&& (*to_proceed)->isExpanded()*/) {
-            if (NextToken(TokenIt, res, to_proceed)->is(tok::hashhash)) {
-                continue;
-            }
+        std::vector<MixedToken> Expanded = Curr.getExpanded(MA);
+        TrimEof(Expanded);
 
-            IdentifierInfo *II = (*to_proceed)->getIdentifierInfo();
+        Tokens.take();
+        Tokens.push(Expanded.data(), Expanded.data() + Expanded.size());
 
-            // If this is a macro to be expanded, do it.
-            if (MacroInfo *currMI = PP.getMacroInfo(II)) {
-                if (/*!to_proceed->isExpandDisabled() &&*/ currMI->isEnabled()) {
-                    // C99 6.10.3p10: If the preprocessing token immediately after the
-                    // macro name isn't a '(', this macro should not be expanded.
-                    if (!currMI->isFunctionLike() || NextToken(TokenIt, res, to_proceed)->is(tok::l_paren)) {
+        return true;
+    }
 
-                        CommonToken *TokPtr = reinterpret_cast<CommonToken *>(to_proceed->get());
+    if (Curr.is(tok::l_paren)) {
+        ++NumParens;
+    } else if (Curr.is(tok::r_paren)) {
+        if (!NumParens) {
+            return false;
+        }
 
-                        std::vector<MixedToken_ptr_t> Expanded = ExpandMacro(
-                                TokPtr->getTok(), currMI, TokenIt, ExpansionStack, MI, MA);
+        --NumParens;
+    } else if (Curr.is(tok::comma)) {
+        if (!NumParens && inArgument) {
+            return false;
+        }
+    }
 
-                        while (!Expanded.empty() && Expanded.back()->isOneOf(tok::eof, tok::eod)) {
-                            Expanded.pop_back();
-                        }
+    if (Curr.isAnyIdentifier() /*&& Curr.isExpanded()*/) {
+        // The left operand of ## is not expanded, nor is an argument being
+        // collected: it is expanded on use by MixedMacroArgs, and # or ##
+        // there take it as written.
+        if (inArgument || Tokens.peek(1).is(tok::hashhash)) {
+            Tokens.advance();
+            return true;
+        }
 
-                        auto Next = res.insert(to_proceed, Expanded.begin(), Expanded.end());
+        IdentifierInfo *II = Curr.getIdentifierInfo();
+        Dependencies.push_back(II);
+
+        // If this is a macro to be expanded, do it.
+        MacroInfo *currMI = getMacroInfo(II);
+        if (currMI && !Curr.getTok().isExpandDisabled()) {
+            if (ExpansionStacks.contains(ExpansionStack, currMI) || !currMI->isEnabled()) {
+                // C99 6.10.3.4p2 says that a disabled macro may never again be
+                // expanded, even if it's in a context where it could be expanded in the
+                // future.
+                if (currMI->isObjectLike() || Tokens.peek(1).is(tok::l_paren))
+                    PP.Diag(Curr.getTok(), diag::pp_disabled_macro_expansion);
+
+                MixedToken Disabled = Tokens.take();
+                Disabled.setExpandDisabled();
+                Tokens.emit(Disabled);
+                return true;
+            }
 
-                        res.erase(to_proceed);
-                        to_proceed = Next;
+            // C99 6.10.3.1: arguments are substituted before the rescan, so
+            // the '(' may come from the argument after the name.  It is
+            // substituted first, the name is scanned again in front of it.
+            MixedToken Next = Tokens.peek(1);
+            if (currMI->isFunctionLike() && Next.getKind() == MixedToken::MTK_Arg && Next.isExpanded() &&
+                Tokens.peek(2).isNot(tok::hashhash)) {
+                unsigned ArgNum = Next.getArgNum();
+                ExpansionStack_id_t ArgExpansionStack = Next.getExpansionStack();
+
+                const std::vector<MixedToken> *Expanded = MA.findExpanded(ArgNum, ArgExpansionStack);
+                if (!Expanded) {
+                    // Scanned again once the argument is expanded.
+                    pushArgExpansion(MA, ArgNum, ArgExpansionStack);
+                    return true;
+                }
 
-                        continue;
-                    }
-                } else {
-                    // C99 6.10.3.4p2 says that a disabled macro may never again be
-                    // expanded, even if it's in a context where it could be expanded in the
-                    // future.
-                    /*
-                    to_proceed->setFlag(Token::DisableExpand);
-                    if (currMI->isObjectLike() || isNextPPTokenLParen())
-                        PP.Diag(*to_proceed, diag::pp_disabled_macro_expansion);
-                    */
+                auto End = Expanded->end();
+                while (End != Expanded->begin() && std::prev(End)->isOneOf(tok::eof, tok::eod)) {
+                    --End;
                 }
+
+                MixedToken Name = Tokens.take();
+                Tokens.take();
+                Tokens.push(Expanded->data(), Expanded->data() + (End - Expanded->begin()));
+                Tokens.push(Name);
+                return true;
             }
 
-            // to_proceed->setFlag(Token::DisableExpand);
-            ++to_proceed;
-        } else if ((*to_proceed)->is(tok::hash) || (*to_proceed)->is(tok::hashat)) {
-            assert(false && "Stringify and Charify are not supported");
-        } else if ((*to_proceed)->is(tok::hashhash)) {
-            if (to_proceed == res.begin() || NextToken(TokenIt, res, to_proceed)->isOneOf(tok::eof, tok::eof)) {
-                // ill-formed, ignore hashhash
-                ++to_proceed;
-                continue;
+            // C99 6.10.3p10: If the preprocessing token immediately after the
+            // macro name isn't a '(', this macro should not be expanded.
+            if (!currMI->isFunctionLike() || Next.is(tok::l_paren)) {
+                // The result is pushed back to Tokens and scanned again.
+                Tokens.take();
+                pushExpansion(Curr.getTok(), currMI, Tokens, ExpansionStack, MI, MA, false, nullptr);
+
+                return true;
             }
+        }
+
+        Tokens.advance();
+    } else if (Curr.is(tok::hash) || Curr.is(tok::hashat)) {
+        // Only an operator before a parameter of a function-like macro body.
+        const MixedToken &Param = Tokens.peek(1);
+        if (!MI || !MI->isFunctionLike() || Param.getKind() != MixedToken::MTK_Arg || !Param.isExpanded()) {
+            Tokens.advance();
+            return true;
+        }
+
+        unsigned ArgNum = Param.getArgNum();
+        MixedToken Hash = Tokens.take();
+        Tokens.take();
+
+        MixedToken Stringified = MA.getStringified(ArgNum, Hash.is(tok::hashat));
+        Stringified.setSpacing(Hash.getSpacing());
+
+        // Scanned again, it may be an operand of ##.
+        Tokens.push(Stringified);
+    } else if (Curr.is(tok::hashhash)) {
+        if (!Tokens.hasOutput() || Tokens.peek(1).isOneOf(tok::eof, tok::eod)) {
+            // ill-formed, ignore hashhash
+            Tokens.advance();
+            return true;
+        }
 
-            std::vector<MixedToken_ptr_t> left = (*std::prev(to_proceed))->getUnexpanded(MA);
-            std::vector<MixedToken_ptr_t> right = NextToken(TokenIt, res, to_proceed)->getUnexpanded(MA);
+        MixedToken HashHash = Tokens.take();
 
-            res.erase(std::prev(to_proceed));
-            EraseNextToken(TokenIt, res, to_proceed);
+        std::vector<MixedToken> Left = Tokens.popOutput().getUnexpanded(MA);
+        std::vector<MixedToken> Right = Tokens.take().getUnexpanded(MA);
 
-            res.insert(to_proceed, left.begin(), left.end());
-            res.insert(std::next(to_proceed), right.begin(), right.end());
+        TrimEof(Left);
+        TrimEof(Right);
 
+        Tokens.emit(Left.data(), Left.data() + Left.size());
+        Tokens.push(Right.data(), Right.data() + Right.size());
 
+        // An empty operand is a placemarker: the other one is left as is.
+        if (Left.empty() || Right.empty()) {
+            return true;
+        }
 
-            if (to_proceed != res.begin() &&
-                    (*std::prev(to_proceed))->isCommonToken() &&
-                     (*std::next(to_proceed))->isCommonToken()) {
-                CommonToken *LHS = reinterpret_cast<CommonToken *>(std::prev(to_proceed)->get());
-                CommonToken *RHS = reinterpret_cast<CommonToken *>(std::next(to_proceed)->get());
+        if (Tokens.lastOutput().isCommonToken() && Tokens.peek().isCommonToken()) {
+            MixedToken LHS = Tokens.popOutput();
+            MixedToken RHS = Tokens.take();
 
-                Token Tok;
+            Token Tok = LHS.getTok();
 
-                // TODO: Result might be meaningful
-                PasteTokens(LHS->getTok(), RHS->getTok(), Tok);
+            if (MacroCounters *Counters = getCounters(MI)) {
+                ++Counters->Pastes;
+            }
 
-                res.erase(std::prev(to_proceed));
-                res.erase(std::next(to_proceed));
+            bool Failed;
+            {
+                TraceSpan PasteSpan(Trace, "PasteTokens", nullptr, LHS.getTok().getLocation());
+                Failed = PasteTokens(LHS.getTok(), RHS.getTok(), Tok);
+            }
 
-                if (Tok.isAnyIdentifier()) {
-                    *to_proceed = std::make_shared<IdentifierArgToken>(Tok, false, ExpansionStack);
+            if (Failed) {
+                // The operands stay apart, RHS is scanned again, as a
+                // possible operand of the next ##, and so is LHS if it may
+                // name a macro.
+                Tokens.push(RHS);
+                if (LHS.getKind() == MixedToken::MTK_Identifier) {
+                    Tokens.push(LHS);
                 } else {
-                    *to_proceed = std::make_shared<CommonToken>(Tok, false);
+                    Tokens.emit(LHS);
                 }
-            } else {
-                ++to_proceed;
-                ++to_proceed;
+                return true;
             }
 
+            // The result is scanned again.
+            if (Tok.isAnyIdentifier()) {
+                Tokens.push(MixedToken::createIdentifier(Tok, false, ExpansionStack));
+            } else {
+                Tokens.push(MixedToken::createCommon(Tok, false));
+            }
         } else {
-            ++to_proceed;
+            Tokens.emit(HashHash);
+            Tokens.advance();
         }
+
+    } else {
+        Tokens.advance();
     }
 
-    return std::vector<MixedToken_ptr_t>(res.begin(), res.end());
+    return true;
 }
 
-// PasteTokens - Tok is the LHS of a ## operator, and CurToken is the ##
-/// operator.  Read the ## and RHS, and paste the LHS/RHS together. Return the result as Tok.
-/// If this returns true, the caller should immediately return the token.
-bool MixedComputations::PasteTokens(const Token &LHS, const Token &RHS, Token &Tok) {
-    SmallString<128> Buffer;
-    const char *ResultTokStrPtr = nullptr;
-    // SourceLocation StartLoc = LHS.getLocation();
-    SourceLocation PasteOpLoc;
+std::vector<MixedToken> MixedComputations::Preprocess(
+        const MacroInfo *MI,
+        TokenRewriter &Tokens,
+        MixedMacroArgs &MA,
+        ExpansionStack_id_t ExpansionStack,
+        bool inArgument) {
+    assert(!MI || isDefined(MI));
+
+    TraceSpan Span(Trace, "Preprocess", MI ? getMacroName(MI) : nullptr);
+
+    unsigned NumParens = 0;
+    size_t Base = Depth;
+    while (PreprocessStep(MI, Tokens, MA, ExpansionStack, inArgument, NumParens)) {
+        RunFrames(Base);
+    }
+
+    std::vector<MixedToken> Result = Tokens.finish();
+    Span.setTokensOut(Result.size() - 1);
+    return Result;
+}
 
-    // Consume the ## operator if any.
-    PasteOpLoc = LHS.getLocation();
+MixedToken MixedComputations::Stringify(const std::vector<MixedToken> &Operand, bool Charify) {
+    auto End = Operand.end();
+    while (End != Operand.begin() && std::prev(End)->isOneOf(tok::eof, tok::eod)) {
+        --End;
+    }
+
+    std::vector<Token> Toks;
+    Toks.reserve(End - Operand.begin() + 1);
+
+    for (auto It = Operand.begin(); It != End; ++It) {
+        if (!It->isCommonToken()) {
+            // Known once the macro the operand was collected in is applied.
+            StringifySequences.emplace_back(Operand.begin(), End);
+            Memory.add(MemoryAccounting::MS_StringifySequences,
+                       sizeof(StringifySequences.back()) + getVectorBytes(StringifySequences.back()));
+            return MixedToken::createStringifySequence(StringifySequences.size() - 1, Charify);
+        }
+        Toks.push_back(It->getTok());
+    }
+    Toks.push_back(EofToken.getTok());
+
+    Token Tok = MacroArgs::StringifyArgument(Toks.data(), PP, Charify, SourceLocation(), SourceLocation());
+    return MixedToken::createCommon(Tok, false);
+}
 
-    // Allocate space for the result token.  This is guaranteed to be enough for
-    // the two tokens.
-    Buffer.resize(RHS.getLength() + RHS.getLength());
+// PasteTokens - Paste LHS and RHS together into Tok, which takes the
+/// whitespace flags of LHS.  Returns true if they do not form a single token,
+/// which is diagnosed, or if a spelling could not be read.  Tok is then left
+/// unmodified and, as clang does, both operands are kept apart.
+bool MixedComputations::PasteTokens(const Token &LHS, const Token &RHS, Token &Tok) {
+    SourceLocation PasteOpLoc = LHS.getLocation();
 
-    // Get the spelling of the LHS token in Buffer.
-    const char *BufPtr = &Buffer[0];
+    // The key is the length of the LHS spelling followed by both spellings,
+    // so its tail is the pasted spelling.
+    SmallString<64> LHSBuffer;
+    SmallString<64> RHSBuffer;
     bool Invalid = false;
-    unsigned LHSLen = PP.getSpelling(LHS, BufPtr, &Invalid);
-    if (BufPtr != &Buffer[0])   // Really, we want the chars in Buffer!
-        memcpy(&Buffer[0], BufPtr, LHSLen);
+
+    StringRef LHSSpelling = PP.getSpelling(LHS, LHSBuffer, &Invalid);
     if (Invalid)
         return true;
-
-    BufPtr = Buffer.data() + LHSLen;
-    unsigned RHSLen = PP.getSpelling(RHS, BufPtr, &Invalid);
+    StringRef RHSSpelling = PP.getSpelling(RHS, RHSBuffer, &Invalid);
     if (Invalid)
         return true;
-    if (RHSLen && BufPtr != &Buffer[LHSLen])
-        // Really, we want the chars in Buffer!
-        memcpy(&Buffer[LHSLen], BufPtr, RHSLen);
-
-    // Trim excess space.
-    Buffer.resize(LHSLen+RHSLen);
-
-    // Plop the pasted result (including the trailing newline and null) into a
-    // scratch buffer where we can lex it.
-    Token ResultTokTmp;
-    ResultTokTmp.startToken();
-
-    // Claim that the tmp token is a string_literal so that we can get the
-    // character pointer back from CreateString in getLiteralData().
-    ResultTokTmp.setKind(tok::string_literal);
-    PP.CreateString(Buffer, ResultTokTmp);
-    SourceLocation ResultTokLoc = ResultTokTmp.getLocation();
-    ResultTokStrPtr = ResultTokTmp.getLiteralData();
-
-    // Lex the resultant pasted token into Result.
-    Token Result;
 
-    if (LHS.isAnyIdentifier() && RHS.isAnyIdentifier()) {
-        // Common paste case: identifier+identifier = identifier.  Avoid creating
-        // a lexer and other overhead.
-        PP.IncrementPasteCounter(true);
-        Result.startToken();
-        Result.setKind(tok::raw_identifier);
-        Result.setRawIdentifierData(ResultTokStrPtr);
-        Result.setLocation(ResultTokLoc);
-        Result.setLength(LHSLen+RHSLen);
-    } else {
-        PP.IncrementPasteCounter(false);
+    uint32_t LHSLen = LHSSpelling.size();
 
-        assert(ResultTokLoc.isFileID() &&
-               "Should be a raw location into scratch buffer");
-        SourceManager &SourceMgr = PP.getSourceManager();
-        FileID LocFileID = SourceMgr.getFileID(ResultTokLoc);
+    SmallString<128> Key;
+    Key.append(reinterpret_cast<const char *>(&LHSLen), reinterpret_cast<const char *>(&LHSLen + 1));
+    Key.append(LHSSpelling.begin(), LHSSpelling.end());
+    Key.append(RHSSpelling.begin(), RHSSpelling.end());
 
-        bool Invalid = false;
-        const char *ScratchBufStart
-                = SourceMgr.getBufferData(LocFileID, &Invalid).data();
-        if (Invalid)
-            return false;
+    StringRef Buffer = Key.str().drop_front(sizeof(LHSLen));
+
+    bool isIdentifierPaste = LHS.isAnyIdentifier() && RHS.isAnyIdentifier();
+    PP.IncrementPasteCounter(isIdentifierPaste);
 
-        // Make a lexer to lex this string from.  Lex just this one token.
-        // Make a lexer object so that we lex and expand the paste result.
-        Lexer TL(SourceMgr.getLocForStartOfFile(LocFileID),
-                 PP.getLangOpts(), ScratchBufStart,
-                 ResultTokStrPtr, ResultTokStrPtr+LHSLen+RHSLen);
-
-        // Lex a token in raw mode.  This way it won't look up identifiers
-        // automatically, lexing off the end will return an eof token, and
-        // warnings are disabled.  This returns true if the result token is the
-        // entire buffer.
-        bool isInvalid = !TL.LexFromRawLexer(Result);
-
-        // If we got an EOF token, we didn't form even ONE token.  For example, we
-        // did "/ ## /" to get "//".
-        isInvalid |= Result.is(tok::eof);
-
-        // If pasting the two tokens didn't form a full new token, this is an
-        // error.  This occurs with "x ## +"  and other stuff.  Return with Tok
-        // unmodified and with RHS as the next token to lex.
-        if (isInvalid) {
-            // Explicitly convert the token location to have proper expansion
-            // information so that the user knows where it came from.
-            SourceManager &SM = PP.getSourceManager();
-            SourceLocation Loc =
-                    SM.createExpansionLoc(PasteOpLoc, LHS.getLocation(), RHS.getLocation(), 2);
-
-            // Do not emit the error when preprocessing assembler code.
-            if (!PP.getLangOpts().AsmPreprocessor) {
-                // If we're in microsoft extensions mode, downgrade this from a hard
-                // error to an extension that defaults to an error.  This allows
-                // disabling it.
-                PP.Diag(Loc, PP.getLangOpts().MicrosoftExt ? diag::ext_pp_bad_paste_ms
-                                                           : diag::err_pp_bad_paste)
-                << Buffer;
+    Token Result;
+
+    auto It = PastedTokens.find(Key);
+    if (It != PastedTokens.end()) {
+        Result = It->second;
+    } else {
+        // Plop the pasted result into a scratch buffer where we can lex it.
+        // Once per distinct paste: the result is cached with its location.
+        Token ResultTokTmp;
+        ResultTokTmp.startToken();
+
+        // Claim that the tmp token is a string_literal so that we can get the
+        // character pointer back from CreateString in getLiteralData().
+        ResultTokTmp.setKind(tok::string_literal);
+        PP.CreateString(Buffer, ResultTokTmp);
+        SourceLocation ResultTokLoc = ResultTokTmp.getLocation();
+        const char *ResultTokStrPtr = ResultTokTmp.getLiteralData();
+
+        if (isIdentifierPaste) {
+            // Common paste case: identifier+identifier = identifier.  Avoid
+            // creating a lexer and other overhead.
+            Result.startToken();
+            Result.setKind(tok::raw_identifier);
+            Result.setRawIdentifierData(ResultTokStrPtr);
+            Result.setLocation(ResultTokLoc);
+            Result.setLength(Buffer.size());
+        } else {
+            assert(ResultTokLoc.isFileID() &&
+                   "Should be a raw location into scratch buffer");
+            SourceManager &SourceMgr = PP.getSourceManager();
+            FileID LocFileID = SourceMgr.getFileID(ResultTokLoc);
+
+            const char *ScratchBufStart
+                    = SourceMgr.getBufferData(LocFileID, &Invalid).data();
+            if (Invalid)
+                return true;
+
+            // Make a lexer to lex this string from.  Lex just this one token.
+            Lexer TL(SourceMgr.getLocForStartOfFile(LocFileID),
+                     PP.getLangOpts(), ScratchBufStart,
+                     ResultTokStrPtr, ResultTokStrPtr + Buffer.size());
+
+            // Lex a token in raw mode.  This way it won't look up identifiers
+            // automatically, lexing off the end will return an eof token, and
+            // warnings are disabled.  This returns true if the result token is the
+            // entire buffer.
+            bool isInvalid = !TL.LexFromRawLexer(Result);
+
+            // If we got an EOF token, we didn't form even ONE token.  For example, we
+            // did "/ ## /" to get "//".
+            isInvalid |= Result.is(tok::eof);
+
+            // If pasting the two tokens didn't form a full new token, this is an
+            // error.  This occurs with "x ## +"  and other stuff.  It is diagnosed
+            // again every time, so it is not cached.
+            if (isInvalid) {
+                // Explicitly convert the token location to have proper expansion
+                // information so that the user knows where it came from.
+                SourceLocation Loc =
+                        SourceMgr.createExpansionLoc(PasteOpLoc, LHS.getLocation(), RHS.getLocation(), 2);
+
+                // Do not emit the error when preprocessing assembler code.
+                if (!PP.getLangOpts().AsmPreprocessor) {
+                    // If we're in microsoft extensions mode, downgrade this from a hard
+                    // error to an extension that defaults to an error.  This allows
+                    // disabling it.
+                    PP.Diag(Loc, PP.getLangOpts().MicrosoftExt ? diag::ext_pp_bad_paste_ms
+                                                               : diag::err_pp_bad_paste)
+                    << Buffer;
+                }
+                return true;
             }
+
+            // Turn ## into 'unknown' to avoid # ## # from looking like a paste
+            // operator.
+            if (Result.is(tok::hashhash))
+                Result.setKind(tok::unknown);
         }
 
-        // Turn ## into 'unknown' to avoid # ## # from looking like a paste
-        // operator.
-        if (Result.is(tok::hashhash))
-            Result.setKind(tok::unknown);
+        // Since token pasting re-lexes the result token in raw mode, identifier
+        // information isn't looked up.  As such, if the result is an
+        // identifier, look up id info, which gives keywords their kind.
+        if (Result.is(tok::raw_identifier)) {
+            PP.LookUpIdentifierInfo(Result);
+        }
+
+        Result.clearFlag(Token::StartOfLine);
+        Result.clearFlag(Token::LeadingSpace);
+        PastedTokens[Key] = Result;
+        Memory.add(MemoryAccounting::MS_PastedTokens, getStringMapEntryBytes(Key.size(), sizeof(Token)));
+    }
+
+    // If this identifier was poisoned and from a paste, emit an error, at
+    // every paste that forms it.
+    if (IdentifierInfo *II = Result.getIdentifierInfo()) {
+        if (II->isPoisoned()) {
+            PP.HandlePoisonedIdentifier(Result);
+        }
     }
 
     // Transfer properties of the LHS over the Result.
-    Result.setFlagValue(Token::StartOfLine , Tok.isAtStartOfLine());
-    Result.setFlagValue(Token::LeadingSpace, Tok.hasLeadingSpace());
+    Result.setFlagValue(Token::StartOfLine , LHS.isAtStartOfLine());
+    Result.setFlagValue(Token::LeadingSpace, LHS.hasLeadingSpace());
 
     Tok = Result;
-
-    // Now that we got the result token, it will be subject to expansion.  Since
-    // token pasting re-lexes the result token in raw mode, identifier information
-    // isn't looked up.  As such, if the result is an identifier, look up id info.
-    if (Tok.is(tok::raw_identifier)) {
-        // Look up the identifier info for the token.  We disabled identifier lookup
-        // by saying we're skipping contents, so we need to do this manually.
-        PP.LookUpIdentifierInfo(Tok);
-    }
     return false;
 }
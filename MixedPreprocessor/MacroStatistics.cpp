@@ -0,0 +1,101 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "MacroStatistics.hpp"
+
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+#include <vector>
+
+
+void printJSONString(llvm::raw_ostream &OS, StringRef String) {
+    OS << '"';
+    for (char C : String) {
+        if (C == '"' || C == '\\') {
+            OS << '\\' << C;
+        } else if (static_cast<unsigned char>(C) < 0x20) {
+            OS << llvm::format("\\u%04x", static_cast<unsigned char>(C));
+        } else {
+            OS << C;
+        }
+    }
+    OS << '"';
+}
+
+
+MacroCounters & MacroStatistics::get(const MacroInfo *MI, StringRef Name) {
+    auto Inserted = Counters.insert(std::make_pair(MI, MacroCounters()));
+    if (Inserted.second) {
+        Inserted.first->second.Name = Name.str();
+    }
+    return Inserted.first->second;
+}
+
+void MacroStatistics::printJSON(llvm::raw_ostream &OS, StringRef File) const {
+    OS << "{\"file\": ";
+    printJSONString(OS, File);
+    OS << ", \"macros\": [";
+
+    bool First = true;
+    for (auto &Entry : Counters) {
+        const MacroCounters &C = Entry.second;
+
+        OS << (First ? "" : ", ") << "{\"name\": ";
+        printJSONString(OS, C.Name);
+        OS << ", \"expansions\": " << C.Expansions
+           << ", \"expansion_ns\": " << C.ExpansionNanoseconds
+           << ", \"precomputes\": " << C.PreComputes
+           << ", \"precomputes_shared\": " << C.PreComputesShared
+           << ", \"precompute_ns\": " << C.PreComputeNanoseconds
+           << ", \"evictions\": " << C.Evictions
+           << ", \"tokens_in\": " << C.TokensIn
+           << ", \"tokens_out\": " << C.TokensOut
+           << ", \"arg_expansions\": " << C.ArgExpansions
+           << ", \"pastes\": " << C.Pastes
+           << ", \"cache_hits\": " << C.CacheHits
+           << ", \"cache_misses\": " << C.CacheMisses << "}";
+
+        First = false;
+    }
+
+    OS << "]}\n";
+}
+
+void MacroStatistics::printTable(llvm::raw_ostream &OS, unsigned TopN) const {
+    std::vector<const MacroCounters *> Sorted;
+    for (auto &Entry : Counters) {
+        Sorted.push_back(&Entry.second);
+    }
+
+    // Most expensive first.
+    std::sort(Sorted.begin(), Sorted.end(), [](const MacroCounters *LHS, const MacroCounters *RHS) {
+        uint64_t LHSTime = LHS->ExpansionNanoseconds + LHS->PreComputeNanoseconds;
+        uint64_t RHSTime = RHS->ExpansionNanoseconds + RHS->PreComputeNanoseconds;
+        if (LHSTime != RHSTime) {
+            return LHSTime > RHSTime;
+        }
+        return LHS->Name < RHS->Name;
+    });
+
+    if (Sorted.size() > TopN) {
+        Sorted.resize(TopN);
+    }
+
+    OS << llvm::format("%-32s %9s %10s %8s %10s %10s %10s %7s %7s %8s %8s\n",
+                       (const char *)"macro", (const char *)"expands", (const char *)"expand ms",
+                       (const char *)"precomp", (const char *)"precomp ms", (const char *)"tokens in",
+                       (const char *)"tokens out", (const char *)"arg exp", (const char *)"pastes",
+                       (const char *)"hits", (const char *)"misses");
+
+    for (auto C : Sorted) {
+        OS << llvm::format("%-32s %9llu %10.3f %8llu %10.3f %10llu %10llu %7llu %7llu %8llu %8llu\n",
+                           C->Name.c_str(),
+                           (unsigned long long)C->Expansions, C->ExpansionNanoseconds / 1e6,
+                           (unsigned long long)C->PreComputes, C->PreComputeNanoseconds / 1e6,
+                           (unsigned long long)C->TokensIn, (unsigned long long)C->TokensOut,
+                           (unsigned long long)C->ArgExpansions, (unsigned long long)C->Pastes,
+                           (unsigned long long)C->CacheHits, (unsigned long long)C->CacheMisses);
+    }
+}
@@ -0,0 +1,88 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_MACROSTATISTICS_HPP
+#define MIXED_PREPROCESSOR_MACROSTATISTICS_HPP
+
+
+#include "clang/Lex/MacroInfo.h"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+using namespace clang;
+
+
+struct MacroCounters {
+    std::string Name;
+
+    uint64_t Expansions = 0;
+    // Inclusive of the macros expanded on the way.
+    uint64_t ExpansionNanoseconds = 0;
+
+    uint64_t PreComputes = 0;
+    // Of which taken from the PreComputedStore.
+    uint64_t PreComputesShared = 0;
+    // PreComputed bodies evicted to stay within the memory budget.
+    uint64_t Evictions = 0;
+    uint64_t PreComputeNanoseconds = 0;
+
+    uint64_t TokensIn = 0;
+    uint64_t TokensOut = 0;
+
+    uint64_t ArgExpansions = 0;
+    uint64_t Pastes = 0;
+
+    uint64_t CacheHits = 0;
+    uint64_t CacheMisses = 0;
+};
+
+
+// Per-macro counters of one MixedComputations.
+//
+// The engine only keeps a pointer to the statistics, null unless they were
+// asked for, so that collecting nothing costs a branch per event.
+class MacroStatistics {
+    // Node-based, counters are held on to across nested expansions.
+    std::unordered_map<const MacroInfo *, MacroCounters> Counters;
+
+public:
+    MacroCounters & get(const MacroInfo *MI, StringRef Name);
+
+    void printJSON(llvm::raw_ostream &OS, StringRef File) const;
+    void printTable(llvm::raw_ostream &OS, unsigned TopN) const;
+};
+
+
+// Writes String as a quoted JSON string.
+void printJSONString(llvm::raw_ostream &OS, StringRef String);
+
+
+// Adds the time elapsed during its lifetime to Nanoseconds, if not null.
+class StatisticsTimer {
+    uint64_t *Nanoseconds;
+    std::chrono::steady_clock::time_point Start;
+
+public:
+    explicit StatisticsTimer(uint64_t *Nanoseconds) : Nanoseconds(Nanoseconds) {
+        if (Nanoseconds) {
+            Start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~StatisticsTimer() {
+        if (Nanoseconds) {
+            *Nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - Start).count();
+        }
+    }
+};
+
+
+#endif //MIXED_PREPROCESSOR_MACROSTATISTICS_HPP
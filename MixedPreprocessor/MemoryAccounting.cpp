@@ -0,0 +1,70 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "MacroStatistics.hpp"
+#include "MemoryAccounting.hpp"
+
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+
+
+void MemoryAccounting::update(Structure S, size_t Current) {
+    Total.Current = Total.Current - Counters[S].Current + Current;
+    Total.Peak = std::max(Total.Peak, Total.Current);
+
+    Counters[S].Current = Current;
+    Counters[S].Peak = std::max(Counters[S].Peak, Current);
+}
+
+llvm::StringRef MemoryAccounting::getName(Structure S) {
+    switch (S) {
+    case MS_Definitions:        return "definitions";
+    case MS_PreComputed:        return "precomputed";
+    case MS_ExpansionCache:     return "expansion_cache";
+    case MS_ExpansionStacks:    return "expansion_stacks";
+    case MS_PastedTokens:       return "pasted_tokens";
+    case MS_StringifySequences: return "stringify_sequences";
+    case MS_ExpandedCache:      return "expanded_cache";
+    case MS_NumStructures:      break;
+    }
+    llvm_unreachable("unknown structure");
+}
+
+void MemoryAccounting::printJSON(llvm::raw_ostream &OS, llvm::StringRef File) const {
+    OS << "{\"file\": ";
+    printJSONString(OS, File);
+    OS << ", \"memory\": {";
+
+    for (unsigned S = 0; S != MS_NumStructures; ++S) {
+        OS << "\"" << getName(static_cast<Structure>(S)) << "\": {\"current\": " << Counters[S].Current
+           << ", \"peak\": " << Counters[S].Peak << "}, ";
+    }
+
+    OS << "\"total\": {\"current\": " << Total.Current << ", \"peak\": " << Total.Peak << "}"
+       << ", \"budget\": " << Budget
+       << ", \"evictions\": " << Evictions
+       << ", \"cache_evictions\": " << CacheEvictions
+       << ", \"budget_unreachable\": " << BudgetUnreachable << "}}\n";
+}
+
+void MemoryAccounting::printTable(llvm::raw_ostream &OS) const {
+    OS << llvm::format("%-32s %12s %12s\n", (const char *)"structure", (const char *)"current KB",
+                       (const char *)"peak KB");
+
+    for (unsigned S = 0; S != MS_NumStructures; ++S) {
+        OS << llvm::format("%-32s %12.1f %12.1f\n", getName(static_cast<Structure>(S)).data(),
+                           Counters[S].Current / 1024.0, Counters[S].Peak / 1024.0);
+    }
+
+    OS << llvm::format("%-32s %12.1f %12.1f\n", (const char *)"total",
+                       Total.Current / 1024.0, Total.Peak / 1024.0);
+
+    if (Budget) {
+        OS << llvm::format("budget %.1f KB, %llu evictions, %llu cache evictions, %llu times unreachable\n",
+                           Budget / 1024.0, (unsigned long long)Evictions, (unsigned long long)CacheEvictions,
+                           (unsigned long long)BudgetUnreachable);
+    }
+}
@@ -0,0 +1,101 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_MEMORYACCOUNTING_HPP
+#define MIXED_PREPROCESSOR_MEMORYACCOUNTING_HPP
+
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// Estimated overhead of a node of a node-based container or hash table.
+const size_t NodeOverhead = 4 * sizeof(void *);
+
+// Estimated bytes of the elements of V, its spare capacity included.
+template <typename T>
+size_t getVectorBytes(const std::vector<T> &V) {
+    return V.capacity() * sizeof(T);
+}
+
+// Estimated bytes of a StringMap entry.
+inline size_t getStringMapEntryBytes(size_t KeyLength, size_t ValueSize) {
+    return sizeof(size_t) + ValueSize + KeyLength + 1 + sizeof(void *) + sizeof(unsigned);
+}
+
+
+// Bytes held by the data structures of one MixedComputations, current and
+// peak, and the budget they are kept within.
+//
+// Sizes are estimates: the elements of a structure, spare capacity included,
+// plus a fixed overhead per node or entry.  Structures are either counted as
+// they change or measured again by the engine whenever it hands out tokens,
+// so a peak of the latter may be missed between two measures.
+class MemoryAccounting {
+public:
+    enum Structure {
+        MS_Definitions,
+        MS_PreComputed,
+        MS_ExpansionCache,
+        MS_ExpansionStacks,
+        MS_PastedTokens,
+        MS_StringifySequences,
+        MS_ExpandedCache,
+        MS_NumStructures
+    };
+
+private:
+    struct Counter {
+        size_t Current = 0;
+        size_t Peak = 0;
+    };
+
+    Counter Counters[MS_NumStructures];
+    Counter Total;
+
+    size_t Budget = 0;
+    uint64_t Evictions = 0;
+    uint64_t CacheEvictions = 0;
+    // Measures over budget where evicting all that may be evicted would not
+    // have been enough, so nothing was.
+    uint64_t BudgetUnreachable = 0;
+
+    void update(Structure S, size_t Current);
+
+public:
+    static llvm::StringRef getName(Structure S);
+
+    void add(Structure S, size_t Bytes) { update(S, Counters[S].Current + Bytes); }
+    void remove(Structure S, size_t Bytes) { update(S, Counters[S].Current - Bytes); }
+    void set(Structure S, size_t Bytes) { update(S, Bytes); }
+
+    size_t getCurrent(Structure S) const { return Counters[S].Current; }
+    size_t getPeak(Structure S) const { return Counters[S].Peak; }
+    size_t getTotal() const { return Total.Current; }
+    size_t getPeakTotal() const { return Total.Peak; }
+
+    // Unlimited if 0.
+    void setBudget(size_t Bytes) { Budget = Bytes; }
+    size_t getBudget() const { return Budget; }
+    bool isOverBudget() const { return Budget && Total.Current > Budget; }
+
+    void addEviction() { ++Evictions; }
+    uint64_t getEvictions() const { return Evictions; }
+
+    void addCacheEvictions(uint64_t Entries) { CacheEvictions += Entries; }
+    uint64_t getCacheEvictions() const { return CacheEvictions; }
+
+    void addBudgetUnreachable() { ++BudgetUnreachable; }
+    uint64_t getBudgetUnreachable() const { return BudgetUnreachable; }
+
+    void printJSON(llvm::raw_ostream &OS, llvm::StringRef File) const;
+    void printTable(llvm::raw_ostream &OS) const;
+};
+
+
+#endif //MIXED_PREPROCESSOR_MEMORYACCOUNTING_HPP
@@ -7,133 +7,857 @@
 #include "clang/Lex/LexDiagnostic.h"
 #include "clang/Lex/MacroArgs.h"
 
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
+#include <algorithm>
+#include <iterator>
+
+
+void MixedComputations::LexUnexpanded(Token &Tok) {
+    if (Lookahead.empty()) {
+        PP.LexUnexpandedNonComment(Tok);
+        return;
+    }
+
+    Tok = Lookahead.front();
+    Lookahead.erase(Lookahead.begin());
+}
+
+const Token & MixedComputations::peekUnexpanded() {
+    if (Lookahead.empty()) {
+        Lookahead.emplace_back();
+        PP.LexUnexpandedNonComment(Lookahead.back());
+    }
+
+    return Lookahead.front();
+}
 
 bool MixedComputations::isNextPPTokenLParen() {
-    Token Tok;
+    return peekUnexpanded().is(tok::l_paren);
+}
 
-    PP.EnableBacktrackAtThisPos();
-    PP.LexUnexpandedNonComment(Tok);
-    PP.Backtrack();
+MacroInfo * MixedComputations::getTrailingMacro(const Token &Tok, std::vector<MixedToken>::const_iterator Next) {
+    // C99 6.10.3.4p1: the result of an expansion is rescanned along with the
+    // rest of the source file, see the example of C11 6.10.3.4p4.
+    if (!Tok.isAnyIdentifier() || Tok.isExpandDisabled() || Stream) {
+        return nullptr;
+    }
 
-    return Tok.is(tok::l_paren);
+    for (; Next != ExpandedCache.end(); ++Next) {
+        if (!Next->isOneOf(tok::eof, tok::eod)) {
+            return nullptr;
+        }
+    }
+
+    MacroInfo *MI = getMacroInfo(Tok.getIdentifierInfo());
+    if (!MI || !MI->isFunctionLike() || !MI->isEnabled() || !isNextPPTokenLParen()) {
+        return nullptr;
+    }
+    return MI;
 }
 
-MixedComputations::MixedComputations(Preprocessor &PP) : PP(PP) {
+// Tokens handed to Lex at once by a streamed expansion.
+static const size_t StreamChunkSize = 256;
+
+// Streamed expansions longer than this are not cached: holding their result
+// is what streaming avoids.
+static const size_t MaxCachedStreamSize = 1 << 14;
+
+struct MixedComputations::StreamedExpansion {
+    const MacroInfo *MI;
+    MacroCounters *Counters;
+
+    std::string Key;
+    size_t DependenciesBegin;
+
+    MixedMacroArgs MA;
+    ExpansionStack_id_t ExpansionStack;
+    TokenRewriter Body;
+    unsigned NumParens;
+
+    // A copy of the tokens produced so far, for Expansions.
+    std::vector<MixedToken> Result;
+    bool Cacheable;
+    size_t TokensOut;
+
+    StreamedExpansion(
+            MixedComputations &MC,
+            const MacroInfo *MI,
+            MacroCounters *Counters,
+            std::string Key,
+            size_t DependenciesBegin,
+            const std::vector<std::vector<MixedToken>> &Args,
+            ExpansionStack_id_t ExpansionStack,
+            const MixedToken *Body) :
+            MI(MI), Counters(Counters), Key(std::move(Key)), DependenciesBegin(DependenciesBegin),
+            MA(MC, MI, Args), ExpansionStack(ExpansionStack), Body(Body), NumParens(0),
+            Cacheable(true), TokensOut(0) {}
+};
+
+// A unit of work of RunFrames: either a rewrite, or an invocation waiting on
+// the rewrites of its arguments and body.
+struct MixedComputations::Frame {
+    enum FrameKind {
+        FK_Preprocess,
+        FK_Expansion
+    };
+
+    // What becomes of the result of an FK_Preprocess frame.
+    enum FinishKind {
+        FF_Argument,        // the next argument of the expansion below
+        FF_Body,            // the result of the expansion below
+        FF_ExpandedArg,     // a pre-expanded argument of MA
+        FF_PreCompute       // the PreComputed body of MI
+    };
+
+    enum ExpansionPhase {
+        EP_Start,           // the arguments are to be collected
+        EP_Collect,         // an argument has just been collected
+        EP_Begin,           // the arguments are all there
+        EP_Substitute,      // a body with no rescan is expanded in place
+        EP_Lookup,          // the cache is looked up
+        EP_Expand,          // the body is to be rewritten
+        EP_Finish           // the body has been rewritten into Result
+    };
+
+    FrameKind Kind;
+    const MacroInfo *MI;
+    ExpansionStack_id_t ExpansionStack;
+
+    // FK_Preprocess
+    TokenRewriter Tokens;
+    MixedMacroArgs *MA;
+    bool inArgument;
+    unsigned NumParens;
+    FinishKind Finish;
+    unsigned ArgNum;
+    ExpansionStack_id_t ArgExpansionStack;
+
+    // FK_Expansion
+    Token MacroName;
+    TokenRewriter *Upstream;
+    const MacroInfo *ParentMI;
+    MixedMacroArgs *ParentArgs;
+    bool Streamed;
+    std::vector<MixedToken> *Return;
+    ExpansionPhase Phase;
+    MacroCounters *Counters;
+    BodyShape Shape;
+    const std::vector<MixedToken> *Body;
+    bool PreComputing;
+    std::string Key;
+    ExpansionStack_id_t BodyExpansionStack;
+    std::vector<MixedToken> Result;
+
+    // FK_Expansion and FF_PreCompute
+    size_t DependenciesBegin;
+    std::vector<std::vector<MixedToken>> Args;
+    llvm::Optional<MixedMacroArgs> OwnArgs;
+
+    llvm::Optional<StatisticsTimer> Timer;
+    llvm::Optional<TraceSpan> Span;
+    llvm::Optional<TraceSpan> PreprocessSpan;
+};
+
+
+MixedComputations::MixedComputations(
+        Preprocessor &PP, std::shared_ptr<PreComputedStore> Store) :
+        PP(PP), Expansions(PP), Stats(nullptr), Trace(nullptr), Depth(0) {
     PP.addPPCallbacks(llvm::make_unique<MixedComputationsPPCallbacks>(*this));
-    // Dependency = llvm::make_unique<MacroDependency>(*this);
+    Dependency = llvm::make_unique<MacroDependency>(*this);
     ExpandedCacheIter = ExpandedCache.begin();
+
+    Token Tok;
+    Tok.startToken();
+    Tok.setKind(tok::eof);
+    EofToken = MixedToken::createCommon(Tok, false);
+
+    if (Store) {
+        DiskCache = llvm::make_unique<PreComputedCache>(*this, PP, std::move(Store));
+    }
+}
+
+MixedComputations::~MixedComputations() {
+    DiskCache.reset();
 }
 
 bool MixedComputations::isDefined(const MacroInfo *MI) {
     return Definitions.find(MI) != Definitions.end();
 }
 
+void MixedComputations::UniqueDependencies(size_t Begin) {
+    std::sort(Dependencies.begin() + Begin, Dependencies.end());
+    Dependencies.erase(std::unique(Dependencies.begin() + Begin, Dependencies.end()), Dependencies.end());
+}
+
+MacroCounters * MixedComputations::getCounters(const MacroInfo *MI) {
+    if (!Stats || !MI) {
+        return nullptr;
+    }
+
+    auto It = MacroNames.find(MI);
+    return &Stats->get(MI, It != MacroNames.end() ? It->second->getName() : StringRef());
+}
+
+void MixedComputations::DropPreComputed(const MacroInfo *MI) {
+    auto It = PreComputed.find(MI);
+    if (It != PreComputed.end()) {
+        ErasePreComputed(It);
+    }
+}
+
+std::vector<MixedToken> & MixedComputations::AddPreComputed(
+        const MacroInfo *MI,
+        std::vector<MixedToken> Tokens,
+        ExpansionCache::Dependencies_t::const_iterator DependenciesBegin,
+        ExpansionCache::Dependencies_t::const_iterator DependenciesEnd) {
+    auto It = PreComputed.find(MI);
+    if (It != PreComputed.end()) {
+        ErasePreComputed(It);
+    }
+
+    PreComputedBody &Body = PreComputed[MI];
+    Body.Tokens = std::move(Tokens);
+
+    Body.Expands = EmptyExpansionStack;
+    for (auto Dependency = DependenciesBegin; Dependency != DependenciesEnd; ++Dependency) {
+        if (const MacroInfo *DependencyMI = getMacroInfo(*Dependency)) {
+            Body.Expands = ExpansionStacks.push(Body.Expands, DependencyMI);
+        }
+    }
+
+    Body.Use = PreComputedUses.insert(PreComputedUses.begin(), MI);
+    Body.Bytes = getVectorBytes(Body.Tokens) + sizeof(PreComputedBody) + 2 * NodeOverhead;
+    Memory.add(MemoryAccounting::MS_PreComputed, Body.Bytes);
+
+    BodyShapes[MI] = ClassifyBody(Body.Tokens);
+
+    EnforceMemoryBudget(MI);
+    return Body.Tokens;
+}
+
+void MixedComputations::ErasePreComputed(
+        std::unordered_map<const MacroInfo *, PreComputedBody>::iterator It) {
+    Memory.remove(MemoryAccounting::MS_PreComputed, It->second.Bytes);
+    PreComputedUses.erase(It->second.Use);
+    BodyShapes.erase(It->first);
+    PreComputed.erase(It);
+}
+
+void MixedComputations::MeasureMemory() {
+    Memory.set(MemoryAccounting::MS_ExpansionCache, Expansions.getBytes());
+    Memory.set(MemoryAccounting::MS_ExpansionStacks, ExpansionStacks.getBytes());
+    Memory.set(MemoryAccounting::MS_ExpandedCache, getVectorBytes(ExpandedCache));
+}
+
+void MixedComputations::EnforceMemoryBudget(const MacroInfo *Keep) {
+    MeasureMemory();
+    if (!Memory.isOverBudget()) {
+        return;
+    }
+
+    // Bodies being rewritten are read in place.
+    llvm::SmallPtrSet<const MacroInfo *, 16> InUse;
+    if (Keep) {
+        InUse.insert(Keep);
+    }
+    if (Stream) {
+        InUse.insert(Stream->MI);
+    }
+    for (size_t i = 0; i != Depth; ++i) {
+        const Frame &F = *Frames[i];
+        if (F.Kind == Frame::FK_Expansion && (F.Body || F.PreComputing)) {
+            InUse.insert(F.MI);
+        }
+    }
+
+    // Only the expansion cache and the bodies not in use may be evicted.  If
+    // all of them are not enough to get under budget, nothing is: what is
+    // evicted would be computed again at once, to no avail.
+    size_t Pinned = 0;
+    for (const MacroInfo *MI : InUse) {
+        auto It = PreComputed.find(MI);
+        if (It != PreComputed.end()) {
+            Pinned += It->second.Bytes;
+        }
+    }
+    size_t Evictable = Memory.getCurrent(MemoryAccounting::MS_ExpansionCache) +
+                       Memory.getCurrent(MemoryAccounting::MS_PreComputed) - Pinned;
+    size_t Excess = Memory.getTotal() - Memory.getBudget();
+    if (Evictable < Excess) {
+        Memory.addBudgetUnreachable();
+        return;
+    }
+
+    // Results of whole invocations go first: they are computed again from
+    // the bodies, which are kept as long as possible.
+    Memory.addCacheEvictions(Expansions.evict(Excess));
+    Memory.set(MemoryAccounting::MS_ExpansionCache, Expansions.getBytes());
+
+    auto Use = PreComputedUses.end();
+    while (Use != PreComputedUses.begin() && Memory.isOverBudget()) {
+        const MacroInfo *MI = *std::prev(Use);
+        if (InUse.count(MI)) {
+            --Use;
+            continue;
+        }
+
+        ErasePreComputed(PreComputed.find(MI));
+        Memory.addEviction();
+
+        MacroCounters *Counters = getCounters(MI);
+        if (Counters) {
+            ++Counters->Evictions;
+        }
+    }
+}
+
+void MixedComputations::RemoveDefinition(const MacroInfo *MI) {
+    auto It = Definitions.find(MI);
+    if (It != Definitions.end()) {
+        Memory.remove(MemoryAccounting::MS_Definitions, getVectorBytes(It->second) + NodeOverhead);
+        Definitions.erase(It);
+    }
+
+    DropPreComputed(MI);
+    Dependency->Remove(MI);
+
+    MacroNames.erase(MI);
+}
+
 void MixedComputations::MacroDefined(const Token &MacroNameTok, const MacroDirective *MD) {
-    const MacroInfo *MI = PP.getMacroInfo(MacroNameTok.getIdentifierInfo());
+    const IdentifierInfo *II = MacroNameTok.getIdentifierInfo();
+    MacroInfo *MI = PP.getMacroInfo(II);
+
+    auto Previous = Macros.find(II);
+    if (Previous != Macros.end()) {
+        // C99 6.10.3p2 allows a redefinition identical to the previous one,
+        // nothing computed so far changes.
+        if (Previous->second->isIdenticalTo(*MI, PP, true)) {
+            return;
+        }
+
+        RemoveDefinition(Previous->second);
+    }
+
+    Macros[II] = MI;
+    MacroNames[MI] = II;
+
+    Expansions.invalidate(II);
+    Dependency->Update(II);
 
-    std::vector<MixedToken_ptr_t> Tokens;
+    std::vector<MixedToken> Tokens;
+    ExpansionStack_id_t ExpansionStack = ExpansionStacks.push(EmptyExpansionStack, MI);
 
     for (auto It = MI->tokens_begin(); It != MI->tokens_end(); ++It) {
         if (!It->isAnyIdentifier()) {
-            Tokens.emplace_back(std::make_shared<CommonToken>(*It, true));
+            Tokens.push_back(MixedToken::createCommon(*It, true));
         } else if (MI->getArgumentNum(It->getIdentifierInfo()) == -1){
-            std::unordered_set<const MacroInfo *> ExpansionStack = {MI};
-            Tokens.emplace_back(std::make_shared<IdentifierArgToken>(*It, true, ExpansionStack));
+            Tokens.push_back(MixedToken::createIdentifier(*It, true, ExpansionStack));
         } else {
             unsigned ArgNum = MI->getArgumentNum(It->getIdentifierInfo());
-            std::unordered_set<const MacroInfo *> ExpansionStack = {MI};
-            Tokens.emplace_back(std::make_shared<MixedArgToken>(ArgNum, true, ExpansionStack));
+            Tokens.push_back(MixedToken::createArg(ArgNum, true, ExpansionStack));
         }
     }
 
-    Token Tok;
-    Tok.startToken();
-    Tok.setKind(tok::eof);
-    Tokens.emplace_back(std::make_shared<CommonToken>(Tok, false));
+    Tokens.push_back(EofToken);
 
-    Definitions[MI] = Tokens;
+    Memory.add(MemoryAccounting::MS_Definitions, getVectorBytes(Tokens) + NodeOverhead);
+    Definitions.emplace(MI, std::move(Tokens));
 }
 
 void MixedComputations::MacroUndefined(const Token &MacroNameTok, const MacroDefinition &MD) {
-    const MacroInfo *MI = PP.getMacroInfo(MacroNameTok.getIdentifierInfo());
-    Definitions.erase(MI);
+    const IdentifierInfo *II = MacroNameTok.getIdentifierInfo();
+
+    auto It = Macros.find(II);
+    if (It == Macros.end()) {
+        return;
+    }
+
+    RemoveDefinition(It->second);
+    Macros.erase(It);
+
+    Expansions.invalidate(II);
+    Dependency->Update(II);
+}
+
+MixedComputations::Frame & MixedComputations::pushFrame() {
+    if (Depth == Frames.size()) {
+        Frames.push_back(llvm::make_unique<Frame>());
+    }
+    return *Frames[Depth++];
+}
+
+void MixedComputations::popFrame() {
+    assert(Depth);
+    Frame &F = *Frames[--Depth];
+
+    // Spans end innermost first.
+    F.PreprocessSpan.reset();
+    F.Span.reset();
+    F.Timer.reset();
+
+    F.OwnArgs.reset();
+    F.Args.clear();
+    F.Result.clear();
+    F.Key.clear();
+}
+
+void MixedComputations::RunFrames(size_t Base) {
+    while (Depth > Base) {
+        Frame &F = *Frames[Depth - 1];
+
+        if (F.Kind == Frame::FK_Expansion) {
+            StepExpansion(F);
+        } else if (!PreprocessStep(F.MI, F.Tokens, *F.MA, F.ExpansionStack, F.inArgument, F.NumParens)) {
+            FinishPreprocess(F);
+        }
+    }
+}
+
+void MixedComputations::initPreprocess(
+        Frame &F,
+        const MacroInfo *MI,
+        MixedMacroArgs &MA,
+        ExpansionStack_id_t ExpansionStack,
+        bool inArgument) {
+    assert(!MI || isDefined(MI));
+
+    F.Kind = Frame::FK_Preprocess;
+    F.MI = MI;
+    F.ExpansionStack = ExpansionStack;
+    F.MA = &MA;
+    F.inArgument = inArgument;
+    F.NumParens = 0;
+    F.PreprocessSpan.emplace(Trace, "Preprocess", MI ? getMacroName(MI) : nullptr);
+}
+
+void MixedComputations::FinishPreprocess(Frame &F) {
+    switch (F.Finish) {
+    case Frame::FF_Argument: {
+        Frame &Expansion = *Frames[Depth - 2];
+        Expansion.Args.push_back(F.Tokens.finish());
+        F.PreprocessSpan->setTokensOut(Expansion.Args.back().size() - 1);
+        break;
+    }
+
+    case Frame::FF_Body: {
+        // Copied, so that both buffers are kept for the next frames.
+        Frame &Expansion = *Frames[Depth - 2];
+        const std::vector<MixedToken> &Result = F.Tokens.finishInPlace();
+        Expansion.Result.assign(Result.begin(), Result.end());
+        F.PreprocessSpan->setTokensOut(Result.size() - 1);
+        break;
+    }
+
+    case Frame::FF_ExpandedArg: {
+        std::vector<MixedToken> Expanded = F.Tokens.finish();
+        F.PreprocessSpan->setTokensOut(Expanded.size() - 1);
+        F.Span->setTokensOut(Expanded.size() - 1);
+        F.MA->addExpanded(F.ArgNum, F.ArgExpansionStack, std::move(Expanded));
+        break;
+    }
+
+    case Frame::FF_PreCompute: {
+        PreComputesInProgress.erase(F.MI);
+
+        std::vector<MixedToken> Tokens = F.Tokens.finish();
+        F.PreprocessSpan->setTokensOut(Tokens.size() - 1);
+
+        for (auto &Tok : Tokens) {
+            if (!Tok.isCommonToken()) {
+                Tok.setExpanded();
+            }
+        }
+
+        UniqueDependencies(F.DependenciesBegin);
+        Dependency->AddDependencies(F.MI, Dependencies.begin() + F.DependenciesBegin, Dependencies.end());
+
+        const std::vector<MixedToken> &Body = AddPreComputed(
+                F.MI, std::move(Tokens), Dependencies.begin() + F.DependenciesBegin, Dependencies.end());
+
+        if (DiskCache) {
+            DiskCache->store(MacroNames[F.MI], F.MI, Body,
+                             Dependencies.begin() + F.DependenciesBegin, Dependencies.end());
+        }
+        break;
+    }
+    }
+
+    popFrame();
 }
 
-std::vector<MixedToken_ptr_t> MixedComputations::ExpandMacro(
+void MixedComputations::pushArgExpansion(
+        MixedMacroArgs &MA, unsigned ArgNum, ExpansionStack_id_t ExpansionStack) {
+    const MacroInfo *MI = MA.getMacroInfo();
+
+    if (MacroCounters *Counters = getCounters(MI)) {
+        ++Counters->ArgExpansions;
+    }
+
+    Frame &F = pushFrame();
+    F.Span.emplace(Trace, "getExpanded", MI ? getMacroName(MI) : nullptr);
+    F.Span->setTokensIn(MA.getArg(ArgNum).size() - 1);
+
+    initPreprocess(F, MI, MA, MA.getExpansionStack(), false);
+    F.Tokens.reset(MA.getArg(ArgNum).data());
+    F.Finish = Frame::FF_ExpandedArg;
+    F.ArgNum = ArgNum;
+    F.ArgExpansionStack = ExpansionStack;
+}
+
+void MixedComputations::ExpandArgument(
+        MixedMacroArgs &MA, unsigned ArgNum, ExpansionStack_id_t ExpansionStack) {
+    size_t Base = Depth;
+    pushArgExpansion(MA, ArgNum, ExpansionStack);
+    RunFrames(Base);
+}
+
+void MixedComputations::pushExpansion(
         const Token &MacroName,
         const MacroInfo *MI,
-        std::vector<MixedToken_ptr_t>::const_iterator &Begin,
-        const std::unordered_set<const MacroInfo *> &ExpansionStack,
+        TokenRewriter &Tokens,
+        ExpansionStack_id_t ExpansionStack,
         const MacroInfo *ParentMI,
-        MixedMacroArgs &ParentArgs) {
-    size_t numArgs = MI->getNumArgs();
-    std::vector<std::vector<MixedToken_ptr_t>> Args;
+        MixedMacroArgs &ParentArgs,
+        bool Streamed,
+        std::vector<MixedToken> *Return) {
+    Frame &F = pushFrame();
+    F.Kind = Frame::FK_Expansion;
+    F.MI = MI;
+    F.ExpansionStack = ExpansionStack;
+    F.MacroName = MacroName;
+    F.Upstream = &Tokens;
+    F.ParentMI = ParentMI;
+    F.ParentArgs = &ParentArgs;
+    F.Streamed = Streamed;
+    F.Return = Return;
+    F.Phase = Frame::EP_Start;
+    F.Counters = getCounters(MI);
+    F.Body = nullptr;
+    F.PreComputing = false;
 
-    if (MI->isFunctionLike()) {
-        assert((*Begin)->is(tok::l_paren));
-        ++Begin;
-
-        if (MI->isFunctionLike()) {
-            while (1) {
-                std::vector<MixedToken_ptr_t> Arg = Preprocess(ParentMI, Begin, ParentArgs, ExpansionStack, true);
-
-                if (Arg.empty() || Arg.back()->isOneOf(tok::eof, tok::eod)) {
-                    return {};
-                } else if (Arg.back()->is(tok::comma)) {
-                    Token Tok;
-                    Tok.startToken();
-                    Tok.setKind(tok::eof);
-                    Arg.back() = std::make_shared<CommonToken>(Tok, false);
-
-                    Args.push_back(Arg);
-                } else {
-                    assert(Arg.back()->is(tok::r_paren));
-
-                    Token Tok;
-                    Tok.startToken();
-                    Tok.setKind(tok::eof);
-                    Arg.back() = std::make_shared<CommonToken>(Tok, false);
-
-                    Args.push_back(Arg);
-                    break;
+    F.Timer.emplace(F.Counters ? &F.Counters->ExpansionNanoseconds : nullptr);
+    F.Span.emplace(Trace, "ExpandMacro", MacroName.getIdentifierInfo(), MacroName.getLocation());
+}
+
+void MixedComputations::pushArgument(Frame &Expansion) {
+    Frame &F = pushFrame();
+    initPreprocess(F, Expansion.ParentMI, *Expansion.ParentArgs, Expansion.ExpansionStack, true);
+    F.Tokens.reset(*Expansion.Upstream);
+    F.Finish = Frame::FF_Argument;
+}
+
+bool MixedComputations::ensureBody(Frame &F) {
+    if (F.Body) {
+        return true;
+    }
+
+    // PreCompute leaves the dependencies of the body behind.
+    bool Recorded = F.PreComputing;
+    F.PreComputing = false;
+
+    auto It = PreComputed.find(F.MI);
+    if (It == PreComputed.end() && !PreComputesInProgress.count(F.MI)) {
+        if (!StartPreCompute(F.MI)) {
+            F.PreComputing = true;
+            return false;
+        }
+
+        It = PreComputed.find(F.MI);
+        Recorded = true;
+    }
+
+    // A macro the body has expanded, or left unexpanded, may be disabled in
+    // this stack: the definition is rewritten in it instead.
+    if (It == PreComputed.end() || ExpansionStacks.intersects(It->second.Expands, F.ExpansionStack)) {
+        F.Body = &Definitions[F.MI];
+        F.Shape = BS_Rescan;
+        return true;
+    }
+
+    PreComputedUses.splice(PreComputedUses.begin(), PreComputedUses, It->second.Use);
+
+    if (!Recorded) {
+        auto &BodyDependencies = Dependency->getDependencies(F.MI);
+        Dependencies.insert(Dependencies.end(), BodyDependencies.begin(), BodyDependencies.end());
+    }
+    F.Body = &It->second.Tokens;
+    return true;
+}
+
+void MixedComputations::StepExpansion(Frame &F) {
+    switch (F.Phase) {
+    case Frame::EP_Start: {
+        if (!F.MI->isFunctionLike()) {
+            F.Phase = Frame::EP_Begin;
+            return;
+        }
+
+        MixedToken LParen = F.Upstream->take();
+        assert(LParen.is(tok::l_paren));
+        (void)LParen;
+
+        F.Phase = Frame::EP_Collect;
+        pushArgument(F);
+        return;
+    }
+
+    case Frame::EP_Collect: {
+        std::vector<MixedToken> &Arg = F.Args.back();
+
+        if (Arg.empty() || Arg.back().isOneOf(tok::eof, tok::eod)) {
+            F.Args.clear();
+            FinishExpansion(F);
+            return;
+        }
+
+        bool isLast = Arg.back().is(tok::r_paren);
+        assert(isLast || Arg.back().is(tok::comma));
+        Arg.back() = EofToken;
+
+        if (!isLast) {
+            pushArgument(F);
+            return;
+        }
+
+        // C99 6.10.3p4: the empty argument list of a macro without
+        // parameters holds no argument, not a single empty one.
+        if (!F.MI->getNumArgs() && F.Args.size() == 1 && F.Args[0].size() == 1) {
+            F.Args.clear();
+        }
+
+        if (F.Args.size() != F.MI->getNumArgs()) {
+            F.Args.clear();
+            FinishExpansion(F);
+            return;
+        }
+
+        F.Phase = Frame::EP_Begin;
+        return;
+    }
+
+    case Frame::EP_Begin: {
+        size_t TokensIn = 0;
+        for (auto &Arg : F.Args) {
+            TokensIn += Arg.size() - 1;
+        }
+        F.Span->setTokensIn(TokensIn);
+
+        if (F.Counters) {
+            ++F.Counters->Expansions;
+            F.Counters->TokensIn += TokensIn;
+        }
+
+        // The arguments have been collected in the parent context, whatever is
+        // looked up from here on is a dependency of this invocation.
+        F.DependenciesBegin = Dependencies.size();
+        Dependencies.push_back(F.MacroName.getIdentifierInfo());
+
+        // Bodies that need no rescan are expanded in place, with neither the
+        // cache nor a new expansion stack.
+        auto ShapeIt = BodyShapes.find(F.MI);
+        F.Shape = ShapeIt == BodyShapes.end() ? BS_Rescan : ShapeIt->second;
+
+        F.Phase = F.Shape == BS_Constant || F.Shape == BS_Substitution ? Frame::EP_Substitute
+                                                                       : Frame::EP_Lookup;
+        return;
+    }
+
+    case Frame::EP_Substitute: {
+        if (!ensureBody(F)) {
+            return;
+        }
+
+        if (F.Shape == BS_Rescan) {
+            F.Phase = Frame::EP_Lookup;
+            return;
+        }
+
+        if (F.Shape == BS_Constant) {
+            F.Result = *F.Body;
+        } else {
+            if (!F.OwnArgs) {
+                F.OwnArgs.emplace(*this, F.MI, F.Args, F.ExpansionStack);
+            }
+
+            // SubstituteArgs does not wait on the arguments.
+            for (auto &Tok : *F.Body) {
+                if (Tok.getKind() == MixedToken::MTK_Arg &&
+                    !F.OwnArgs->findExpanded(Tok.getArgNum(), Tok.getExpansionStack())) {
+                    pushArgExpansion(*F.OwnArgs, Tok.getArgNum(), Tok.getExpansionStack());
+                    return;
                 }
             }
+
+            if (!SubstituteArgs(*F.Body, *F.OwnArgs, F.Result)) {
+                // An expanded argument needs a rescan in the body.
+                F.Result.clear();
+                F.Phase = Frame::EP_Lookup;
+                return;
+            }
+        }
+
+        if (F.Counters) {
+            F.Counters->TokensOut += F.Result.size() - 1;
+        }
+        FinishExpansion(F);
+        return;
+    }
+
+    case Frame::EP_Lookup: {
+        F.Key = Expansions.getKey(F.MI, F.Args, F.ExpansionStack);
+        if (auto Cached = Expansions.lookup(F.Key, Dependencies)) {
+            F.Result = *Cached;
+            if (F.Counters) {
+                ++F.Counters->CacheHits;
+                F.Counters->TokensOut += F.Result.size() - 1;
+            }
+            FinishExpansion(F);
+            return;
+        }
+
+        if (F.Counters) {
+            ++F.Counters->CacheMisses;
+        }
+
+        F.BodyExpansionStack = ExpansionStacks.push(F.ExpansionStack, F.MI);
+        F.Phase = Frame::EP_Expand;
+        return;
+    }
+
+    case Frame::EP_Expand: {
+        if (!ensureBody(F)) {
+            return;
+        }
+
+        if (F.Streamed) {
+            Stream = llvm::make_unique<StreamedExpansion>(
+                    *this, F.MI, F.Counters, std::move(F.Key), F.DependenciesBegin, F.Args,
+                    F.BodyExpansionStack, F.Body->data());
+            FinishExpansion(F);
+            return;
         }
+
+        if (!F.OwnArgs) {
+            F.OwnArgs.emplace(*this, F.MI, F.Args, F.ExpansionStack);
+        }
+
+        F.Phase = Frame::EP_Finish;
+
+        Frame &Body = pushFrame();
+        initPreprocess(Body, F.MI, *F.OwnArgs, F.BodyExpansionStack, false);
+        Body.Tokens.reset(F.Body->data());
+        Body.Finish = Frame::FF_Body;
+        return;
+    }
+
+    case Frame::EP_Finish: {
+        UniqueDependencies(F.DependenciesBegin);
+        Expansions.insert(F.Key, F.Result, Dependencies.begin() + F.DependenciesBegin, Dependencies.end());
+
+        if (F.Counters) {
+            F.Counters->TokensOut += F.Result.size() - 1;
+        }
+        FinishExpansion(F);
+        return;
+    }
+    }
+}
+
+void MixedComputations::FinishExpansion(Frame &F) {
+    if (!F.Result.empty()) {
+        F.Span->setTokensOut(F.Result.size() - 1);
     }
 
-    if (Args.size() != numArgs) {
-        return {};
+    if (F.Return) {
+        *F.Return = std::move(F.Result);
+    } else {
+        auto End = F.Result.end();
+        while (End != F.Result.begin() && std::prev(End)->isOneOf(tok::eof, tok::eod)) {
+            --End;
+        }
+        F.Upstream->push(F.Result.data(), F.Result.data() + (End - F.Result.begin()));
     }
 
-    MixedMacroArgs MixedMA(*this, MI, Args);
+    popFrame();
+}
+
+std::vector<MixedToken> MixedComputations::ExpandMacro(
+        const Token &MacroName,
+        const MacroInfo *MI,
+        TokenRewriter &Tokens,
+        ExpansionStack_id_t ExpansionStack,
+        const MacroInfo *ParentMI,
+        MixedMacroArgs &ParentArgs,
+        bool Streamed) {
+    std::vector<MixedToken> Result;
+
+    size_t Base = Depth;
+    pushExpansion(MacroName, MI, Tokens, ExpansionStack, ParentMI, ParentArgs, Streamed, &Result);
+    RunFrames(Base);
 
-    std::unordered_set<const MacroInfo *> NexExpansionStack = ExpansionStack;
-    NexExpansionStack.insert(MI);
+    return Result;
+}
 
-    if (PreComputed.find(MI) == PreComputed.end()) {
-        PreCompute(MI);
+size_t MixedComputations::LexBatch(Token *Tokens, size_t N) {
+    size_t Count = 0;
+    while (Count != N) {
+        // The rest of the current expansion is copied at once, but for a
+        // trailing macro name left to Lex.
+        for (; Count != N && ExpandedCacheIter != ExpandedCache.end(); ++ExpandedCacheIter) {
+            const Token &Tok = ExpandedCacheIter->getTok();
+            if (Tok.isAnyIdentifier() && getTrailingMacro(Tok, std::next(ExpandedCacheIter))) {
+                break;
+            }
+            if (!Tok.isOneOf(tok::eof, tok::eod)) {
+                Tokens[Count++] = Tok;
+            }
+        }
+
+        if (Count == N) {
+            break;
+        }
+
+        Lex(Tokens[Count]);
+        if (Tokens[Count++].is(tok::eof)) {
+            break;
+        }
     }
 
-    std::vector<MixedToken_ptr_t>::const_iterator Iter = PreComputed[MI].cbegin();
-    return Preprocess(MI, Iter, MixedMA, NexExpansionStack, false);
+    return Count;
 }
 
 void MixedComputations::Lex(Token &Tok) {
+    // Only kept if a macro is expanded.
+    TraceSpan Span(Trace, "Lex", nullptr, SourceLocation(), false);
+
     while(1) {
         if (ExpandedCacheIter != ExpandedCache.end()) {
-            assert((*ExpandedCacheIter)->isCommonToken());
-
-            Tok = reinterpret_cast<CommonToken *>(ExpandedCacheIter->get())->getTok();
+            Tok = ExpandedCacheIter->getTok();
             ++ExpandedCacheIter;
 
             if (Tok.isOneOf(tok::eof, tok::eod)) continue;
+
+            if (MacroInfo *MI = getTrailingMacro(Tok, ExpandedCacheIter)) {
+                LexMacro(Tok, MI);
+                EnforceMemoryBudget();
+                continue;
+            }
             return;
         }
 
+        if (Stream) {
+            ContinueStream();
+            EnforceMemoryBudget();
+            continue;
+        }
+
         ExpandedCache.clear();
         ExpandedCacheIter = ExpandedCache.begin();
 
-        PP.LexUnexpandedNonComment(Tok);
+        LexUnexpanded(Tok);
 
         if (!Tok.isAnyIdentifier()) {
             return;
@@ -141,12 +865,13 @@ void MixedComputations::Lex(Token &Tok) {
 
         IdentifierInfo *II = Tok.getIdentifierInfo();
 
-        if (MacroInfo *MI = PP.getMacroInfo(II)) {
+        if (MacroInfo *MI = getMacroInfo(II)) {
             if (!Tok.isExpandDisabled() && MI->isEnabled()) {
                 // C99 6.10.3p10: If the preprocessing token immediately after the
                 // macro name isn't a '(', this macro should not be expanded.
                 if (!MI->isFunctionLike() || isNextPPTokenLParen()) {
                     LexMacro(Tok, MI);
+                    EnforceMemoryBudget();
                     continue;
                 }
             } else {
@@ -164,14 +889,18 @@ void MixedComputations::Lex(Token &Tok) {
 }
 
 void MixedComputations::LexMacro(Token &MacroName, MacroInfo *MI) {
-    std::vector<MixedToken_ptr_t> Tokens;
+    TraceSpan Span(Trace, "LexMacro", MacroName.getIdentifierInfo(), MacroName.getLocation());
+
+    std::vector<MixedToken> Tokens;
     Token Tok;
 
+    ExpansionStack_id_t ExpansionStack = ExpansionStacks.push(EmptyExpansionStack, MI);
+
     unsigned NumParens = 0;
 
     if (MI->isFunctionLike()) {
         while (1) {
-            PP.LexUnexpandedNonComment(Tok);
+            LexUnexpanded(Tok);
 
             if (Tok.isOneOf(tok::eof, tok::eod)) {
                 ExpandedCache = Tokens;
@@ -180,10 +909,9 @@ void MixedComputations::LexMacro(Token &MacroName, MacroInfo *MI) {
             }
 
             if (!Tok.isAnyIdentifier()) {
-                Tokens.emplace_back(std::make_shared<CommonToken>(Tok, false));
+                Tokens.push_back(MixedToken::createCommon(Tok, false));
             } else {
-                std::unordered_set<const MacroInfo *> ExpansionStack = {MI};
-                Tokens.emplace_back(std::make_shared<IdentifierArgToken>(Tok, false, ExpansionStack));
+                Tokens.push_back(MixedToken::createIdentifier(Tok, false, ExpansionStack));
             }
 
             if (Tok.is(tok::l_paren)) {
@@ -198,41 +926,122 @@ void MixedComputations::LexMacro(Token &MacroName, MacroInfo *MI) {
         }
     }
 
-    std::vector<MixedToken_ptr_t>::const_iterator Iter = Tokens.cbegin();
+    Tokens.push_back(EofToken);
+    TokenRewriter Input(Tokens.data());
 
-    std::vector<std::vector<MixedToken_ptr_t>> Args;
-    std::unordered_set<const MacroInfo *> ExpansionStack;
+    std::vector<std::vector<MixedToken>> Args;
     MixedMacroArgs emptyMA(*this, nullptr, Args);
 
-    ExpandedCache = ExpandMacro(MacroName, MI, Iter, ExpansionStack, nullptr, emptyMA);
+    ExpandedCache = ExpandMacro(MacroName, MI, Input, EmptyExpansionStack, nullptr, emptyMA, true);
     ExpandedCacheIter = ExpandedCache.begin();
+
+    if (Stream) {
+        ContinueStream();
+    } else {
+        Dependencies.clear();
+    }
+
+    Span.setTokensOut(ExpandedCache.size());
 }
 
-void MixedComputations::PreCompute(const MacroInfo *MI) {
-    unsigned numArgs = MI->getNumArgs();
+void MixedComputations::ContinueStream() {
+    StreamedExpansion &S = *Stream;
+    StatisticsTimer Timer(S.Counters ? &S.Counters->ExpansionNanoseconds : nullptr);
+    TraceSpan Span(Trace, "ContinueStream", getMacroName(S.MI));
 
-    std::vector<std::vector<MixedToken_ptr_t>> Args(numArgs);
-    for (unsigned i = 0; i != numArgs; ++i) {
-        Args[i] = {std::make_shared<MixedArgToken>(i, false, std::unordered_set<const MacroInfo *>())};
+    ExpandedCache.clear();
 
-        Token Tok;
-        Tok.startToken();
-        Tok.setKind(tok::eof);
-        Args[i].push_back(std::make_shared<CommonToken>(Tok, false));
+    bool Done = false;
+    size_t Base = Depth;
+    while (S.Body.outputSize() <= StreamChunkSize) {
+        if (!PreprocessStep(S.MI, S.Body, S.MA, S.ExpansionStack, false, S.NumParens)) {
+            Done = true;
+            break;
+        }
+        RunFrames(Base);
     }
 
-    MixedMacroArgs MA(*this, MI, Args);
+    if (Done) {
+        ExpandedCache = S.Body.finish();
+    } else {
+        S.Body.flush(ExpandedCache);
+    }
+    ExpandedCacheIter = ExpandedCache.begin();
+    S.TokensOut += ExpandedCache.size();
+    Span.setTokensOut(ExpandedCache.size());
 
-    assert(Definitions.find(MI) != Definitions.end());
+    if (S.Cacheable) {
+        S.Result.insert(S.Result.end(), ExpandedCache.begin(), ExpandedCache.end());
+        if (S.Result.size() > MaxCachedStreamSize) {
+            S.Cacheable = false;
+            std::vector<MixedToken>().swap(S.Result);
+        }
+    }
+
+    // Dependencies only matter to the cache entry, and repeat a lot over a
+    // long expansion.
+    if (S.Cacheable) {
+        UniqueDependencies(S.DependenciesBegin);
+    } else {
+        Dependencies.resize(S.DependenciesBegin);
+    }
+
+    if (!Done) {
+        return;
+    }
+
+    if (S.Cacheable) {
+        Expansions.insert(S.Key, S.Result, Dependencies.begin() + S.DependenciesBegin, Dependencies.end());
+    }
+    if (S.Counters) {
+        S.Counters->TokensOut += S.TokensOut - 1;
+    }
 
-    std::vector<MixedToken_ptr_t>::const_iterator Iter = Definitions[MI].cbegin();
-    auto Tokens = Preprocess(MI, Iter, MA, {}, false);
+    Stream.reset();
+    Dependencies.clear();
+}
+
+bool MixedComputations::StartPreCompute(const MacroInfo *MI) {
+    MacroCounters *Counters = getCounters(MI);
+    if (Counters) {
+        ++Counters->PreComputes;
+    }
 
-    for (auto &TokenPtr : Tokens) {
-        if (!TokenPtr->isCommonToken()) {
-            TokenPtr->setExpanded();
+    Frame &F = pushFrame();
+    F.Timer.emplace(Counters ? &Counters->PreComputeNanoseconds : nullptr);
+    F.Span.emplace(Trace, "PreCompute", getMacroName(MI), MI->getDefinitionLoc());
+    F.DependenciesBegin = Dependencies.size();
+
+    if (DiskCache) {
+        std::vector<MixedToken> Tokens;
+        if (DiskCache->lookup(MacroNames[MI], MI, Tokens, Dependencies)) {
+            if (Counters) {
+                ++Counters->PreComputesShared;
+            }
+            UniqueDependencies(F.DependenciesBegin);
+            Dependency->AddDependencies(MI, Dependencies.begin() + F.DependenciesBegin, Dependencies.end());
+
+            AddPreComputed(MI, std::move(Tokens), Dependencies.begin() + F.DependenciesBegin, Dependencies.end());
+
+            popFrame();
+            return true;
         }
     }
 
-    PreComputed[MI] = Tokens;
+    unsigned numArgs = MI->getNumArgs();
+    for (unsigned i = 0; i != numArgs; ++i) {
+        F.Args.push_back({MixedToken::createArg(i, false, EmptyExpansionStack), EofToken});
+    }
+
+    F.OwnArgs.emplace(*this, MI, F.Args, EmptyExpansionStack, true);
+
+    assert(Definitions.find(MI) != Definitions.end());
+
+    // The body does not depend on where MI is expanded, only MI itself is
+    // disabled in there.
+    PreComputesInProgress.insert(MI);
+    initPreprocess(F, MI, *F.OwnArgs, ExpansionStacks.push(EmptyExpansionStack, MI), false);
+    F.Tokens.reset(Definitions[MI].data());
+    F.Finish = Frame::FF_PreCompute;
+    return false;
 }
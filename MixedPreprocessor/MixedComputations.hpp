@@ -6,69 +6,313 @@
 #define MIXED_PREPROCESSOR_MIXEDCOMPUTATIONS_HPP
 
 
-// #include "MacroDependency.hpp"
+#include "ExpansionCache.hpp"
+#include "ExpansionStack.hpp"
+#include "ExpansionTrace.hpp"
+#include "MacroDependency.hpp"
+#include "MacroStatistics.hpp"
+#include "MemoryAccounting.hpp"
 #include "MixedComputationsPPCallbacks.hpp"
 #include "MixedMacroArgs.hpp"
 #include "MixedToken.hpp"
+#include "PreComputedCache.hpp"
+#include "TokenRewriter.hpp"
 
 #include "clang/Lex/MacroInfo.h"
 #include "clang/Lex/Preprocessor.h"
 #include "clang/Lex/PPCallbacks.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+
+#include <list>
+#include <memory>
 #include <unordered_map>
-#include <unordered_set>
 
 using namespace clang;
 
 
 class MacroDependency;
 class MixedMacroArgs;
-class MixedToken;
-typedef std::shared_ptr<MixedToken> MixedToken_ptr_t;
 
 
 class MixedComputations : PPCallbacks {
     Preprocessor &PP;
-    // std::unique_ptr<MacroDependency> Dependency;
+    std::unique_ptr<MacroDependency> Dependency;
+
+    MixedToken EofToken;
+
+    ExpansionStackTable ExpansionStacks;
+    ExpansionCache Expansions;
+
+    std::unordered_map<const MacroInfo *, std::vector<MixedToken>> Definitions;
+
+    struct PreComputedBody {
+        std::vector<MixedToken> Tokens;
+        // Macros looked up while computing the body.  The body is computed in
+        // the stack of its macro alone, it does not hold for an expansion in a
+        // stack sharing any of them.
+        ExpansionStack_id_t Expands;
+        // Position in PreComputedUses, and the bytes accounted for.
+        std::list<const MacroInfo *>::iterator Use;
+        size_t Bytes;
+    };
+
+    std::unordered_map<const MacroInfo *, PreComputedBody> PreComputed;
+    // Macros of the PreComputed bodies, the most recently used first.
+    std::list<const MacroInfo *> PreComputedUses;
+
+    MemoryAccounting Memory;
+
+    // What an expansion of a PreComputed body involves.
+    enum BodyShape {
+        BS_Constant,        // the body itself
+        BS_Substitution,    // expanded arguments spliced in, no rescan
+        BS_Rescan,          // macro names, # or unbalanced parentheses
+        BS_Paste            // ## operators
+    };
+
+    llvm::DenseMap<const MacroInfo *, BodyShape> BodyShapes;
+
+    // Macros whose PreCompute is under way.  A PreCompute starts over from
+    // the stack of its own macro, so mutually recursive macros would
+    // PreCompute each other without end: their invocations in there rewrite
+    // the definition instead.
+    llvm::SmallPtrSet<const MacroInfo *, 8> PreComputesInProgress;
+
+    // Results of ##, keyed on the spellings of both operands.  Their
+    // whitespace flags are those of the LHS, not kept here.
+    llvm::StringMap<Token> PastedTokens;
+
+    // Operands of residual MTK_StringifySequence tokens, by index.
+    std::vector<std::vector<MixedToken>> StringifySequences;
+
+    // The definition of every macro name known to Definitions.  It differs
+    // from the one of PP after a redefinition identical to the previous one:
+    // the previous MacroInfo is kept along with all the work cached for it.
+    llvm::DenseMap<const IdentifierInfo *, MacroInfo *> Macros;
+    llvm::DenseMap<const MacroInfo *, const IdentifierInfo *> MacroNames;
+
+    std::unique_ptr<PreComputedCache> DiskCache;
 
-    std::unordered_map<const MacroInfo *, std::vector<MixedToken_ptr_t>> Definitions;
-    std::unordered_map<const MacroInfo *, std::vector<MixedToken_ptr_t>> PreComputed;
+    MacroStatistics *Stats;
+    ExpansionTrace *Trace;
 
-    std::vector<MixedToken_ptr_t> ExpandedCache;
-    std::vector<MixedToken_ptr_t>::const_iterator ExpandedCacheIter;
+    // Identifiers looked up by the computations in progress.  Each of them
+    // owns the tail of the vector starting where it began.
+    ExpansionCache::Dependencies_t Dependencies;
+
+    std::vector<MixedToken> ExpandedCache;
+    std::vector<MixedToken>::const_iterator ExpandedCacheIter;
+
+    // The outermost expansion in progress, if it did not complete at once.
+    // Lex refills ExpandedCache from it as its tokens become final, so the
+    // output of the outermost body is never held as a whole.
+    //
+    // Only the outermost body streams.  An expansion nested in it is still
+    // computed to completion by ExpandMacro, then spliced back for rescan,
+    // so peak memory is bounded by the largest nested result, not by the
+    // nesting depth: a macro whose body is a single invocation of a huge one
+    // gains nothing from streaming.
+    struct StreamedExpansion;
+    std::unique_ptr<StreamedExpansion> Stream;
 
     void LexMacro(Token &MacroName, MacroInfo *MI);
 
+    // Runs Stream until ExpandedCache holds a chunk of tokens or the
+    // expansion is complete.
+    void ContinueStream();
+
+    // Work in progress, innermost last.
+    //
+    // Expansions, argument pre-expansions and PreComputes nest arbitrarily
+    // deep, so none of them recurses: the rewrite loop pushes a frame for the
+    // nested work and scans the same token again once it is done.  Frames are
+    // heap-allocated and recycled along with their buffers, only the first
+    // Depth of them are live.
+    struct Frame;
+    std::vector<std::unique_ptr<Frame>> Frames;
+    size_t Depth;
+
+    Frame & pushFrame();
+    void popFrame();
+
+    // Runs the frames above Base to completion.
+    void RunFrames(size_t Base);
+
+    // Makes F a rewrite, its Tokens and Finish are left to the caller.
+    void initPreprocess(
+            Frame &F,
+            const MacroInfo *MI,
+            MixedMacroArgs &MA,
+            ExpansionStack_id_t ExpansionStack,
+            bool inArgument);
+    void FinishPreprocess(Frame &F);
+
+    // Invocation of MI whose name has just been taken from Tokens.  The
+    // result is pushed back to Tokens, or moved to Return if set.
+    void pushExpansion(
+            const Token &MacroName,
+            const MacroInfo *MI,
+            TokenRewriter &Tokens,
+            ExpansionStack_id_t ExpansionStack,
+            const MacroInfo *ParentMI,
+            MixedMacroArgs &ParentArgs,
+            bool Streamed,
+            std::vector<MixedToken> *Return);
+    void pushArgument(Frame &Expansion);
+    void StepExpansion(Frame &F);
+    void FinishExpansion(Frame &F);
+
+    // Sets the body of an expansion frame, unless it has to be PreComputed
+    // first.  Its dependencies are recorded.  Where the PreComputed body does
+    // not hold, the body is the definition, with the shape BS_Rescan.
+    bool ensureBody(Frame &F);
+
+    void pushArgExpansion(MixedMacroArgs &MA, unsigned ArgNum, ExpansionStack_id_t ExpansionStack);
+
+    // Returns false if a frame has been pushed to compute the body.
+    bool StartPreCompute(const MacroInfo *MI);
+
+    BodyShape ClassifyBody(const std::vector<MixedToken> &Body);
+
+    // Sets the PreComputed body of MI, computed with the given dependencies,
+    // and its shape, then keeps the engine within its memory budget.
+    std::vector<MixedToken> & AddPreComputed(
+            const MacroInfo *MI,
+            std::vector<MixedToken> Tokens,
+            ExpansionCache::Dependencies_t::const_iterator DependenciesBegin,
+            ExpansionCache::Dependencies_t::const_iterator DependenciesEnd);
+    void ErasePreComputed(std::unordered_map<const MacroInfo *, PreComputedBody>::iterator It);
+
+    // Measures the structures not accounted for as they change.
+    void MeasureMemory();
+
+    // Evicts the least recently used entries of Expansions, then PreComputed
+    // bodies, until the engine fits in its budget.  Bodies read by a live
+    // frame or by Stream, and the one of Keep, stay.  Nothing is evicted if
+    // that cannot be enough.
+    void EnforceMemoryBudget(const MacroInfo *Keep = nullptr);
+
+    // Expands a BS_Substitution body into Result.  Fails if an expanded
+    // argument has to be rescanned along with the body.
+    bool SubstituteArgs(const std::vector<MixedToken> &Body, MixedMacroArgs &MA, std::vector<MixedToken> &Result);
+
+    // Processes the token under the cursor.  Returns false once the token
+    // under the cursor terminates the rewrite.
+    bool PreprocessStep(
+            const MacroInfo *MI,
+            TokenRewriter &Tokens,
+            MixedMacroArgs &MA,
+            ExpansionStack_id_t ExpansionStack,
+            bool inArgument,
+            unsigned &NumParens);
+
+    // Unexpanded tokens lexed ahead from PP, in order.  The token following
+    // a function-like macro name is peeked there, then taken by LexMacro.
+    llvm::SmallVector<Token, 2> Lookahead;
+
+    // The next unexpanded token, from Lookahead or PP.
+    void LexUnexpanded(Token &Tok);
+    const Token & peekUnexpanded();
+
     bool isNextPPTokenLParen();
 
-    void PreCompute(const MacroInfo *MI);
+    // The function-like macro named by Tok, the last token of a top-level
+    // expansion, if the unexpanded tokens that follow invoke it.  Next is the
+    // position of Tok in ExpandedCache, plus one.
+    MacroInfo * getTrailingMacro(const Token &Tok, std::vector<MixedToken>::const_iterator Next);
+
+    // Removes duplicates from the dependencies recorded since Begin.
+    void UniqueDependencies(size_t Begin);
+
+    void RemoveDefinition(const MacroInfo *MI);
 
 public:
-    MixedComputations(Preprocessor &PP);
+    // With a Store, PreComputed bodies are looked up in and added to it, and
+    // so shared with the other engines using it.
+    MixedComputations(Preprocessor &PP, std::shared_ptr<PreComputedStore> Store = nullptr);
+    ~MixedComputations();
+
+    ExpansionStackTable & getExpansionStacks() { return ExpansionStacks; }
+
+    // Statistics are only collected while set.
+    void setStatistics(MacroStatistics *S) { Stats = S; }
+
+    // Counters of MI, nullptr if statistics are not collected.
+    MacroCounters * getCounters(const MacroInfo *MI);
+
+    // Spans are only recorded while set.
+    void setTrace(ExpansionTrace *T) { Trace = T; }
+    ExpansionTrace * getTrace() const { return Trace; }
+
+    const IdentifierInfo * getMacroName(const MacroInfo *MI) const {
+        auto It = MacroNames.find(MI);
+        return It == MacroNames.end() ? nullptr : It->second;
+    }
 
     bool isDefined(const MacroInfo *MI);
 
+    MacroInfo * getMacroInfo(const IdentifierInfo *II) const {
+        auto It = Macros.find(II);
+        return It == Macros.end() ? nullptr : It->second;
+    }
+
+    // Forgets the PreComputed body of MI, it is computed again on next use.
+    void DropPreComputed(const MacroInfo *MI);
+
+    // Cold cached expansions and PreComputed bodies are evicted beyond
+    // Bytes, unlimited if 0.
+    void setMemoryBudget(size_t Bytes) { Memory.setBudget(Bytes); }
+
+    // The accounting of the engine, measured again.
+    const MemoryAccounting & getMemory() {
+        MeasureMemory();
+        return Memory;
+    }
+
     void MacroDefined(const Token &MacroNameTok, const MacroDirective *MD);
     void MacroUndefined(const Token &MacroNameTok, const MacroDefinition &MD);
 
-    std::vector<MixedToken_ptr_t> Preprocess(
+    std::vector<MixedToken> Preprocess(
             const MacroInfo *MI,
-            std::vector<MixedToken_ptr_t>::const_iterator &TokenIt,
+            TokenRewriter &Tokens,
             MixedMacroArgs &MA,
-            const std::unordered_set<const MacroInfo *> &ExpansionStack,
+            ExpansionStack_id_t ExpansionStack,
             bool inArgument);
 
     bool PasteTokens(const Token &LHS, const Token &RHS, Token &Tok);
 
-    std::vector<MixedToken_ptr_t> ExpandMacro(
+    // # or #@ of Operand: a string literal, or a residual token if Operand
+    // has placeholders or residual tokens.
+    MixedToken Stringify(const std::vector<MixedToken> &Operand, bool Charify);
+
+    const std::vector<MixedToken> & getStringifySequence(unsigned Sequence) const {
+        assert(Sequence < StringifySequences.size());
+        return StringifySequences[Sequence];
+    }
+
+    // Expands an argument of MA into its ExpandedArgs.
+    void ExpandArgument(MixedMacroArgs &MA, unsigned ArgNum, ExpansionStack_id_t ExpansionStack);
+
+    // With Streamed, a result that is not cached is not computed here: Stream
+    // is set up to produce it instead, and the result is empty.
+    std::vector<MixedToken> ExpandMacro(
             const Token &Tok,
             const MacroInfo *MI,
-            std::vector<MixedToken_ptr_t>::const_iterator &TokenIt,
-            const std::unordered_set<const MacroInfo *> &ExpansionStack,
+            TokenRewriter &Tokens,
+            ExpansionStack_id_t ExpansionStack,
             const MacroInfo *ParentMI,
-            MixedMacroArgs &ParentArgs);
+            MixedMacroArgs &ParentArgs,
+            bool Streamed = false);
 
     void Lex(Token &Tok);
+
+    // Lexes up to N tokens into Tokens, stopping after an eof.  Returns the
+    // number of tokens lexed, at least one if N is not 0.
+    size_t LexBatch(Token *Tokens, size_t N);
 };
 
 #endif //MIXED_PREPROCESSOR_MIXEDCOMPUTATIONS_HPP
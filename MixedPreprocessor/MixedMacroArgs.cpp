@@ -4,54 +4,128 @@
 
 #include "MixedMacroArgs.hpp"
 
-#include "clang/Lex/MacroArgs.h"
+#include <iterator>
 
 
-std::vector<MixedToken_ptr_t> MixedMacroArgs::getExpanded(
-        unsigned ArgNum, const std::unordered_set<const MacroInfo *> &ExpansionStack) {
+const std::vector<MixedToken> & MixedMacroArgs::getExpanded(
+        unsigned ArgNum, ExpansionStack_id_t ExpansionStack) {
     assert(ArgNum < Args.size());
 
-    std::unordered_set<const MacroInfo *> NewExpansionStack = ExpansionStack;
-    NewExpansionStack.insert(MI);
-
-    std::vector<MixedToken_ptr_t> Curr = getUnexpanded(ArgNum);
+    if (const std::vector<MixedToken> *Expanded = findExpanded(ArgNum, ExpansionStack)) {
+        return *Expanded;
+    }
 
-    std::vector<MixedToken_ptr_t>::const_iterator Iter = Curr.cbegin();
-    return MC.Preprocess(MI, Iter, *this, NewExpansionStack, false);
+    MC.ExpandArgument(*this, ArgNum, ExpansionStack);
+    return *findExpanded(ArgNum, ExpansionStack);
 }
 
-std::vector<MixedToken_ptr_t> MixedMacroArgs::getUnexpanded(unsigned ArgNum) {
+std::vector<MixedToken> MixedMacroArgs::getUnexpanded(unsigned ArgNum) {
     assert(ArgNum < Args.size());
     return Args[ArgNum];
 }
 
-/*
-MixedToken_ptr_t MixedMacroArgs::getStringified(unsigned ArgNum, bool Charify) {
+MixedToken MixedMacroArgs::getStringified(unsigned ArgNum, bool Charify) {
     assert(ArgNum < Args.size());
 
-    std::vector<MixedToken_ptr_t> Arg = Args[ArgNum];
+    std::unordered_map<unsigned, MixedToken> &Cache = Charify ? CharifiedArgs : StringifiedArgs;
+
+    auto It = Cache.find(ArgNum);
+    if (It != Cache.end()) {
+        return It->second;
+    }
+
+    // A placeholder argument stands for the one the body is applied to.
+    MixedToken Result = Placeholders ? MixedToken::createStringifyArg(ArgNum, Charify)
+                                     : MC.Stringify(Args[ArgNum], Charify);
+
+    return Cache.emplace(ArgNum, Result).first->second;
+}
+
+void MixedMacroArgs::appendSubstituted(const MixedToken &Tok, bool Pasted, std::vector<MixedToken> &Result) {
+    if (Tok.isStringify()) {
+        Result.push_back(resolveStringify(Tok));
+        return;
+    } else if (Tok.getKind() != MixedToken::MTK_Arg) {
+        Result.push_back(Tok);
+        return;
+    }
+
+    // As in a body, an operand of ## is not expanded.
+    std::vector<MixedToken> Arg = Pasted ? getUnexpanded(Tok.getArgNum())
+                                         : getExpanded(Tok.getArgNum(), Tok.getExpansionStack());
 
-    if (!std::all_of(Arg.begin(), Arg.end(),
-            [](MixedToken_ptr_t TokenPtr) { return TokenPtr->isCommonToken(); })) {
-        return std::make_shared<StringifyToken>(ArgNum, Charify);
+    auto End = Arg.end();
+    while (End != Arg.begin() && std::prev(End)->isOneOf(tok::eof, tok::eod)) {
+        --End;
     }
 
-    std::unordered_map<unsigned, Token> &CachedRes = Charify ?
-                                                     CharifiedArgs :
-                                                     StringifiedArgs;
+    Result.insert(Result.end(), Arg.begin(), End);
+}
+
+MixedToken MixedMacroArgs::resolveStringify(const MixedToken &Tok) {
+    MixedToken Result;
+
+    if (Tok.getKind() == MixedToken::MTK_StringifyArg) {
+        Result = getStringified(Tok.getArgNum(), Tok.isCharify());
+        Result.setSpacing(Tok.getSpacing());
+        return Result;
+    }
+
+    auto Key = std::make_pair(Tok.getSequence(), Tok.isCharify());
 
-    if (CachedRes.find(ArgNum) == CachedRes.end()) {
-        Token *Tokens = new Token[Arg.size()];
-        for (size_t i = 0; i != Arg.size(); ++i) {
-            // I am sure it is correct
-            Tokens[i] = reinterpret_cast<CommonToken *>(Arg[i].get())->getTok();
+    auto It = ResolvedSequences.find(Key);
+    if (It != ResolvedSequences.end()) {
+        Result = It->second;
+        Result.setSpacing(Tok.getSpacing());
+        return Result;
+    }
+
+    // The sequence is an argument collected in the body of MI, placeholders
+    // and ## left as they were: substitute and paste them as the body would
+    // have.  Copied, the table grows as nested sequences are resolved.
+    std::vector<MixedToken> Sequence = MC.getStringifySequence(Tok.getSequence());
+    std::vector<MixedToken> Operand;
+    bool LeftEmpty = true;
+
+    for (size_t i = 0; i != Sequence.size(); ++i) {
+        const MixedToken &Curr = Sequence[i];
+
+        if (!Curr.is(tok::hashhash) || !i || i + 1 == Sequence.size()) {
+            size_t Begin = Operand.size();
+            appendSubstituted(Curr, i + 1 != Sequence.size() && Sequence[i + 1].is(tok::hashhash), Operand);
+            LeftEmpty = Begin == Operand.size();
+            continue;
         }
 
-        CachedRes[ArgNum] = MacroArgs::StringifyArgument(
-                Tokens, PP, Charify,
-                Tokens[0].getLocation(), Tokens[Arg.size() - 1].getLocation());
+        size_t RightBegin = Operand.size();
+        appendSubstituted(Sequence[++i], true, Operand);
+        bool RightEmpty = RightBegin == Operand.size();
+
+        // An empty operand is a placemarker: the other one is left as is.
+        if (!LeftEmpty && !RightEmpty) {
+            MixedToken &LHS = Operand[RightBegin - 1];
+            const MixedToken &RHS = Operand[RightBegin];
+
+            if (LHS.isCommonToken() && RHS.isCommonToken()) {
+                Token Pasted = LHS.getTok();
+
+                // A failed paste is diagnosed, both operands are stringified.
+                if (!MC.PasteTokens(LHS.getTok(), RHS.getTok(), Pasted)) {
+                    LHS = Pasted.isAnyIdentifier() ? MixedToken::createIdentifier(Pasted, false, EmptyExpansionStack)
+                                                   : MixedToken::createCommon(Pasted, false);
+                    Operand.erase(Operand.begin() + RightBegin);
+                }
+            } else {
+                Operand.insert(Operand.begin() + RightBegin, Curr);
+            }
+        }
+
+        LeftEmpty = LeftEmpty && RightEmpty;
     }
 
-    return std::make_shared<CommonToken>(CachedRes[ArgNum]);
+    Result = MC.Stringify(Operand, Tok.isCharify());
+    ResolvedSequences.emplace(Key, Result);
+
+    Result.setSpacing(Tok.getSpacing());
+    return Result;
 }
-*/
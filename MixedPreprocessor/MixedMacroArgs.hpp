@@ -12,6 +12,7 @@
 #include "clang/Lex/Preprocessor.h"
 
 #include <map>
+#include <utility>
 #include <vector>
 #include <unordered_map>
 
@@ -19,34 +20,77 @@ using namespace clang;
 
 
 class MixedComputations;
-class MixedToken;
-typedef std::shared_ptr<MixedToken> MixedToken_ptr_t;
 
 
 class MixedMacroArgs {
     MixedComputations &MC;
     const MacroInfo *MI;
 
-    std::vector<std::vector<MixedToken_ptr_t>> Args;
+    std::vector<std::vector<MixedToken>> Args;
 
-    // std::map<std::pair<unsigned, std::unordered_set<const MacroInfo *>>,
-    //        std::vector<MixedToken_ptr_t>> ExpandedArgs;
+    // The stack MI has been invoked in.  Arguments are expanded in it, before
+    // MI itself is disabled.
+    ExpansionStack_id_t ExpansionStack;
 
-    // std::unordered_map<unsigned, Token> CharifiedArgs;
-    // std::unordered_map<unsigned, Token> StringifiedArgs;
+    // The arguments of a PreCompute, each one the placeholder of itself.
+    bool Placeholders;
+
+    // Pre-expanded arguments, filled on first use only, so an argument that is
+    // only an operand of ## is never expanded.
+    std::map<std::pair<unsigned, ExpansionStack_id_t>,
+             std::vector<MixedToken>> ExpandedArgs;
+
+    // Operands of # and #@, filled on first use, and residual ones resolved
+    // with these arguments, by sequence.
+    std::unordered_map<unsigned, MixedToken> CharifiedArgs;
+    std::unordered_map<unsigned, MixedToken> StringifiedArgs;
+    std::map<std::pair<unsigned, bool>, MixedToken> ResolvedSequences;
+
+    // Appends the tokens Tok stands for in a stringify sequence.
+    void appendSubstituted(const MixedToken &Tok, bool Pasted, std::vector<MixedToken> &Result);
 
 public:
     MixedMacroArgs(MixedComputations &MC, const MacroInfo *MI,
-                   const std::vector<std::vector<MixedToken_ptr_t>> &Args) :
-            MC(MC), MI(MI), Args(Args) {}
+                   const std::vector<std::vector<MixedToken>> &Args,
+                   ExpansionStack_id_t ExpansionStack = EmptyExpansionStack,
+                   bool Placeholders = false) :
+            MC(MC), MI(MI), Args(Args), ExpansionStack(ExpansionStack), Placeholders(Placeholders) {}
+
+
+    const MacroInfo * getMacroInfo() const { return MI; }
 
+    ExpansionStack_id_t getExpansionStack() const { return ExpansionStack; }
 
-    std::vector<MixedToken_ptr_t> getExpanded(
+    const std::vector<MixedToken> & getArg(unsigned ArgNum) const {
+        assert(ArgNum < Args.size());
+        return Args[ArgNum];
+    }
+
+    // The pre-expanded argument, nullptr if it has not been expanded yet.
+    const std::vector<MixedToken> * findExpanded(unsigned ArgNum, ExpansionStack_id_t ExpansionStack) const {
+        auto It = ExpandedArgs.find(std::make_pair(ArgNum, ExpansionStack));
+        return It == ExpandedArgs.end() ? nullptr : &It->second;
+    }
+
+    void addExpanded(unsigned ArgNum, ExpansionStack_id_t ExpansionStack, std::vector<MixedToken> Expanded) {
+        ExpandedArgs[std::make_pair(ArgNum, ExpansionStack)] = std::move(Expanded);
+    }
+
+    // The pre-expanded argument, expanded to completion if needed.  The
+    // rewrite loop does not wait on it, it schedules the expansion instead.
+    const std::vector<MixedToken> & getExpanded(
             unsigned ArgNum,
-            const std::unordered_set<const MacroInfo *> &ExpansionStack);
+            ExpansionStack_id_t ExpansionStack);
+
+
+    std::vector<MixedToken> getUnexpanded(unsigned ArgNum);
 
+    // The string literal for # or #@ of an argument, or a residual token if
+    // the argument is not known yet.
+    MixedToken getStringified(unsigned ArgNum, bool Charify);
 
-    std::vector<MixedToken_ptr_t> getUnexpanded(unsigned ArgNum);
+    // Resolves an expanded residual token of the macro of these arguments.
+    MixedToken resolveStringify(const MixedToken &Tok);
 };
 
 
@@ -3,50 +3,25 @@
 
 
 #include "MixedToken.hpp"
+#include "MixedMacroArgs.hpp"
 
 
-std::vector<MixedToken_ptr_t> CommonToken::getExpanded(MixedMacroArgs &Args) const {
-    return {std::make_shared<CommonToken>(getTok(), isExpanded())};
-}
-
-std::vector<MixedToken_ptr_t> CommonToken::getUnexpanded(MixedMacroArgs &Args) const {
-    return {std::make_shared<CommonToken>(getTok(), true)};
-}
-
-void CommonToken::addExpansionStack(const std::unordered_set<const MacroInfo *> &Stack) {
-
-}
-
-std::vector<MixedToken_ptr_t> IdentifierArgToken::getExpanded(MixedMacroArgs &Args) const {
-    return {std::make_shared<IdentifierArgToken>(getTok(), true, ExpansionStack)};
-}
-
-std::vector<MixedToken_ptr_t> IdentifierArgToken::getUnexpanded(MixedMacroArgs &Args) const {
-    return {std::make_shared<IdentifierArgToken>(getTok(), isExpanded(), ExpansionStack)};
-}
-
-void IdentifierArgToken::addExpansionStack(const std::unordered_set<const MacroInfo *> &Stack) {
-    for (auto MI : Stack) {
-        ExpansionStack.insert(MI);
+// The Expanded flag only matters for placeholders and residual tokens, a
+// common token or an identifier stands for itself.
+std::vector<MixedToken> MixedToken::getExpanded(MixedMacroArgs &Args) const {
+    if (Kind == MTK_Arg) {
+        return Args.getExpanded(Data.Index, ExpansionStack);
+    } else if (isStringify() && Expanded) {
+        return {Args.resolveStringify(*this)};
     }
+    return {*this};
 }
 
-std::vector<MixedToken_ptr_t> MixedArgToken::getExpanded(MixedMacroArgs &Args) const {
-    return Args.getExpanded(ArgNum, ExpansionStack);
-}
-
-std::vector<MixedToken_ptr_t> MixedArgToken::getUnexpanded(MixedMacroArgs &Args) const {
-    return Args.getUnexpanded(ArgNum);
-}
-
-void MixedArgToken::addExpansionStack(const std::unordered_set<const MacroInfo *> &Stack) {
-    for (auto MI : Stack) {
-        ExpansionStack.insert(MI);
+std::vector<MixedToken> MixedToken::getUnexpanded(MixedMacroArgs &Args) const {
+    if (Kind == MTK_Arg) {
+        return Args.getUnexpanded(Data.Index);
+    } else if (isStringify() && Expanded) {
+        return {Args.resolveStringify(*this)};
     }
+    return {*this};
 }
-
-/*
-std::vector<MixedToken_ptr_t> StringifyToken::getExpanded(MixedMacroArgs &Args) {
-    return {Args.getStringified(ArgNum, Charify)};
-}
-*/
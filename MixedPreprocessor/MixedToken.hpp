@@ -6,117 +6,181 @@
 #define MIXED_PREPROCESSOR_MIXEDTOKEN_HPP
 
 
-#include "MixedMacroArgs.hpp"
+#include "ExpansionStack.hpp"
 
 #include "clang/Lex/MacroInfo.h"
 #include "clang/Lex/Token.h"
 #include "clang/Basic/TokenKinds.h"
 
-#include <memory>
+#include <type_traits>
 #include <vector>
-#include <unordered_set>
 
 using namespace clang;
 
 
 class MixedMacroArgs;
-class MixedToken;
-typedef std::shared_ptr<MixedToken> MixedToken_ptr_t;
 
 
+// A token of a macro computation, stored by value.
+//
+// A MixedToken is one of:
+//  - a common token, a clang Token standing for itself;
+//  - an identifier, which may still turn out to be a macro name: the Token
+//    and the ExpansionStack it has been produced in;
+//  - an argument placeholder: the number of a macro argument, which is
+//    substituted when the computation is applied to actual arguments;
+//  - a residual # or #@: the stringified form of an argument, or of a
+//    sequence of the stringify table of MixedComputations, which is not known
+//    until the placeholders there are substituted.
+//
+// The kind is a tag rather than a dynamic type, so that predicates of the
+// rescan loop are inlined and token vectors are plain contiguous arrays.
 class MixedToken {
-protected:
-    bool Expanded;
-
 public:
-    MixedToken(bool Expanded) : Expanded(Expanded) {}
-    virtual ~MixedToken() {}
-
-    virtual std::vector<MixedToken_ptr_t> getExpanded(MixedMacroArgs &Args) const = 0;
-    virtual std::vector<MixedToken_ptr_t> getUnexpanded(MixedMacroArgs &Args) const = 0;
-    virtual void addExpansionStack(const std::unordered_set<const MacroInfo *> &Stack) = 0;
+    enum MixedTokenKind : unsigned char {
+        MTK_Common,
+        MTK_Identifier,
+        MTK_Arg,
+        MTK_StringifyArg,
+        MTK_StringifySequence
+    };
+
+private:
+    struct PlaceholderData {
+        unsigned Index;         // argument number, or stringify sequence
+        unsigned short Spacing; // StartOfLine and LeadingSpace of a residual #
+        bool Charify;
+    };
+
+    union {
+        Token Tok;              // MTK_Common, MTK_Identifier
+        PlaceholderData Data;   // MTK_Arg, MTK_StringifyArg, MTK_StringifySequence
+    };
+    ExpansionStack_id_t ExpansionStack;
+    MixedTokenKind Kind;
+    bool Expanded;
 
-    bool isExpanded() const { return Expanded; }
-    void setExpanded() { Expanded = true; }
+    MixedToken(MixedTokenKind Kind, bool Expanded, ExpansionStack_id_t ExpansionStack) :
+            ExpansionStack(ExpansionStack), Kind(Kind), Expanded(Expanded) {}
 
-    virtual bool isAnyIdentifier() const = 0;
-    virtual IdentifierInfo * getIdentifierInfo() const = 0;
+public:
+    MixedToken() = default;
 
-    virtual bool is(tok::TokenKind K) const = 0;
-    virtual bool isNot(tok::TokenKind K) const = 0;
-    virtual bool isOneOf(tok::TokenKind K1, tok::TokenKind K2) const = 0;
+    static MixedToken createCommon(const Token &Tok, bool Expanded) {
+        MixedToken Result(MTK_Common, Expanded, EmptyExpansionStack);
+        Result.Tok = Tok;
+        return Result;
+    }
 
-    virtual bool isCommonToken() const = 0;
-};
+    static MixedToken createIdentifier(const Token &Tok, bool Expanded, ExpansionStack_id_t ExpansionStack) {
+        assert(Tok.getIdentifierInfo());
+        MixedToken Result(MTK_Identifier, Expanded, ExpansionStack);
+        Result.Tok = Tok;
+        return Result;
+    }
 
-class CommonToken : public MixedToken {
-    const Token Tok;
+    static MixedToken createArg(unsigned ArgNum, bool Expanded, ExpansionStack_id_t ExpansionStack) {
+        MixedToken Result(MTK_Arg, Expanded, ExpansionStack);
+        Result.Data.Index = ArgNum;
+        Result.Data.Spacing = 0;
+        Result.Data.Charify = false;
+        return Result;
+    }
 
-public:
-    CommonToken(const Token &Tok, bool Expanded) : MixedToken(Expanded), Tok(Tok) {}
+    // Residual tokens are created unexpanded: they are resolved by the
+    // arguments of the macro whose PreComputed body they end up in.
+    static MixedToken createStringifyArg(unsigned ArgNum, bool Charify) {
+        MixedToken Result(MTK_StringifyArg, false, EmptyExpansionStack);
+        Result.Data.Index = ArgNum;
+        Result.Data.Spacing = 0;
+        Result.Data.Charify = Charify;
+        return Result;
+    }
 
-    std::vector<MixedToken_ptr_t> getExpanded(MixedMacroArgs &Args) const override;
-    std::vector<MixedToken_ptr_t> getUnexpanded(MixedMacroArgs &Args) const override;
-    void addExpansionStack(const std::unordered_set<const MacroInfo *> &Stack) override;
+    static MixedToken createStringifySequence(unsigned Sequence, bool Charify) {
+        MixedToken Result(MTK_StringifySequence, false, EmptyExpansionStack);
+        Result.Data.Index = Sequence;
+        Result.Data.Spacing = 0;
+        Result.Data.Charify = Charify;
+        return Result;
+    }
 
-    bool isAnyIdentifier() const override { return Tok.isAnyIdentifier(); }
-    IdentifierInfo * getIdentifierInfo() const override { return Tok.getIdentifierInfo(); }
+    std::vector<MixedToken> getExpanded(MixedMacroArgs &Args) const;
+    std::vector<MixedToken> getUnexpanded(MixedMacroArgs &Args) const;
 
-    bool is(tok::TokenKind K) const override { return Tok.is(K); }
-    bool isNot(tok::TokenKind K) const override { return Tok.isNot(K); }
-    bool isOneOf(tok::TokenKind K1, tok::TokenKind K2) const override { return Tok.isOneOf(K1, K2); }
+    MixedTokenKind getKind() const { return Kind; }
 
-    bool isCommonToken() const override { return true; };
+    bool isExpanded() const { return Expanded; }
+    void setExpanded() { Expanded = true; }
 
-    const Token & getTok() const { return Tok; }
-};
+    // Common tokens and identifiers.
+    bool isCommonToken() const { return Kind == MTK_Common || Kind == MTK_Identifier; }
 
-class IdentifierArgToken : public CommonToken {
-    std::unordered_set<const MacroInfo *> ExpansionStack;
+    bool isStringify() const { return Kind == MTK_StringifyArg || Kind == MTK_StringifySequence; }
+    bool isCharify() const {
+        assert(isStringify());
+        return Data.Charify;
+    }
 
-public:
-    IdentifierArgToken(const Token &Tok, bool Expanded,
-                       const std::unordered_set<const MacroInfo *> &ExpansionStack) :
-            CommonToken(Tok, Expanded), ExpansionStack(ExpansionStack) {
-        assert(Tok.getIdentifierInfo());
+    // Whitespace before the token.  A residual token hands it over to the
+    // token it is resolved to.
+    unsigned short getSpacing() const {
+        return isCommonToken() ? Tok.getFlags() & (Token::StartOfLine | Token::LeadingSpace)
+                               : Data.Spacing;
     }
 
-    std::vector<MixedToken_ptr_t> getExpanded(MixedMacroArgs &Args) const override;
-    std::vector<MixedToken_ptr_t> getUnexpanded(MixedMacroArgs &Args) const override;
-    void addExpansionStack(const std::unordered_set<const MacroInfo *> &Stack) override;
+    void setSpacing(unsigned short Spacing) {
+        if (isCommonToken()) {
+            Tok.clearFlag(Token::StartOfLine);
+            Tok.clearFlag(Token::LeadingSpace);
+            Tok.setFlag(static_cast<Token::TokenFlags>(Spacing));
+        } else {
+            Data.Spacing = Spacing;
+        }
+    }
 
-    bool isAnyIdentifier() const override { return true; }
-};
+    const Token & getTok() const {
+        assert(isCommonToken());
+        return Tok;
+    }
 
-class MixedArgToken : public MixedToken {
-    const unsigned ArgNum;
-    std::unordered_set<const MacroInfo *> ExpansionStack;
+    // C99 6.10.3.4p2: the token is never again expanded as a macro name.
+    void setExpandDisabled() {
+        assert(isCommonToken());
+        Tok.setFlag(Token::DisableExpand);
+    }
 
-public:
-    MixedArgToken(unsigned getArgNum, bool Expanded,
-                  const std::unordered_set<const MacroInfo *> &ExpansionStack) :
-            MixedToken(Expanded), ArgNum(getArgNum), ExpansionStack(ExpansionStack) {}
+    bool isAnyIdentifier() const {
+        return Kind == MTK_Identifier || (Kind == MTK_Common && Tok.isAnyIdentifier());
+    }
 
-    std::vector<MixedToken_ptr_t> getExpanded(MixedMacroArgs &Args) const override;
-    std::vector<MixedToken_ptr_t> getUnexpanded(MixedMacroArgs &Args) const override;
-    void addExpansionStack(const std::unordered_set<const MacroInfo *> &Stack) override;
+    IdentifierInfo * getIdentifierInfo() const {
+        return isCommonToken() ? Tok.getIdentifierInfo() : nullptr;
+    }
 
-    bool isAnyIdentifier() const override { return false; }
-    IdentifierInfo * getIdentifierInfo() const override { return nullptr; }
+    // Placeholders and residual tokens are none of the token kinds.
+    bool is(tok::TokenKind K) const { return isCommonToken() && Tok.is(K); }
+    bool isNot(tok::TokenKind K) const { return !isCommonToken() || Tok.isNot(K); }
+    bool isOneOf(tok::TokenKind K1, tok::TokenKind K2) const { return isCommonToken() && Tok.isOneOf(K1, K2); }
 
-    bool is(tok::TokenKind K) const override { return false; }
-    bool isNot(tok::TokenKind K) const override { return false; }
-    bool isOneOf(tok::TokenKind K1, tok::TokenKind K2) const override { return false; }
+    // Identifiers and placeholders.
+    ExpansionStack_id_t getExpansionStack() const {
+        assert(Kind == MTK_Identifier || Kind == MTK_Arg);
+        return ExpansionStack;
+    }
 
-    bool isCommonToken() const override { return false; }
-};
+    unsigned getArgNum() const {
+        assert(Kind == MTK_Arg || Kind == MTK_StringifyArg);
+        return Data.Index;
+    }
 
-/*
-class StringifyToken : public MixedToken {
-    std::vector<MixedToken_ptr_t> Tokens;
-    const bool Charify;
+    unsigned getSequence() const {
+        assert(Kind == MTK_StringifySequence);
+        return Data.Index;
+    }
 };
-*/
 
+static_assert(std::is_trivially_copyable<MixedToken>::value, "MixedToken is copied as raw memory");
+static_assert(sizeof(MixedToken) <= 32, "MixedToken is expected to fit in 32 bytes");
 
 #endif //MIXED_PREPROCESSOR_MIXEDTOKEN_HPP
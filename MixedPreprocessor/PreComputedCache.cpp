@@ -0,0 +1,588 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "PreComputedCache.hpp"
+#include "MixedComputations.hpp"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+// The file is a header
+//
+//   char[4] Magic
+//   uint32 Version
+//   uint32 ByteOrder                     ByteOrderMark as written
+//   uint64 TokenTableHash                of the token kinds of the writer
+//
+// followed by entries, each of them being
+//
+//   uint32 Size                          of the rest of the entry
+//   uint64 Fingerprint
+//   uint32 NameLength, Name
+//   uint32 NumDependencies, {uint64 Fingerprint, uint32 NameLength, Name}...
+//   uint32 SpellingsLength, Spellings
+//   uint32 NumTokens, StoredToken...
+//
+// in native byte order: the cache is not meant to be moved between machines.
+// A file written with another byte order, or by a build whose token kinds
+// differ, is ignored as a whole and replaced by the next save.
+static const char Magic[4] = {'M', 'P', 'P', 'C'};
+static const uint32_t Version = 4;
+static const uint32_t ByteOrderMark = 0x01020304;
+
+static const char *FileName = "precomputed.cache";
+
+// Entries kept for one macro name.
+static const size_t MaxEntriesPerName = 8;
+
+namespace {
+
+enum StoredTokenType : uint8_t {
+    STT_Common,       // MTK_Common without IdentifierInfo
+    STT_Keyword,      // MTK_Common with IdentifierInfo
+    STT_Identifier,   // MTK_Identifier
+    STT_Arg,          // MTK_Arg
+    STT_StringifyArg  // MTK_StringifyArg, Kind is Charify
+};
+
+struct StoredToken {
+    uint8_t Type;
+    uint8_t Expanded;
+    uint16_t Kind;
+    uint16_t Flags;
+    uint16_t Padding;
+    uint32_t Offset;    // into Spellings, or ArgNum for STT_Arg and STT_StringifyArg
+    uint32_t Length;
+};
+
+// Bounds-checked reader over an entry, a truncated or otherwise corrupt
+// entry just fails to validate.
+class EntryReader {
+    const char *Ptr;
+    const char *End;
+    bool Failed;
+
+public:
+    explicit EntryReader(StringRef Data) : Ptr(Data.begin()), End(Data.end()), Failed(false) {}
+
+    bool failed() const { return Failed; }
+
+    const char * position() const { return Ptr; }
+
+    size_t remaining() const { return End - Ptr; }
+
+    template <typename T>
+    T read() {
+        T Value = T();
+        if (Failed || size_t(End - Ptr) < sizeof(T)) {
+            Failed = true;
+            return Value;
+        }
+        memcpy(&Value, Ptr, sizeof(T));
+        Ptr += sizeof(T);
+        return Value;
+    }
+
+    StringRef readString() {
+        uint32_t Length = read<uint32_t>();
+        if (Failed || size_t(End - Ptr) < Length) {
+            Failed = true;
+            return StringRef();
+        }
+        StringRef Result(Ptr, Length);
+        Ptr += Length;
+        return Result;
+    }
+};
+
+}
+
+
+template <typename T>
+static void write(llvm::raw_ostream &OS, const T &Value) {
+    OS.write(reinterpret_cast<const char *>(&Value), sizeof(T));
+}
+
+static void writeString(llvm::raw_ostream &OS, StringRef String) {
+    write(OS, static_cast<uint32_t>(String.size()));
+    OS << String;
+}
+
+// 64-bit FNV-1a.
+static void hash(uint64_t &Hash, StringRef Data) {
+    for (unsigned char C : Data) {
+        Hash ^= C;
+        Hash *= 0x100000001b3ULL;
+    }
+}
+
+template <typename T>
+static void hash(uint64_t &Hash, const T &Value) {
+    hash(Hash, StringRef(reinterpret_cast<const char *>(&Value), sizeof(T)));
+}
+
+
+// Hash of the token kinds of this build, as StoredToken::Kind refers to them.
+static uint64_t getTokenTableHash() {
+    static const uint64_t TableHash = [] {
+        uint64_t Hash = 0xcbf29ce484222325ULL;
+        hash(Hash, static_cast<uint32_t>(tok::NUM_TOKENS));
+        hash(Hash, static_cast<uint32_t>(sizeof(StoredToken)));
+        for (unsigned Kind = 0; Kind != tok::NUM_TOKENS; ++Kind) {
+            hash(Hash, StringRef(tok::getTokenName(static_cast<tok::TokenKind>(Kind))));
+            hash(Hash, '\0');
+        }
+        return Hash;
+    }();
+    return TableHash;
+}
+
+// The fingerprint, name and dependencies at the head of an entry, which
+// tell what it was computed for.
+static StringRef getEntryKey(StringRef Entry) {
+    EntryReader Reader(Entry);
+    Reader.read<uint64_t>();
+    Reader.readString();
+    uint32_t NumDependencies = Reader.read<uint32_t>();
+    for (uint32_t i = 0; i != NumDependencies && !Reader.failed(); ++i) {
+        Reader.read<uint64_t>();
+        Reader.readString();
+    }
+    return Reader.failed() ? Entry : StringRef(Entry.begin(), Reader.position() - Entry.begin());
+}
+
+
+PreComputedStore::PreComputedStore(StringRef Directory) : Dirty(false) {
+    if (Directory.empty()) {
+        return;
+    }
+
+    SmallString<256> FilePath(Directory);
+    llvm::sys::path::append(FilePath, FileName);
+    Path = FilePath.str().str();
+
+    load();
+}
+
+PreComputedStore::~PreComputedStore() {
+    save();
+}
+
+void PreComputedStore::load() {
+    auto File = llvm::MemoryBuffer::getFile(Path, -1, false);
+    if (!File) {
+        return;
+    }
+    Buffer = std::move(File.get());
+
+    EntryReader Header(Buffer->getBuffer());
+    char FileMagic[sizeof(Magic)];
+    for (auto &C : FileMagic) {
+        C = Header.read<char>();
+    }
+    uint32_t FileVersion = Header.read<uint32_t>();
+    uint32_t FileByteOrder = Header.read<uint32_t>();
+    uint64_t FileTokenTableHash = Header.read<uint64_t>();
+    if (Header.failed() || memcmp(FileMagic, Magic, sizeof(Magic)) || FileVersion != Version ||
+            FileByteOrder != ByteOrderMark || FileTokenTableHash != getTokenTableHash()) {
+        Buffer.reset();
+        return;
+    }
+
+    const char *Ptr = Header.position();
+    const char *End = Buffer->getBufferEnd();
+
+    while (Ptr != End) {
+        uint32_t Size;
+        if (size_t(End - Ptr) < sizeof(Size)) {
+            break;
+        }
+        memcpy(&Size, Ptr, sizeof(Size));
+        Ptr += sizeof(Size);
+        if (size_t(End - Ptr) < Size) {
+            break;
+        }
+
+        StringRef Entry(Ptr, Size);
+        Ptr += Size;
+
+        EntryReader Reader(Entry);
+        Reader.read<uint64_t>();
+        StringRef Name = Reader.readString();
+        if (!Reader.failed()) {
+            auto &NameEntries = Entries[Name];
+            if (NameEntries.size() < MaxEntriesPerName) {
+                NameEntries.push_back({Entry, nullptr});
+            }
+        }
+    }
+}
+
+void PreComputedStore::save() {
+    if (Path.empty()) {
+        return;
+    }
+
+    // Lookups go on while the file is written, from a snapshot.
+    std::lock_guard<std::mutex> SaveGuard(SaveMutex);
+    std::vector<Entry> Snapshot;
+    {
+        llvm::sys::ScopedWriter Guard(Mutex);
+        if (!Dirty) {
+            return;
+        }
+        Dirty = false;
+
+        for (auto &Name : Entries) {
+            Snapshot.insert(Snapshot.end(), Name.second.begin(), Name.second.end());
+        }
+    }
+
+    SmallString<256> Directory(Path);
+    llvm::sys::path::remove_filename(Directory);
+    if (llvm::sys::fs::create_directories(Directory)) {
+        return;
+    }
+
+    int FD;
+    SmallString<256> TempPath;
+    if (llvm::sys::fs::createUniqueFile(Path + "-%%%%%%%%", FD, TempPath)) {
+        return;
+    }
+
+    {
+        llvm::raw_fd_ostream OS(FD, true);
+
+        OS.write(Magic, sizeof(Magic));
+        write(OS, Version);
+        write(OS, ByteOrderMark);
+        write(OS, getTokenTableHash());
+
+        for (auto &Entry : Snapshot) {
+            write(OS, static_cast<uint32_t>(Entry.Data.size()));
+            OS << Entry.Data;
+        }
+
+        if (OS.has_error()) {
+            OS.clear_error();
+            llvm::sys::fs::remove(TempPath);
+            return;
+        }
+    }
+
+    // The old file stays mapped, Buffer is still valid.
+    if (llvm::sys::fs::rename(TempPath, Path)) {
+        llvm::sys::fs::remove(TempPath);
+    }
+}
+
+std::vector<PreComputedStore::Entry> PreComputedStore::find(StringRef Name) {
+    llvm::sys::ScopedReader Guard(Mutex);
+    auto It = Entries.find(Name);
+    return It == Entries.end() ? std::vector<Entry>() : It->second;
+}
+
+void PreComputedStore::add(StringRef Name, std::string Data) {
+    auto Owner = std::make_shared<const std::string>(std::move(Data));
+    Entry New = {*Owner, Owner};
+    StringRef Key = getEntryKey(New.Data);
+
+    llvm::sys::ScopedWriter Guard(Mutex);
+
+    auto &NameEntries = Entries[Name];
+    NameEntries.erase(
+            std::remove_if(NameEntries.begin(), NameEntries.end(), [&](const Entry &Existing) {
+                return getEntryKey(Existing.Data) == Key;
+            }),
+            NameEntries.end());
+
+    NameEntries.insert(NameEntries.begin(), std::move(New));
+    if (NameEntries.size() > MaxEntriesPerName) {
+        NameEntries.pop_back();
+    }
+    Dirty = true;
+}
+
+
+PreComputedCache::PreComputedCache(
+        MixedComputations &MC, Preprocessor &PP, std::shared_ptr<PreComputedStore> Store) :
+        MC(MC), PP(PP), Store(std::move(Store)) {}
+
+uint64_t PreComputedCache::getFingerprint(const MacroInfo *MI) {
+    if (!MI) {
+        return 0;
+    }
+
+    auto It = Fingerprints.find(MI);
+    if (It != Fingerprints.end()) {
+        return It->second;
+    }
+
+    uint64_t Hash = 0xcbf29ce484222325ULL;
+    SmallString<64> SpellingBuffer;
+
+    hash(Hash, MI->isFunctionLike());
+    hash(Hash, MI->isC99Varargs());
+    hash(Hash, MI->isGNUVarargs());
+    hash(Hash, MI->getNumArgs());
+    for (auto Arg = MI->arg_begin(); Arg != MI->arg_end(); ++Arg) {
+        hash(Hash, (*Arg)->getName());
+        hash(Hash, '\0');
+    }
+
+    for (auto Tok = MI->tokens_begin(); Tok != MI->tokens_end(); ++Tok) {
+        hash(Hash, static_cast<uint16_t>(Tok->getKind()));
+        hash(Hash, Tok->hasLeadingSpace());
+
+        StringRef Spelling = Tok->getIdentifierInfo() ? Tok->getIdentifierInfo()->getName()
+                                                      : PP.getSpelling(*Tok, SpellingBuffer);
+        hash(Hash, Spelling);
+        hash(Hash, '\0');
+    }
+
+    // Zero stands for no definition.
+    Hash |= 1;
+
+    Fingerprints[MI] = Hash;
+    return Hash;
+}
+
+bool PreComputedCache::lookup(
+        const IdentifierInfo *Name,
+        const MacroInfo *MI,
+        std::vector<MixedToken> &Tokens,
+        ExpansionCache::Dependencies_t &Dependencies) {
+    std::vector<PreComputedStore::Entry> Entries = Store->find(Name->getName());
+    if (Entries.empty()) {
+        return false;
+    }
+
+    uint64_t Fingerprint = getFingerprint(MI);
+
+    for (auto &Entry : Entries) {
+        if (materialize(Entry.Data, MI, Fingerprint, Tokens, Dependencies)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool PreComputedCache::materialize(
+        StringRef Entry,
+        const MacroInfo *MI,
+        uint64_t Fingerprint,
+        std::vector<MixedToken> &Tokens,
+        ExpansionCache::Dependencies_t &Dependencies) {
+    EntryReader Reader(Entry);
+
+    if (Reader.read<uint64_t>() != Fingerprint) {
+        return false;
+    }
+    Reader.readString();
+
+    ExpansionCache::Dependencies_t EntryDependencies;
+
+    uint32_t NumDependencies = Reader.read<uint32_t>();
+    for (uint32_t i = 0; i != NumDependencies && !Reader.failed(); ++i) {
+        uint64_t DependencyFingerprint = Reader.read<uint64_t>();
+        StringRef DependencyName = Reader.readString();
+        if (Reader.failed()) {
+            return false;
+        }
+
+        const IdentifierInfo *II = PP.getIdentifierInfo(DependencyName);
+        if (getFingerprint(MC.getMacroInfo(II)) != DependencyFingerprint) {
+            return false;
+        }
+
+        EntryDependencies.push_back(II);
+    }
+
+    StringRef Spellings = Reader.readString();
+    uint32_t NumTokens = Reader.read<uint32_t>();
+    if (Reader.failed() || NumTokens > Reader.remaining() / sizeof(StoredToken)) {
+        return false;
+    }
+
+    // Nothing of a token is trusted before it is used: the file may have
+    // been truncated or overwritten.
+    std::vector<StoredToken> StoredTokens(NumTokens);
+    for (auto &Stored : StoredTokens) {
+        Stored = Reader.read<StoredToken>();
+        if (Reader.failed()) {
+            return false;
+        }
+
+        switch (Stored.Type) {
+        case STT_Arg:
+        case STT_StringifyArg:
+            if (Stored.Offset >= MI->getNumArgs() || (Stored.Type == STT_StringifyArg && Stored.Kind > 1)) {
+                return false;
+            }
+            break;
+        case STT_Common:
+        case STT_Keyword:
+        case STT_Identifier:
+            if (Stored.Kind >= tok::NUM_TOKENS || (Stored.Flags & Token::NeedsCleaning) ||
+                    Stored.Offset + uint64_t(Stored.Length) > Spellings.size() ||
+                    (Stored.Type != STT_Common && !Stored.Length)) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+
+    // All spellings of the entry go to the scratch buffer at once, tokens
+    // point into it.
+    Token Base;
+    Base.startToken();
+    Base.setKind(tok::string_literal);
+    if (!Spellings.empty()) {
+        PP.CreateString(Spellings, Base);
+    }
+
+    ExpansionStack_id_t ExpansionStack = MC.getExpansionStacks().push(EmptyExpansionStack, MI);
+
+    for (auto &Stored : StoredTokens) {
+        if (Stored.Type == STT_Arg) {
+            Tokens.push_back(MixedToken::createArg(Stored.Offset, Stored.Expanded, ExpansionStack));
+            continue;
+        } else if (Stored.Type == STT_StringifyArg) {
+            MixedToken Residual = MixedToken::createStringifyArg(Stored.Offset, Stored.Kind);
+            Residual.setSpacing(Stored.Flags);
+            if (Stored.Expanded) {
+                Residual.setExpanded();
+            }
+            Tokens.push_back(Residual);
+            continue;
+        }
+
+        Token Tok;
+        Tok.startToken();
+        Tok.setKind(static_cast<tok::TokenKind>(Stored.Kind));
+        Tok.setFlag(static_cast<Token::TokenFlags>(Stored.Flags));
+
+        if (Stored.Length) {
+            Tok.setLocation(Base.getLocation().getLocWithOffset(Stored.Offset));
+            Tok.setLength(Stored.Length);
+        }
+
+        const char *Spelling = Base.getLiteralData() + Stored.Offset;
+
+        if (Stored.Type == STT_Identifier || Stored.Type == STT_Keyword) {
+            Tok.setIdentifierInfo(PP.getIdentifierInfo(StringRef(Spelling, Stored.Length)));
+        } else if (Tok.isLiteral()) {
+            Tok.setLiteralData(Spelling);
+        }
+
+        if (Stored.Type == STT_Identifier) {
+            Tokens.push_back(MixedToken::createIdentifier(Tok, Stored.Expanded, ExpansionStack));
+        } else {
+            Tokens.push_back(MixedToken::createCommon(Tok, Stored.Expanded));
+        }
+    }
+
+    Dependencies.insert(Dependencies.end(), EntryDependencies.begin(), EntryDependencies.end());
+    return true;
+}
+
+void PreComputedCache::store(
+        const IdentifierInfo *Name,
+        const MacroInfo *MI,
+        const std::vector<MixedToken> &Tokens,
+        ExpansionCache::Dependencies_t::const_iterator DependenciesBegin,
+        ExpansionCache::Dependencies_t::const_iterator DependenciesEnd) {
+    uint64_t Fingerprint = getFingerprint(MI);
+
+    std::string Spellings;
+    std::vector<StoredToken> StoredTokens;
+    SmallString<64> SpellingBuffer;
+
+    for (auto &MixedTok : Tokens) {
+        StoredToken Stored;
+        memset(&Stored, 0, sizeof(Stored));
+        Stored.Expanded = MixedTok.isExpanded();
+
+        if (MixedTok.getKind() == MixedToken::MTK_Arg) {
+            Stored.Type = STT_Arg;
+            Stored.Offset = MixedTok.getArgNum();
+            StoredTokens.push_back(Stored);
+            continue;
+        } else if (MixedTok.getKind() == MixedToken::MTK_StringifyArg) {
+            Stored.Type = STT_StringifyArg;
+            Stored.Kind = MixedTok.isCharify();
+            Stored.Flags = MixedTok.getSpacing();
+            Stored.Offset = MixedTok.getArgNum();
+            StoredTokens.push_back(Stored);
+            continue;
+        } else if (MixedTok.isStringify()) {
+            // Stringify sequences only live as long as the engine.
+            return;
+        }
+
+        const Token &Tok = MixedTok.getTok();
+
+        if (MixedTok.getKind() == MixedToken::MTK_Identifier) {
+            Stored.Type = STT_Identifier;
+        } else if (Tok.getIdentifierInfo()) {
+            Stored.Type = STT_Keyword;
+        } else {
+            Stored.Type = STT_Common;
+        }
+
+        Stored.Kind = Tok.getKind();
+        // Spellings are stored clean.
+        Stored.Flags = Tok.getFlags() & ~Token::NeedsCleaning;
+
+        if (!Tok.isOneOf(tok::eof, tok::eod)) {
+            StringRef Spelling = Tok.getIdentifierInfo() ? Tok.getIdentifierInfo()->getName()
+                                                         : PP.getSpelling(Tok, SpellingBuffer);
+            Stored.Offset = Spellings.size();
+            Stored.Length = Spelling.size();
+            Spellings.append(Spelling.data(), Spelling.size());
+        }
+
+        StoredTokens.push_back(Stored);
+    }
+
+    std::string Entry;
+    llvm::raw_string_ostream OS(Entry);
+
+    write(OS, Fingerprint);
+    writeString(OS, Name->getName());
+
+    // Sorted by name, so that the entries of the same body in different
+    // translation units have the same key.
+    std::vector<const IdentifierInfo *> SortedDependencies(DependenciesBegin, DependenciesEnd);
+    std::sort(SortedDependencies.begin(), SortedDependencies.end(),
+              [](const IdentifierInfo *LHS, const IdentifierInfo *RHS) {
+                  return LHS->getName() < RHS->getName();
+              });
+
+    write(OS, static_cast<uint32_t>(SortedDependencies.size()));
+    for (auto II : SortedDependencies) {
+        write(OS, getFingerprint(MC.getMacroInfo(II)));
+        writeString(OS, II->getName());
+    }
+
+    writeString(OS, Spellings);
+
+    write(OS, static_cast<uint32_t>(StoredTokens.size()));
+    for (auto &Stored : StoredTokens) {
+        write(OS, Stored);
+    }
+
+    OS.flush();
+
+    Store->add(Name->getName(), std::move(Entry));
+}
@@ -0,0 +1,138 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_PRECOMPUTEDCACHE_HPP
+#define MIXED_PREPROCESSOR_PRECOMPUTEDCACHE_HPP
+
+
+#include "ExpansionCache.hpp"
+#include "MixedToken.hpp"
+
+#include "clang/Basic/IdentifierTable.h"
+#include "clang/Lex/MacroInfo.h"
+#include "clang/Lex/Preprocessor.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/RWMutex.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace clang;
+
+
+class MixedComputations;
+
+
+// PreComputed bodies shared by the translation units of a process, and kept
+// on disk across runs.
+//
+// An entry holds the residual body of a macro, placeholders included, the
+// fingerprint of the definition it was computed for, and the fingerprint of
+// the definition every identifier it depended on had at that time (zero for
+// an undefined one).  Dependencies are transitively closed, so comparing
+// these shallow fingerprints with the current definitions tells whether the
+// body is still valid.  Entries are looked up by macro name, and a name
+// keeps a few of them side by side, the most recent first: the same header
+// may be included after different definitions of what its macros use.
+//
+// A store knows nothing of the engines, it may be shared by all translation
+// units of a process and outlive them.  It is read-mostly: an engine only
+// adds an entry after a lookup of the same definition failed.
+//
+// With a directory, the cache is a single file in there, memory-mapped when
+// the store is opened and only indexed by macro name until an entry is
+// asked for.  Entries stored are written back together with the loaded ones
+// by save, or when the store is destroyed.  The file is replaced atomically,
+// so a concurrent run only ever sees a complete file.
+class PreComputedStore {
+public:
+    // A raw entry, pointing into the file or into Owner.
+    struct Entry {
+        StringRef Data;
+        std::shared_ptr<const std::string> Owner;
+    };
+
+private:
+    std::string Path;
+
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+    llvm::StringMap<std::vector<Entry>> Entries;
+    bool Dirty;
+
+    llvm::sys::RWMutex Mutex;
+    std::mutex SaveMutex;
+
+    void load();
+
+public:
+    // Kept in memory only without a Directory.
+    explicit PreComputedStore(StringRef Directory = StringRef());
+    PreComputedStore(const PreComputedStore &) = delete;
+    PreComputedStore & operator=(const PreComputedStore &) = delete;
+    ~PreComputedStore();
+
+    // The raw entries of a macro name, the most recent first.
+    std::vector<Entry> find(StringRef Name);
+
+    // Adds a raw entry, replacing the one of the same definition and
+    // dependencies.
+    void add(StringRef Name, std::string Entry);
+
+    // Writes the file back if entries were added since the last save.
+    void save();
+};
+
+
+// The view of one engine on a PreComputedStore: it fingerprints the
+// definitions of its Preprocessor and translates entries from and to its
+// tokens.  A body holding a stringify sequence, which only the engine that
+// made it can resolve, is not stored.
+class PreComputedCache {
+    MixedComputations &MC;
+    Preprocessor &PP;
+
+    std::shared_ptr<PreComputedStore> Store;
+
+    llvm::DenseMap<const MacroInfo *, uint64_t> Fingerprints;
+
+    bool materialize(
+            StringRef Entry,
+            const MacroInfo *MI,
+            uint64_t Fingerprint,
+            std::vector<MixedToken> &Tokens,
+            ExpansionCache::Dependencies_t &Dependencies);
+
+public:
+    PreComputedCache(MixedComputations &MC, Preprocessor &PP, std::shared_ptr<PreComputedStore> Store);
+    PreComputedCache(const PreComputedCache &) = delete;
+    PreComputedCache & operator=(const PreComputedCache &) = delete;
+
+    // Fingerprint of a definition, zero for nullptr.
+    uint64_t getFingerprint(const MacroInfo *MI);
+
+    // Builds the PreComputed body of MI, defined as Name, from a valid entry.
+    // On success, its dependencies are appended to Dependencies.
+    bool lookup(
+            const IdentifierInfo *Name,
+            const MacroInfo *MI,
+            std::vector<MixedToken> &Tokens,
+            ExpansionCache::Dependencies_t &Dependencies);
+
+    void store(
+            const IdentifierInfo *Name,
+            const MacroInfo *MI,
+            const std::vector<MixedToken> &Tokens,
+            ExpansionCache::Dependencies_t::const_iterator DependenciesBegin,
+            ExpansionCache::Dependencies_t::const_iterator DependenciesEnd);
+};
+
+
+#endif //MIXED_PREPROCESSOR_PRECOMPUTEDCACHE_HPP
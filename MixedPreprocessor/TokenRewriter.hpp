@@ -0,0 +1,139 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_TOKENREWRITER_HPP
+#define MIXED_PREPROCESSOR_TOKENREWRITER_HPP
+
+
+#include "MixedToken.hpp"
+
+#include "llvm/ADT/SmallVector.h"
+
+#include <iterator>
+#include <vector>
+
+
+// Contiguous rewrite buffer driving MixedComputations::Preprocess.
+//
+// Processed tokens are appended to Out.  Tokens still to be scanned are kept
+// in Pending in reverse order: the token under the cursor is Pending.back(),
+// so splicing an expansion in front of the cursor and consuming tokens are
+// both operations on the back of a vector.  When Pending runs dry, tokens are
+// pulled from the source: either an eof-terminated token array, or the
+// rewriter of the enclosing Preprocess when macro arguments are collected.
+class TokenRewriter {
+    const MixedToken *Source;
+    TokenRewriter *Upstream;
+
+    llvm::SmallVector<MixedToken, 32> Pending;
+    std::vector<MixedToken> Out;
+
+    MixedToken pull() {
+        return Upstream ? Upstream->take() : *Source++;
+    }
+
+public:
+    TokenRewriter() : Source(nullptr), Upstream(nullptr) {}
+    explicit TokenRewriter(const MixedToken *Source) : Source(Source), Upstream(nullptr) {}
+    explicit TokenRewriter(TokenRewriter &Upstream) : Source(nullptr), Upstream(&Upstream) {}
+
+    TokenRewriter(const TokenRewriter &) = delete;
+    TokenRewriter & operator=(const TokenRewriter &) = delete;
+
+    // Starts a new rewrite, the buffers of the previous one are reused.
+    void reset(const MixedToken *NewSource) {
+        Source = NewSource;
+        Upstream = nullptr;
+        Pending.clear();
+        Out.clear();
+    }
+
+    void reset(TokenRewriter &NewUpstream) {
+        Source = nullptr;
+        Upstream = &NewUpstream;
+        Pending.clear();
+        Out.clear();
+    }
+
+    // Returns the N-th token that has not been consumed yet, 0 being the one
+    // under the cursor.  The reference is only valid until the next call.
+    const MixedToken & peek(unsigned N = 0) {
+        while (Pending.size() <= N) {
+            Pending.insert(Pending.begin(), pull());
+        }
+        return Pending[Pending.size() - 1 - N];
+    }
+
+    // Consumes the token under the cursor.
+    MixedToken take() {
+        return Pending.empty() ? pull() : Pending.pop_back_val();
+    }
+
+    // Places [Begin, End) in front of the cursor, *Begin becoming the next
+    // token to be scanned.
+    void push(const MixedToken *Begin, const MixedToken *End) {
+        typedef std::reverse_iterator<const MixedToken *> Reversed;
+        Pending.append(Reversed(End), Reversed(Begin));
+    }
+
+    void push(const MixedToken &Tok) { Pending.push_back(Tok); }
+
+    // Moves the token under the cursor to the output.
+    void advance() { Out.push_back(take()); }
+
+    void emit(const MixedToken &Tok) { Out.push_back(Tok); }
+
+    void emit(const MixedToken *Begin, const MixedToken *End) {
+        Out.insert(Out.end(), Begin, End);
+    }
+
+    bool hasOutput() const { return !Out.empty(); }
+    const MixedToken & lastOutput() const { return Out.back(); }
+
+    // Moves the output but its last Keep tokens to the end of Final.  Only
+    // the last output token may still be taken back, as the left operand of
+    // a ##, so the others are final.
+    void flush(std::vector<MixedToken> &Final, size_t Keep = 1) {
+        if (Out.size() <= Keep) {
+            return;
+        }
+        Final.insert(Final.end(), Out.begin(), Out.end() - Keep);
+        Out.erase(Out.begin(), Out.end() - Keep);
+    }
+
+    size_t outputSize() const { return Out.size(); }
+
+    MixedToken popOutput() {
+        MixedToken Tok = Out.back();
+        Out.pop_back();
+        return Tok;
+    }
+
+    // Ends the rewrite at the token under the cursor, which terminates the
+    // result.  Tokens spliced in behind it are handed back to the upstream
+    // rewriter, if any; so is an eof, which has to stop the upstream as well.
+    // The result is left in the output buffer until the next reset.
+    const std::vector<MixedToken> & finishInPlace() {
+        MixedToken Last = take();
+        Out.push_back(Last);
+
+        if (Upstream) {
+            if (Last.isOneOf(tok::eof, tok::eod)) {
+                Pending.push_back(Last);
+            }
+            Upstream->Pending.append(Pending.begin(), Pending.end());
+        }
+        Pending.clear();
+
+        return Out;
+    }
+
+    std::vector<MixedToken> finish() {
+        finishInPlace();
+        return std::move(Out);
+    }
+};
+
+
+#endif //MIXED_PREPROCESSOR_TOKENREWRITER_HPP
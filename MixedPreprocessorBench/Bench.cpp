@@ -0,0 +1,167 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "MixedComputations.hpp"
+#include "Workloads.hpp"
+
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Lex/Preprocessor.h"
+#include "clang/Tooling/Tooling.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace clang;
+
+
+// Every allocation of the process goes through here, so that a run can
+// report how many of them it made.
+static std::atomic<uint64_t> Allocations(0);
+
+void * operator new(size_t Size) {
+    ++Allocations;
+    if (void *Ptr = malloc(Size ? Size : 1)) {
+        return Ptr;
+    }
+    abort();
+}
+
+void * operator new[](size_t Size) {
+    return operator new(Size);
+}
+
+void operator delete(void *Ptr) noexcept {
+    free(Ptr);
+}
+
+void operator delete[](void *Ptr) noexcept {
+    free(Ptr);
+}
+
+
+static llvm::cl::opt<unsigned> Scale(
+        "scale",
+        llvm::cl::desc("Multiply the number of macro uses of every workload by <N>"),
+        llvm::cl::value_desc("N"),
+        llvm::cl::init(4));
+
+static llvm::cl::opt<unsigned> Iterations(
+        "iterations",
+        llvm::cl::desc("Run every workload <N> times and keep the fastest run"),
+        llvm::cl::value_desc("N"),
+        llvm::cl::init(5));
+
+static llvm::cl::opt<std::string> Filter(
+        "filter",
+        llvm::cl::desc("Only run the workloads whose name contains <name>"),
+        llvm::cl::value_desc("name"));
+
+
+namespace {
+
+struct RunResult {
+    uint64_t Tokens = 0;
+    uint64_t Allocations = 0;
+    double Seconds = 0;
+};
+
+// Lexes the whole main file, through MixedComputations or through the
+// stock Preprocessor, and measures the lexing only.
+class BenchAction : public PreprocessorFrontendAction {
+    const bool Mixed;
+    RunResult &Result;
+
+protected:
+    void ExecuteAction() override {
+        Preprocessor &PP = getCompilerInstance().getPreprocessor();
+
+        std::unique_ptr<MixedComputations> MC;
+        if (Mixed) {
+            MC = llvm::make_unique<MixedComputations>(PP);
+        }
+
+        Token Tok;
+        std::vector<Token> Batch(256);
+        uint64_t AllocationsBefore = Allocations;
+        auto Start = std::chrono::steady_clock::now();
+
+        PP.EnterMainSourceFile();
+
+        if (Mixed) {
+            size_t Count;
+            do {
+                Count = MC->LexBatch(Batch.data(), Batch.size());
+                Result.Tokens += Count;
+            } while (Batch[Count - 1].isNot(tok::eof));
+        } else {
+            do {
+                PP.Lex(Tok);
+                ++Result.Tokens;
+            } while (Tok.isNot(tok::eof));
+        }
+
+        Result.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+        Result.Allocations = Allocations - AllocationsBefore;
+    }
+
+public:
+    BenchAction(bool Mixed, RunResult &Result) : Mixed(Mixed), Result(Result) {}
+};
+
+}
+
+
+static RunResult Run(const Workload &W, bool Mixed) {
+    RunResult Best;
+
+    for (unsigned i = 0; i != std::max(1u, unsigned(Iterations)); ++i) {
+        RunResult Result;
+        tooling::runToolOnCodeWithArgs(new BenchAction(Mixed, Result), W.Source, {"-x", "c++"}, "bench.cpp");
+
+        if (!i || Result.Seconds < Best.Seconds) {
+            Best = Result;
+        }
+    }
+
+    return Best;
+}
+
+static void Report(llvm::raw_ostream &OS, const Workload &W, const char *Engine, const RunResult &Result) {
+    double TokensPerSecond = Result.Seconds ? Result.Tokens / Result.Seconds : 0;
+    double AllocationsPerToken = Result.Tokens ? double(Result.Allocations) / Result.Tokens : 0;
+
+    OS << llvm::format("%-24s %-6s %10llu %10.2f %12.0f %10.3f\n",
+                       W.Name.c_str(), Engine, (unsigned long long)Result.Tokens,
+                       Result.Seconds * 1000, TokensPerSecond, AllocationsPerToken);
+}
+
+int main(int argc, const char **argv) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "mixed-preprocessor benchmarks\n");
+
+    llvm::raw_ostream &OS = llvm::outs();
+    OS << "workload                 engine     tokens         ms     tokens/s allocs/tok\n";
+
+    for (auto &W : getWorkloads(Scale)) {
+        if (!Filter.empty() && W.Name.find(Filter) == std::string::npos) {
+            continue;
+        }
+
+        Report(OS, W, "stock", Run(W, false));
+        Report(OS, W, "mixed", Run(W, true));
+        OS.flush();
+    }
+
+    return 0;
+}
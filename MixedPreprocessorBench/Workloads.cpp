@@ -0,0 +1,136 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "Workloads.hpp"
+
+#include <string>
+
+
+static std::string N(unsigned i) {
+    return std::to_string(i);
+}
+
+
+// #define CHAIN0 x
+// #define CHAINi CHAIN(i-1) + i
+static Workload DeepChain(unsigned Scale) {
+    const unsigned Depth = 128;
+    Workload W{"deep-object-chain", ""};
+
+    W.Source += "#define CHAIN0 x\n";
+    for (unsigned i = 1; i <= Depth; ++i) {
+        W.Source += "#define CHAIN" + N(i) + " CHAIN" + N(i - 1) + " + " + N(i) + "\n";
+    }
+    for (unsigned i = 0; i != 16 * Scale; ++i) {
+        W.Source += "int v" + N(i) + " = CHAIN" + N(Depth) + ";\n";
+    }
+    return W;
+}
+
+// #define WIDE(x) LEAF0(x) LEAF1(x) ... LEAF63(x)
+static Workload WideFanOut(unsigned Scale) {
+    const unsigned Width = 64;
+    Workload W{"wide-function-fan-out", ""};
+
+    for (unsigned i = 0; i != Width; ++i) {
+        W.Source += "#define LEAF" + N(i) + "(x) (x + " + N(i) + ")\n";
+    }
+    W.Source += "#define WIDE(x)";
+    for (unsigned i = 0; i != Width; ++i) {
+        W.Source += " LEAF" + N(i) + "(x)";
+    }
+    W.Source += "\n";
+    for (unsigned i = 0; i != 64 * Scale; ++i) {
+        W.Source += "WIDE(a" + N(i % 16) + ")\n";
+    }
+    return W;
+}
+
+// #define CAT(a, b) a ## b
+static Workload Pasting(unsigned Scale) {
+    Workload W{"token-pasting", ""};
+
+    W.Source += "#define CAT(a, b) a ## b\n";
+    W.Source += "#define CAT3(a, b, c) a ## b ## c\n";
+    W.Source += "#define FIELD(type, name) type CAT(m_, name); type CAT3(get_, name, _value)();\n";
+    for (unsigned i = 0; i != 1024 * Scale; ++i) {
+        W.Source += "FIELD(int, f" + N(i % 256) + ") CAT(x, " + N(i) + ") CAT(+, =)\n";
+    }
+    return W;
+}
+
+// #define TABLE(X) X(e0, 0) X(e1, 1) ...
+static Workload XMacro(unsigned Scale) {
+    const unsigned Rows = 64;
+    Workload W{"x-macro-table", ""};
+
+    W.Source += "#define TABLE(X)";
+    for (unsigned i = 0; i != Rows; ++i) {
+        W.Source += " X(e" + N(i) + ", " + N(i) + ")";
+    }
+    W.Source += "\n";
+    W.Source += "#define AS_ENUM(name, value) name = value,\n";
+    W.Source += "#define AS_CASE(name, value) case name: return value;\n";
+    W.Source += "#define AS_DECL(name, value) extern int name##_v;\n";
+    for (unsigned i = 0; i != 8 * Scale; ++i) {
+        W.Source += "enum E" + N(i) + " { TABLE(AS_ENUM) };\n";
+        W.Source += "int f" + N(i) + "(int e) { switch (e) { TABLE(AS_CASE) } }\n";
+        W.Source += "TABLE(AS_DECL)\n";
+    }
+    return W;
+}
+
+// #define REP0(m)
+// #define REPi(m) REP(i-1)(m) m(i-1)
+static Workload Repetition(unsigned Scale) {
+    const unsigned Count = 64;
+    Workload W{"pp-repetition", ""};
+
+    W.Source += "#define REP0(m)\n";
+    for (unsigned i = 1; i <= Count; ++i) {
+        W.Source += "#define REP" + N(i) + "(m) REP" + N(i - 1) + "(m) m(" + N(i - 1) + ")\n";
+    }
+    W.Source += "#define PARAM(i) int p ## i,\n";
+    W.Source += "#define ELEM(i) [i] = i,\n";
+    for (unsigned i = 0; i != 8 * Scale; ++i) {
+        W.Source += "void f" + N(i) + "(REP" + N(Count) + "(PARAM) int last);\n";
+        W.Source += "int a" + N(i) + "[] = { REP" + N(Count) + "(ELEM) };\n";
+    }
+    return W;
+}
+
+// #define LONG(a0, ..., a63) a63 a0 a31 ...
+static Workload LongArguments(unsigned Scale) {
+    const unsigned Arity = 64;
+    Workload W{"long-argument-lists", ""};
+
+    W.Source += "#define LONG(";
+    for (unsigned i = 0; i != Arity; ++i) {
+        W.Source += (i ? ", a" : "a") + N(i);
+    }
+    W.Source += ")";
+    for (unsigned i = 0; i != Arity; i += 4) {
+        W.Source += " a" + N(Arity - 1 - i) + " a" + N(i);
+    }
+    W.Source += "\n";
+    for (unsigned i = 0; i != 64 * Scale; ++i) {
+        W.Source += "LONG(";
+        for (unsigned j = 0; j != Arity; ++j) {
+            W.Source += (j ? ", (x" : "(x") + N(j) + " + " + N(i) + ")";
+        }
+        W.Source += ")\n";
+    }
+    return W;
+}
+
+std::vector<Workload> getWorkloads(unsigned Scale) {
+    return {
+        DeepChain(Scale),
+        WideFanOut(Scale),
+        Pasting(Scale),
+        XMacro(Scale),
+        Repetition(Scale),
+        LongArguments(Scale)
+    };
+}
@@ -0,0 +1,23 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_WORKLOADS_HPP
+#define MIXED_PREPROCESSOR_WORKLOADS_HPP
+
+
+#include <string>
+#include <vector>
+
+
+struct Workload {
+    std::string Name;
+    std::string Source;
+};
+
+// Synthetic sources exercising one expansion pattern each.  Scale multiplies
+// the number of macro uses, not the shape of the macros.
+std::vector<Workload> getWorkloads(unsigned Scale);
+
+
+#endif //MIXED_PREPROCESSOR_WORKLOADS_HPP
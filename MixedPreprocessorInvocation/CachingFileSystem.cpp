@@ -0,0 +1,127 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "CachingFileSystem.hpp"
+
+#include "llvm/ADT/SmallString.h"
+
+
+// Modification times may be as coarse as this.
+static const unsigned RacyWindowSeconds = 2;
+
+
+namespace {
+
+class CachedFileHandle : public vfs::File {
+    vfs::Status Status;
+    StringRef Contents;
+
+public:
+    CachedFileHandle(const vfs::Status &Status, StringRef Contents) : Status(Status), Contents(Contents) {}
+
+    llvm::ErrorOr<vfs::Status> status() override { return Status; }
+
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(
+            const Twine &Name,
+            int64_t FileSize = -1,
+            bool RequiresNullTerminator = true,
+            bool IsVolatile = false) override {
+        return llvm::MemoryBuffer::getMemBuffer(Contents, Name.str(), RequiresNullTerminator);
+    }
+
+    std::error_code close() override { return std::error_code(); }
+};
+
+}
+
+
+CachingFileSystem::CachingFileSystem() : Real(vfs::getRealFileSystem()), Users(0) {}
+
+CachingFileSystem::Use::Use(CachingFileSystem &FS) : FS(FS) {
+    std::lock_guard<std::mutex> Guard(FS.Mutex);
+    ++FS.Users;
+}
+
+CachingFileSystem::Use::~Use() {
+    std::lock_guard<std::mutex> Guard(FS.Mutex);
+    if (!--FS.Users) {
+        FS.Retired.clear();
+    }
+}
+
+bool CachingFileSystem::isUpToDate(const CachedFile &Cached, const vfs::Status &Current) {
+    if (!Cached.Buffer ||
+            Cached.Status.getUniqueID() != Current.getUniqueID() ||
+            Cached.Status.getSize() != Current.getSize() ||
+            Cached.Status.getLastModificationTime() != Current.getLastModificationTime()) {
+        return false;
+    }
+
+    llvm::sys::TimeValue Window(RacyWindowSeconds, 0);
+    return Current.getLastModificationTime() + Window < Cached.ReadTime;
+}
+
+llvm::ErrorOr<vfs::Status> CachingFileSystem::status(const Twine &Path) {
+    return Real->status(Path);
+}
+
+llvm::ErrorOr<std::unique_ptr<vfs::File>> CachingFileSystem::openFileForRead(const Twine &Path) {
+    SmallString<256> NameStorage;
+    StringRef Name = Path.toStringRef(NameStorage);
+
+    // Taken before the stat, a modification in between makes the contents
+    // look racy, never up to date.
+    llvm::sys::TimeValue ReadTime = llvm::sys::TimeValue::now();
+
+    auto Current = Real->status(Name);
+    if (!Current) {
+        return Current.getError();
+    }
+    if (!Current->isRegularFile()) {
+        return Real->openFileForRead(Name);
+    }
+
+    {
+        std::lock_guard<std::mutex> Guard(Mutex);
+        auto It = Files.find(Name);
+        if (It != Files.end() && isUpToDate(It->second, *Current)) {
+            return std::unique_ptr<vfs::File>(new CachedFileHandle(*Current, It->second.Buffer->getBuffer()));
+        }
+    }
+
+    auto File = Real->openFileForRead(Name);
+    if (!File) {
+        return File.getError();
+    }
+    auto Buffer = (*File)->getBuffer(Name, Current->getSize());
+    if (!Buffer) {
+        return Buffer.getError();
+    }
+
+    std::lock_guard<std::mutex> Guard(Mutex);
+
+    CachedFile &Cached = Files[Name];
+    if (!Cached.Buffer || Cached.Buffer->getBuffer() != (*Buffer)->getBuffer()) {
+        if (Users) {
+            Retired.push_back(std::move(Cached.Buffer));
+        }
+        Cached.Buffer = std::move(*Buffer);
+    }
+    Cached.Status = *Current;
+    Cached.ReadTime = ReadTime;
+
+    return std::unique_ptr<vfs::File>(new CachedFileHandle(*Current, Cached.Buffer->getBuffer()));
+}
+
+vfs::directory_iterator CachingFileSystem::dir_begin(const Twine &Dir, std::error_code &EC) {
+    return Real->dir_begin(Dir, EC);
+}
+
+llvm::ErrorOr<std::string> CachingFileSystem::getCurrentWorkingDirectory() const {
+    return Real->getCurrentWorkingDirectory();
+}
+
+std::error_code CachingFileSystem::setCurrentWorkingDirectory(const Twine &Path) {
+    return Real->setCurrentWorkingDirectory(Path);
+}
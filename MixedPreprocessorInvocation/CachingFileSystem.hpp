@@ -0,0 +1,73 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_CACHINGFILESYSTEM_HPP
+#define MIXED_PREPROCESSOR_CACHINGFILESYSTEM_HPP
+
+
+#include "clang/Basic/VirtualFileSystem.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TimeValue.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace clang;
+
+
+// The real file system, with the contents of the files read through it kept
+// in memory for the next compiler instances.
+//
+// Every open stats the file, its cached contents are only used while its
+// unique ID, size and modification time are those they were read with.  A
+// file modified too shortly before being read may be modified again
+// without its modification time changing, so such a file is read again and
+// compared on the next open, until it is older than the window.
+//
+// The buffers handed out point into the cached contents.  Contents replaced
+// while compiler instances are using the file system are only freed when
+// the last one of them releases it.
+class CachingFileSystem : public vfs::FileSystem {
+    struct CachedFile {
+        vfs::Status Status;
+        llvm::sys::TimeValue ReadTime;
+        std::unique_ptr<llvm::MemoryBuffer> Buffer;
+    };
+
+    IntrusiveRefCntPtr<vfs::FileSystem> Real;
+
+    std::mutex Mutex;
+    llvm::StringMap<CachedFile> Files;
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> Retired;
+    unsigned Users;
+
+    bool isUpToDate(const CachedFile &Cached, const vfs::Status &Current);
+
+public:
+    CachingFileSystem();
+
+    // Holds the buffers handed out until destroyed.
+    class Use {
+        CachingFileSystem &FS;
+
+    public:
+        explicit Use(CachingFileSystem &FS);
+        Use(const Use &) = delete;
+        Use & operator=(const Use &) = delete;
+        ~Use();
+    };
+
+    llvm::ErrorOr<vfs::Status> status(const Twine &Path) override;
+    llvm::ErrorOr<std::unique_ptr<vfs::File>> openFileForRead(const Twine &Path) override;
+    vfs::directory_iterator dir_begin(const Twine &Dir, std::error_code &EC) override;
+    llvm::ErrorOr<std::string> getCurrentWorkingDirectory() const override;
+    std::error_code setCurrentWorkingDirectory(const Twine &Path) override;
+};
+
+
+#endif //MIXED_PREPROCESSOR_CACHINGFILESYSTEM_HPP
@@ -0,0 +1,66 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "Client.hpp"
+#include "ServerProtocol.hpp"
+
+#include "clang/Tooling/Tooling.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+
+#include <unistd.h>
+
+using namespace clang;
+
+
+// The server does not run in the directory of the client.
+static std::string getAbsoluteDirectory(StringRef Directory) {
+    if (Directory.empty()) {
+        return std::string();
+    }
+    SmallString<256> Path(Directory);
+    llvm::sys::fs::make_absolute(Path);
+    return Path.str().str();
+}
+
+bool runRemote(
+        StringRef SocketPath,
+        const tooling::CompilationDatabase &Compilations,
+        StringRef SourcePath,
+        const MixedPreprocessorOptions &Options,
+        raw_ostream &OS,
+        raw_ostream &ErrOS,
+        int &Status) {
+    int FD = connectSocket(SocketPath);
+    if (FD < 0) {
+        return false;
+    }
+
+    ServerRequest Request;
+    Request.Options = Options;
+    Request.Options.Store.reset();
+    Request.Options.CacheDir = getAbsoluteDirectory(Options.CacheDir);
+    Request.Options.TraceDir = getAbsoluteDirectory(Options.TraceDir);
+    Request.SourcePath = tooling::getAbsolutePath(SourcePath);
+    Request.Commands = Compilations.getCompileCommands(Request.SourcePath);
+
+    std::string Message;
+    ServerReply Reply;
+    bool Received = sendMessage(FD, encodeRequest(Request)) &&
+                    receiveMessage(FD, Message) &&
+                    decodeReply(Message, Reply);
+    close(FD);
+
+    if (!Received) {
+        ErrOS << "error: lost the server on " << SocketPath << " while preprocessing " << SourcePath << "\n";
+        Status = 1;
+        return true;
+    }
+
+    OS << Reply.Output;
+    ErrOS << Reply.Errors;
+    Status = Reply.Status;
+    return true;
+}
@@ -0,0 +1,30 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_CLIENT_HPP
+#define MIXED_PREPROCESSOR_CLIENT_HPP
+
+
+#include "FrontendActions.hpp"
+
+#include "clang/Tooling/CompilationDatabase.h"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+
+// Preprocesses SourcePath on the server listening on SocketPath, writing its
+// output to OS and its diagnostics and reports to ErrOS, as the local tool
+// would.  Returns false, with nothing written, if there is no server.
+bool runRemote(
+        llvm::StringRef SocketPath,
+        const clang::tooling::CompilationDatabase &Compilations,
+        llvm::StringRef SourcePath,
+        const MixedPreprocessorOptions &Options,
+        llvm::raw_ostream &OS,
+        llvm::raw_ostream &ErrOS,
+        int &Status);
+
+
+#endif //MIXED_PREPROCESSOR_CLIENT_HPP
@@ -2,29 +2,171 @@
 // Distributed under the terms of the GNU GPL v3 License.
 
 
+#include "ExpansionTrace.hpp"
 #include "FrontendActions.hpp"
+#include "MacroStatistics.hpp"
+#include "MemoryAccounting.hpp"
 #include "MixedComputations.hpp"
+#include "TokenStreamWriter.hpp"
 
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Basic/FileManager.h"
 #include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
 #include "clang/Lex/Preprocessor.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+#include <string>
+#include <system_error>
+#include <vector>
 
 using namespace clang;
 
 
-void DoMixedPrintPreprocessedInput(Preprocessor &PP, raw_ostream *OS) {
-    MixedComputations MC(PP);
-    Token Tok;
+std::string flattenPath(StringRef Path) {
+    std::string Name = Path.str();
+    for (auto &C : Name) {
+        if (llvm::sys::path::is_separator(C) || C == ':') {
+            C = '_';
+        }
+    }
+    return Name;
+}
+
 
-    PP.EnterMainSourceFile();
+// Token kind names, so that printing a kind does not take a strlen.
+static std::vector<StringRef> getKindNames() {
+    std::vector<StringRef> KindNames;
+    for (unsigned Kind = 0; Kind != tok::NUM_TOKENS; ++Kind) {
+        KindNames.push_back(tok::getTokenName(static_cast<tok::TokenKind>(Kind)));
+    }
+    return KindNames;
+}
+
+// Tokens are taken from MC in batches.
+static const size_t BatchSize = 256;
+
+static void PrintText(Preprocessor &PP, MixedComputations &MC, raw_ostream *OS) {
+    // The output is built in a large buffer handed to OS in one write.
+    // Spellings are taken in place from the identifier table, the literal
+    // data or the source buffers, SpellingBuffer only holds the ones that
+    // need cleaning.
+    const size_t FlushThreshold = 1 << 20;
+
+    std::vector<StringRef> KindNames = getKindNames();
+    std::string Output;
+    Output.reserve(FlushThreshold + 4096);
+    SmallString<256> SpellingBuffer;
+    std::vector<Token> Batch(BatchSize);
+    size_t Count;
+
+    do {
+        Count = MC.LexBatch(Batch.data(), Batch.size());
+
+        for (size_t i = 0; i != Count; ++i) {
+            const Token &Tok = Batch[i];
+
+            StringRef Kind = KindNames[Tok.getKind()];
+            Output.append(Kind.data(), Kind.size());
+            Output.append(" '", 2);
+            StringRef Spelling = PP.getSpelling(Tok, SpellingBuffer);
+            Output.append(Spelling.data(), Spelling.size());
+            Output.append("'\n", 2);
+        }
+
+        if (Output.size() >= FlushThreshold) {
+            OS->write(Output.data(), Output.size());
+            Output.clear();
+        }
+    } while (Batch[Count - 1].isNot(tok::eof));
+
+    OS->write(Output.data(), Output.size());
+}
+
+static void PrintBinary(Preprocessor &PP, MixedComputations &MC, raw_ostream *OS) {
+    tokenstream::TokenStreamWriter Writer(*OS, getKindNames());
+    SmallString<256> SpellingBuffer;
+    std::vector<Token> Batch(BatchSize);
+    size_t Count;
 
     do {
-        MC.Lex(Tok);
-        *OS << tok::getTokenName(Tok.getKind()) << " '" << PP.getSpelling(Tok) << "'\n";
-    } while (Tok.isNot(tok::eof));
+        Count = MC.LexBatch(Batch.data(), Batch.size());
+
+        for (size_t i = 0; i != Count; ++i) {
+            const Token &Tok = Batch[i];
+            // Spellings are written clean.
+            Writer.add(Tok.getKind(), Tok.getFlags() & ~Token::NeedsCleaning, PP.getSpelling(Tok, SpellingBuffer));
+        }
+    } while (Batch[Count - 1].isNot(tok::eof));
+}
+
+void DoMixedPrintPreprocessedInput(
+        Preprocessor &PP, raw_ostream *OS, raw_ostream &ErrOS, StringRef File,
+        const MixedPreprocessorOptions &Options) {
+    MixedComputations MC(PP, Options.Store);
+    MC.setMemoryBudget(size_t(Options.MemoryBudgetMB) << 20);
+
+    MacroStatistics Stats;
+    if (Options.Stats) {
+        MC.setStatistics(&Stats);
+    }
+
+    std::unique_ptr<ExpansionTrace> Trace;
+    if (!Options.TraceDir.empty()) {
+        Trace = llvm::make_unique<ExpansionTrace>();
+        MC.setTrace(Trace.get());
+    }
+
+    PP.EnterMainSourceFile();
+
+    if (Options.Format == MixedPreprocessorOptions::Binary) {
+        PrintBinary(PP, MC, OS);
+    } else {
+        PrintText(PP, MC, OS);
+    }
+
+    if (Options.Stats) {
+        // Written at once, so that the reports of parallel TUs do not mix.
+        std::string Report;
+        llvm::raw_string_ostream ReportOS(Report);
+        Stats.printJSON(ReportOS, File);
+        Stats.printTable(ReportOS, Options.StatsTopN);
+
+        const MemoryAccounting &Memory = MC.getMemory();
+        Memory.printJSON(ReportOS, File);
+        Memory.printTable(ReportOS);
+        ErrOS << ReportOS.str();
+    }
+
+    if (Trace) {
+        SmallString<256> Path(Options.TraceDir);
+        llvm::sys::path::append(Path, flattenPath(File) + ".trace.json");
+
+        std::error_code EC;
+        llvm::raw_fd_ostream TraceOS(Path, EC, llvm::sys::fs::F_None);
+        if (EC) {
+            ErrOS << "error: cannot open " << Path << ": " << EC.message() << "\n";
+            return;
+        }
+
+        MC.setTrace(nullptr);
+        Trace->write(TraceOS, PP.getSourceManager());
+    }
 }
 
 void MixedPrintPreprocessedAction::ExecuteAction() {
     CompilerInstance &CI = getCompilerInstance();
+    raw_ostream &Errors = ErrOS ? *ErrOS : llvm::errs();
+
+    if (OS) {
+        DoMixedPrintPreprocessedInput(CI.getPreprocessor(), OS, Errors, getCurrentFile(), Options);
+        return;
+    }
+
     // Output file may need to be set to 'Binary', to avoid converting Unix style
     // line feeds (<LF>) to Microsoft style line feeds (<CR><LF>).
     //
@@ -67,8 +209,66 @@ void MixedPrintPreprocessedAction::ExecuteAction() {
         }
     }
 
-    raw_ostream *OS = CI.createDefaultOutputFile(BinaryMode, getCurrentFile());
-    if (!OS) return;
+    // The token stream is binary whatever the input looks like.
+    if (Options.Format == MixedPreprocessorOptions::Binary) {
+        BinaryMode = true;
+    }
+
+    raw_ostream *DefaultOS = CI.createDefaultOutputFile(BinaryMode, getCurrentFile());
+    if (!DefaultOS) return;
+
+    DoMixedPrintPreprocessedInput(CI.getPreprocessor(), DefaultOS, Errors, getCurrentFile(), Options);
+}
+
+int runCompileCommands(
+        ArrayRef<tooling::CompileCommand> Commands,
+        StringRef SourcePath,
+        const MixedPreprocessorOptions &Options,
+        StringRef MainExecutable,
+        IntrusiveRefCntPtr<vfs::FileSystem> FS,
+        std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+        raw_ostream &OS,
+        raw_ostream &ErrOS) {
+    if (Commands.empty()) {
+        ErrOS << "Skipping " << SourcePath << ". Compile command not found.\n";
+        return 1;
+    }
+
+    // The adjusters ClangTool applies by default.
+    tooling::ArgumentsAdjuster StripOutput = tooling::getClangStripOutputAdjuster();
+    tooling::ArgumentsAdjuster SyntaxOnly = tooling::getClangSyntaxOnlyAdjuster();
+
+    IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts(new DiagnosticOptions());
+    int Status = 0;
+
+    for (auto &Command : Commands) {
+        if (Command.CommandLine.empty()) {
+            continue;
+        }
+
+        std::vector<std::string> CommandLine = SyntaxOnly(StripOutput(Command.CommandLine));
+        CommandLine[0] = MainExecutable.str();
+
+        // The driver checks that the inputs exist before the file manager is
+        // involved.
+        if (!Command.Directory.empty()) {
+            CommandLine.insert(CommandLine.begin() + 1, {"-working-directory", Command.Directory});
+        }
+
+        FileSystemOptions FileSystemOpts;
+        FileSystemOpts.WorkingDir = Command.Directory;
+        IntrusiveRefCntPtr<FileManager> Files(new FileManager(FileSystemOpts, FS));
+
+        MixedPrintPreprocessedActionFactory Factory(Options, &OS, &ErrOS);
+        TextDiagnosticPrinter DiagnosticPrinter(ErrOS, &*DiagOpts);
+
+        tooling::ToolInvocation Invocation(std::move(CommandLine), &Factory, Files.get(), PCHContainerOps);
+        Invocation.setDiagnosticConsumer(&DiagnosticPrinter);
+        if (!Invocation.run()) {
+            ErrOS << "Error while processing " << SourcePath << ".\n";
+            Status = 1;
+        }
+    }
 
-    DoMixedPrintPreprocessedInput(CI.getPreprocessor(), OS);
+    return Status;
 }
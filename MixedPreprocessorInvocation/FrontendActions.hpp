@@ -6,14 +6,103 @@
 #define MIXED_PREPROCESSOR_FRONTENDACTIONS_HPP
 
 
+#include "PreComputedCache.hpp"
+
+#include "clang/Basic/VirtualFileSystem.h"
 #include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/PCHContainerOperations.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+#include <string>
+
+
+// Options of the tool, handed to every action it creates.
+struct MixedPreprocessorOptions {
+    enum OutputFormat {
+        Text,     // one "kind 'spelling'" line per token
+        Binary    // see MixedPreprocessorTokenStream/TokenStream.hpp
+    };
+
+    OutputFormat Format = Text;
+
+    // Directory of the persistent PreComputed cache, none if empty, and the
+    // store shared by all translation units of the process, opened on it or
+    // kept in memory only, none if null.
+    std::string CacheDir;
+    std::shared_ptr<PreComputedStore> Store;
+
+    // Memory the engine keeps cold cached expansions and PreComputed bodies
+    // within, in megabytes, unlimited if 0.
+    unsigned MemoryBudgetMB = 0;
+
+    // Print per-macro statistics to stderr after every translation unit, as
+    // JSON and as a table of the StatsTopN most expensive macros, followed
+    // by the memory held by the engine.
+    bool Stats = false;
+    unsigned StatsTopN = 20;
+
+    // Directory receiving a Chrome trace of the expansions of every
+    // translation unit, none if empty.
+    std::string TraceDir;
+};
 
 
+// Sources sharing a file name may live in different directories, so output
+// files are named after the whole source path, flattened.
+std::string flattenPath(llvm::StringRef Path);
+
+
+// Prints the tokens to OS, or to the default output file of the compiler
+// instance if OS is null.  Reports go to ErrOS, or to stderr if it is null.
 class MixedPrintPreprocessedAction : public clang::PreprocessorFrontendAction {
+  const MixedPreprocessorOptions &Options;
+  llvm::raw_ostream *OS;
+  llvm::raw_ostream *ErrOS;
+
+public:
+  explicit MixedPrintPreprocessedAction(const MixedPreprocessorOptions &Options, llvm::raw_ostream *OS = nullptr,
+                                        llvm::raw_ostream *ErrOS = nullptr) :
+          Options(Options), OS(OS), ErrOS(ErrOS) {}
+
 protected:
   void ExecuteAction() override;
 
   bool hasPCHSupport() const override { return true; }
 };
 
+class MixedPrintPreprocessedActionFactory : public clang::tooling::FrontendActionFactory {
+  const MixedPreprocessorOptions &Options;
+  llvm::raw_ostream *OS;
+  llvm::raw_ostream *ErrOS;
+
+public:
+  explicit MixedPrintPreprocessedActionFactory(const MixedPreprocessorOptions &Options, llvm::raw_ostream *OS = nullptr,
+                                               llvm::raw_ostream *ErrOS = nullptr) :
+          Options(Options), OS(OS), ErrOS(ErrOS) {}
+
+  clang::FrontendAction *create() override { return new MixedPrintPreprocessedAction(Options, OS, ErrOS); }
+};
+
+
+// Preprocesses SourcePath into OS once per compile command, as ClangTool
+// would, and returns its status.  The working directory of the process is
+// left alone: relative paths are resolved by a file manager of every command
+// on FS, so that sources may be preprocessed concurrently.  The driver is told
+// it runs as MainExecutable, which the builtin headers are found next to.
+// Diagnostics go to ErrOS.
+int runCompileCommands(
+        llvm::ArrayRef<clang::tooling::CompileCommand> Commands,
+        llvm::StringRef SourcePath,
+        const MixedPreprocessorOptions &Options,
+        llvm::StringRef MainExecutable,
+        llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> FS,
+        std::shared_ptr<clang::PCHContainerOperations> PCHContainerOps,
+        llvm::raw_ostream &OS,
+        llvm::raw_ostream &ErrOS);
+
 #endif //MIXED_PREPROCESSOR_FRONTENDACTIONS_HPP
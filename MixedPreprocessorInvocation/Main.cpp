@@ -2,20 +2,159 @@
 // Distributed under the terms of the GNU GPL v3 License.
 
 
+#include "Client.hpp"
 #include "FrontendActions.hpp"
+#include "ParallelTool.hpp"
 
+#include "clang/Basic/VirtualFileSystem.h"
+#include "clang/Frontend/PCHContainerOperations.h"
 #include "clang/Tooling/Tooling.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdlib>
+#include <mutex>
+#include <string>
+
 
 static llvm::cl::OptionCategory MixedToolCategory("Preprocessor options");
 static llvm::cl::extrahelp CommonHelp(clang::tooling::CommonOptionsParser::HelpMessage);
 
+static llvm::cl::opt<unsigned> Jobs(
+        "j",
+        llvm::cl::desc("Preprocess <N> translation units in parallel"),
+        llvm::cl::value_desc("N"),
+        llvm::cl::init(1),
+        llvm::cl::Prefix,
+        llvm::cl::cat(MixedToolCategory));
+
+static llvm::cl::opt<std::string> OutputDir(
+        "output-dir",
+        llvm::cl::desc("Write the output of every translation unit to a file in <dir>"),
+        llvm::cl::value_desc("dir"),
+        llvm::cl::cat(MixedToolCategory));
+
+static llvm::cl::opt<std::string> CacheDir(
+        "cache-dir",
+        llvm::cl::desc("Keep precomputed macro bodies in <dir> across runs"),
+        llvm::cl::value_desc("dir"),
+        llvm::cl::cat(MixedToolCategory));
+
+static llvm::cl::opt<std::string> Format(
+        "format",
+        llvm::cl::desc("Output format: text (default) or binary"),
+        llvm::cl::value_desc("format"),
+        llvm::cl::init("text"),
+        llvm::cl::cat(MixedToolCategory));
+
+static llvm::cl::opt<unsigned> MemoryBudget(
+        "memory-budget",
+        llvm::cl::desc("Evict cold cached expansions and precomputed macro bodies beyond <MB> of engine memory per translation unit"),
+        llvm::cl::value_desc("MB"),
+        llvm::cl::init(0),
+        llvm::cl::cat(MixedToolCategory));
+
+static llvm::cl::opt<bool> Stats(
+        "stats",
+        llvm::cl::desc("Print per-macro statistics to stderr after every translation unit"),
+        llvm::cl::cat(MixedToolCategory));
+
+static llvm::cl::opt<unsigned> StatsTop(
+        "stats-top",
+        llvm::cl::desc("Number of macros in the --stats table"),
+        llvm::cl::value_desc("N"),
+        llvm::cl::init(20),
+        llvm::cl::cat(MixedToolCategory));
+
+static llvm::cl::opt<std::string> TraceDir(
+        "trace-dir",
+        llvm::cl::desc("Write a Chrome trace of the macro expansions of every translation unit to <dir>"),
+        llvm::cl::value_desc("dir"),
+        llvm::cl::cat(MixedToolCategory));
+
+static llvm::cl::opt<std::string> Connect(
+        "connect",
+        llvm::cl::desc("Preprocess on the mixed-preprocessor-server listening on <socket>, "
+                       "$MIXED_PREPROCESSOR_SOCKET by default"),
+        llvm::cl::value_desc("socket"),
+        llvm::cl::cat(MixedToolCategory));
+
+// Its address locates the executable.
+static int StaticSymbol;
+
 int main(int argc, const char **argv) {
     clang::tooling::CommonOptionsParser op(argc, argv, MixedToolCategory);
+
+    MixedPreprocessorOptions Options;
+    if (Format == "binary") {
+        Options.Format = MixedPreprocessorOptions::Binary;
+    } else if (Format != "text") {
+        llvm::errs() << "error: unknown output format '" << Format << "'\n";
+        return 1;
+    }
+    Options.CacheDir = CacheDir;
+    // A single translation unit has no one to share PreComputed bodies with.
+    if (!CacheDir.empty() || op.getSourcePathList().size() > 1) {
+        Options.Store = std::make_shared<PreComputedStore>(CacheDir);
+    }
+    Options.MemoryBudgetMB = MemoryBudget;
+    Options.Stats = Stats;
+    Options.StatsTopN = StatsTop;
+    Options.TraceDir = TraceDir;
+
+    std::string Socket = Connect;
+    if (Socket.empty()) {
+        if (const char *Env = getenv("MIXED_PREPROCESSOR_SOCKET")) {
+            Socket = Env;
+        }
+    }
+
+    // ClangTool changes the working directory of the process for every
+    // compile command, so sources run concurrently would see each other's.
+    std::string MainExecutable = llvm::sys::fs::getMainExecutable(argv[0], &StaticSymbol);
+    auto FS = clang::vfs::getRealFileSystem();
+    auto PCHContainerOps = std::make_shared<clang::PCHContainerOperations>();
+
+    SourceRunner RunLocal = [&](llvm::StringRef SourcePath, llvm::raw_ostream &OS, llvm::raw_ostream &ErrOS) {
+        std::string File = clang::tooling::getAbsolutePath(SourcePath);
+        return runCompileCommands(op.getCompilations().getCompileCommands(File), File, Options, MainExecutable,
+                                  FS, PCHContainerOps, OS, ErrOS);
+    };
+
+    // Without a server, sources are preprocessed locally as if there was
+    // no socket at all.
+    std::once_flag NoServer;
+    SourceRunner RunRemote = [&](llvm::StringRef SourcePath, llvm::raw_ostream &OS, llvm::raw_ostream &ErrOS) {
+        int Status;
+        if (runRemote(Socket, op.getCompilations(), SourcePath, Options, OS, ErrOS, Status)) {
+            return Status;
+        }
+        std::call_once(NoServer, [&]() {
+            ErrOS << "warning: no server on " << Socket << ", preprocessing locally\n";
+        });
+        return RunLocal(SourcePath, OS, ErrOS);
+    };
+
+    const SourceRunner &Run = Socket.empty() ? RunLocal : RunRemote;
+
+    if (Jobs > 1 || !OutputDir.empty()) {
+        return runParallel(op.getSourcePathList(), Run, Jobs, OutputDir);
+    }
+
+    if (!Socket.empty()) {
+        int Status = 0;
+        for (auto &SourcePath : op.getSourcePathList()) {
+            Status |= Run(SourcePath, llvm::outs(), llvm::errs());
+        }
+        return Status;
+    }
+
     clang::tooling::ClangTool Tool(op.getCompilations(), op.getSourcePathList());
 
-    int result = Tool.run(clang::tooling::newFrontendActionFactory<MixedPrintPreprocessedAction>().get());
+    MixedPrintPreprocessedActionFactory Factory(Options);
+    int result = Tool.run(&Factory);
 
     return result;
 }
@@ -0,0 +1,147 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "FrontendActions.hpp"
+#include "ParallelTool.hpp"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+using namespace clang;
+
+
+namespace {
+
+struct SourceResult {
+    std::string Output;
+    std::string Errors;
+    double Seconds = 0;
+    int Status = 0;
+    bool Done = false;
+};
+
+}
+
+
+static std::string getOutputPath(StringRef OutputDir, StringRef SourcePath) {
+    SmallString<256> Path(OutputDir);
+    llvm::sys::path::append(Path, flattenPath(SourcePath) + ".mpp");
+    return Path.str().str();
+}
+
+static void printTimingSummary(
+        llvm::raw_ostream &OS,
+        ArrayRef<std::string> SourcePaths,
+        const std::vector<SourceResult> &Results,
+        double WallSeconds) {
+    double Total = 0;
+
+    OS << "===" << std::string(73, '-') << "===\n";
+    OS << "                      Mixed preprocessor per-TU time\n";
+    OS << "===" << std::string(73, '-') << "===\n";
+    OS << "  Time (ms)  Status  Source\n";
+
+    for (size_t i = 0; i != SourcePaths.size(); ++i) {
+        Total += Results[i].Seconds;
+        OS << llvm::format("%11.1f  %6d  ", Results[i].Seconds * 1000, Results[i].Status)
+           << SourcePaths[i] << "\n";
+    }
+
+    OS << llvm::format("%11.1f          Total (%u TUs)\n", Total * 1000, (unsigned)SourcePaths.size());
+    OS << llvm::format("%11.1f          Wall clock\n", WallSeconds * 1000);
+}
+
+int runParallel(
+        ArrayRef<std::string> SourcePaths,
+        const SourceRunner &Run,
+        unsigned Jobs,
+        StringRef OutputDir) {
+    typedef std::chrono::steady_clock Clock;
+
+    std::vector<SourceResult> Results(SourcePaths.size());
+    std::mutex ResultsMutex;
+    std::condition_variable ResultReady;
+
+    if (!OutputDir.empty()) {
+        if (std::error_code EC = llvm::sys::fs::create_directories(OutputDir)) {
+            llvm::errs() << "error: cannot create " << OutputDir << ": " << EC.message() << "\n";
+            return 1;
+        }
+    }
+
+    auto WallStart = Clock::now();
+
+    llvm::ThreadPool Pool(Jobs);
+
+    for (size_t i = 0; i != SourcePaths.size(); ++i) {
+        Pool.async([&, i]() {
+            SourceResult Result;
+            auto Start = Clock::now();
+
+            llvm::raw_string_ostream ErrOS(Result.Errors);
+
+            std::unique_ptr<llvm::raw_ostream> OS;
+            if (OutputDir.empty()) {
+                OS.reset(new llvm::raw_string_ostream(Result.Output));
+            } else {
+                std::error_code EC;
+                std::string Path = getOutputPath(OutputDir, SourcePaths[i]);
+                OS.reset(new llvm::raw_fd_ostream(Path, EC, llvm::sys::fs::F_None));
+                if (EC) {
+                    ErrOS << "error: cannot open " << Path << ": " << EC.message() << "\n";
+                    Result.Status = 1;
+                    OS.reset();
+                }
+            }
+
+            if (OS) {
+                Result.Status = Run(SourcePaths[i], *OS, ErrOS);
+                OS.reset();
+            }
+            ErrOS.flush();
+
+            Result.Seconds = std::chrono::duration<double>(Clock::now() - Start).count();
+            Result.Done = true;
+
+            std::lock_guard<std::mutex> Guard(ResultsMutex);
+            Results[i] = std::move(Result);
+            ResultReady.notify_all();
+        });
+    }
+
+    // Outputs are written as soon as all of the preceding ones are, each
+    // after its diagnostics.
+    int Status = 0;
+    for (size_t i = 0; i != SourcePaths.size(); ++i) {
+        std::string Output;
+        std::string Errors;
+        {
+            std::unique_lock<std::mutex> Guard(ResultsMutex);
+            ResultReady.wait(Guard, [&]() { return Results[i].Done; });
+            Output.swap(Results[i].Output);
+            Errors.swap(Results[i].Errors);
+            Status |= Results[i].Status;
+        }
+        llvm::errs() << Errors;
+        llvm::outs() << Output;
+        llvm::outs().flush();
+    }
+
+    Pool.wait();
+
+    double WallSeconds = std::chrono::duration<double>(Clock::now() - WallStart).count();
+    printTimingSummary(llvm::errs(), SourcePaths, Results, WallSeconds);
+
+    return Status;
+}
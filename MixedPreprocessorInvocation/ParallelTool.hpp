@@ -0,0 +1,38 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_PARALLELTOOL_HPP
+#define MIXED_PREPROCESSOR_PARALLELTOOL_HPP
+
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <functional>
+#include <string>
+
+
+// Preprocesses one source into OS, with its diagnostics and reports to ErrOS,
+// returns its status.
+typedef std::function<int(llvm::StringRef SourcePath, llvm::raw_ostream &OS, llvm::raw_ostream &ErrOS)>
+        SourceRunner;
+
+
+// Preprocesses every source with Run, Jobs of them at a time.
+//
+// Without OutputDir, the outputs are buffered and written to stdout in the
+// order of SourcePaths, as if the sources were processed one by one.  With
+// OutputDir, every source is written to a file of its own in there.  The
+// diagnostics of every source are buffered likewise and written to stderr
+// along with its output.  A per-source timing summary is printed to stderr
+// at the end.
+int runParallel(
+        llvm::ArrayRef<std::string> SourcePaths,
+        const SourceRunner &Run,
+        unsigned Jobs,
+        llvm::StringRef OutputDir);
+
+
+#endif //MIXED_PREPROCESSOR_PARALLELTOOL_HPP
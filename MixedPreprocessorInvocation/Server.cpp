@@ -0,0 +1,143 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "CachingFileSystem.hpp"
+#include "FrontendActions.hpp"
+#include "Server.hpp"
+#include "ServerProtocol.hpp"
+
+#include "clang/Frontend/PCHContainerOperations.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace clang;
+
+
+namespace {
+
+struct ServerState {
+    std::string MainExecutable;
+    IntrusiveRefCntPtr<CachingFileSystem> FS;
+    std::shared_ptr<PCHContainerOperations> PCHContainerOps;
+
+    std::mutex StoresMutex;
+    llvm::StringMap<std::shared_ptr<PreComputedStore>> Stores;
+
+    explicit ServerState(StringRef MainExecutable) :
+            MainExecutable(MainExecutable),
+            FS(new CachingFileSystem()),
+            PCHContainerOps(std::make_shared<PCHContainerOperations>()) {}
+
+    // The one of no cache directory is kept in memory only.
+    std::shared_ptr<PreComputedStore> getStore(StringRef CacheDir) {
+        std::lock_guard<std::mutex> Guard(StoresMutex);
+        auto &Store = Stores[CacheDir];
+        if (!Store) {
+            Store = std::make_shared<PreComputedStore>(CacheDir);
+        }
+        return Store;
+    }
+};
+
+}
+
+
+static ServerReply serveRequest(ServerState &State, ServerRequest &Request) {
+    ServerReply Reply;
+    llvm::raw_string_ostream OS(Reply.Output);
+    llvm::raw_string_ostream ErrOS(Reply.Errors);
+
+    MixedPreprocessorOptions &Options = Request.Options;
+    Options.Store = State.getStore(Options.CacheDir);
+
+    {
+        CachingFileSystem::Use Use(*State.FS);
+        Reply.Status = runCompileCommands(Request.Commands, Request.SourcePath, Options, State.MainExecutable,
+                                          State.FS, State.PCHContainerOps, OS, ErrOS);
+    }
+
+    if (Options.Store) {
+        Options.Store->save();
+    }
+
+    OS.flush();
+    ErrOS.flush();
+    return Reply;
+}
+
+static void serveConnection(ServerState &State, int FD) {
+    std::string Message;
+    ServerRequest Request;
+    if (!receiveMessage(FD, Message)) {
+        return;
+    }
+
+    ServerReply Reply;
+    if (decodeRequest(Message, Request)) {
+        Reply = serveRequest(State, Request);
+    } else {
+        Reply.Status = 1;
+        Reply.Errors = "error: malformed request, client and server versions differ?\n";
+    }
+
+    std::string Encoded = encodeReply(Reply);
+    if (Encoded.size() > MaxMessageSize) {
+        ServerReply TooLarge;
+        TooLarge.Status = 1;
+        TooLarge.Errors = "error: the output of " + Request.SourcePath +
+                          " is too large to be sent back, preprocess it without the server\n";
+        Encoded = encodeReply(TooLarge);
+    }
+
+    // A client that went away is not an error of the server.
+    sendMessage(FD, Encoded);
+}
+
+int runServer(StringRef SocketPath, unsigned Jobs, StringRef MainExecutable) {
+    // Writing to a client that went away must not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string Error;
+    int ListenFD = listenSocket(SocketPath, Error);
+    if (ListenFD < 0) {
+        llvm::errs() << "error: cannot listen on " << SocketPath << ": " << Error << "\n";
+        return 1;
+    }
+
+    ServerState State(MainExecutable);
+    llvm::ThreadPool Pool(Jobs);
+
+    for (;;) {
+        int FD = accept(ListenFD, nullptr, nullptr);
+        if (FD < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            llvm::errs() << "error: cannot accept on " << SocketPath << ": " << strerror(errno) << "\n";
+            break;
+        }
+
+        Pool.async([&State, FD]() {
+            serveConnection(State, FD);
+            close(FD);
+        });
+    }
+
+    Pool.wait();
+    close(ListenFD);
+    unlink(SocketPath.str().c_str());
+    return 1;
+}
@@ -0,0 +1,24 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_SERVER_HPP
+#define MIXED_PREPROCESSOR_SERVER_HPP
+
+
+#include "llvm/ADT/StringRef.h"
+
+
+// Serves preprocessing requests on the Unix socket SocketPath until killed,
+// Jobs of them at a time.  See ServerProtocol.hpp.
+//
+// What does not depend on a translation unit is kept between requests: the
+// process itself, the contents of the files read (see CachingFileSystem)
+// and the PreComputed store of every cache directory, saved after every
+// request that added to it.  Requests without a cache directory share a
+// store kept in memory.  The driver is told it runs as MainExecutable,
+// which the builtin headers are found next to.
+int runServer(llvm::StringRef SocketPath, unsigned Jobs, llvm::StringRef MainExecutable);
+
+
+#endif //MIXED_PREPROCESSOR_SERVER_HPP
@@ -0,0 +1,41 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "Server.hpp"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+
+#include <string>
+#include <thread>
+
+
+static llvm::cl::OptionCategory ServerCategory("Server options");
+
+static llvm::cl::opt<std::string> SocketPath(
+        llvm::cl::Positional,
+        llvm::cl::desc("<socket>"),
+        llvm::cl::Required,
+        llvm::cl::cat(ServerCategory));
+
+static llvm::cl::opt<unsigned> Jobs(
+        "j",
+        llvm::cl::desc("Serve <N> requests in parallel, one per core by default"),
+        llvm::cl::value_desc("N"),
+        llvm::cl::init(std::thread::hardware_concurrency()),
+        llvm::cl::Prefix,
+        llvm::cl::cat(ServerCategory));
+
+// Its address locates the executable.
+static int StaticSymbol;
+
+int main(int argc, const char **argv) {
+    llvm::cl::HideUnrelatedOptions(ServerCategory);
+    llvm::cl::ParseCommandLineOptions(argc, argv,
+            "Mixed preprocessor server, clients are mixed-preprocessor --connect=<socket>\n");
+
+    std::string MainExecutable = llvm::sys::fs::getMainExecutable(argv[0], &StaticSymbol);
+
+    return runServer(SocketPath, Jobs ? Jobs : 1, MainExecutable);
+}
@@ -0,0 +1,282 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "ServerProtocol.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace clang;
+
+
+// Bumped on every change of the encoding, a client and a server of
+// different versions refuse each other's messages.
+static const uint32_t ProtocolVersion = 2;
+
+
+namespace {
+
+class MessageWriter {
+    std::string Data;
+
+public:
+    void writeInt(uint32_t Value) {
+        Data.append(reinterpret_cast<const char *>(&Value), sizeof(Value));
+    }
+
+    void writeString(StringRef String) {
+        writeInt(String.size());
+        Data.append(String.data(), String.size());
+    }
+
+    std::string take() { return std::move(Data); }
+};
+
+// Bounds-checked, a truncated message just fails to decode.
+class MessageReader {
+    StringRef Data;
+    bool Failed;
+
+public:
+    explicit MessageReader(StringRef Data) : Data(Data), Failed(false) {}
+
+    bool failed() const { return Failed; }
+
+    uint32_t readInt() {
+        uint32_t Value = 0;
+        if (Failed || Data.size() < sizeof(Value)) {
+            Failed = true;
+            return Value;
+        }
+        memcpy(&Value, Data.data(), sizeof(Value));
+        Data = Data.drop_front(sizeof(Value));
+        return Value;
+    }
+
+    std::string readString() {
+        uint32_t Length = readInt();
+        if (Failed || Data.size() < Length) {
+            Failed = true;
+            return std::string();
+        }
+        std::string Result = Data.substr(0, Length).str();
+        Data = Data.drop_front(Length);
+        return Result;
+    }
+};
+
+}
+
+
+std::string encodeRequest(const ServerRequest &Request) {
+    MessageWriter Writer;
+    Writer.writeInt(ProtocolVersion);
+
+    const MixedPreprocessorOptions &Options = Request.Options;
+    Writer.writeInt(Options.Format);
+    Writer.writeString(Options.CacheDir);
+    Writer.writeInt(Options.MemoryBudgetMB);
+    Writer.writeInt(Options.Stats);
+    Writer.writeInt(Options.StatsTopN);
+    Writer.writeString(Options.TraceDir);
+
+    Writer.writeString(Request.SourcePath);
+    Writer.writeInt(Request.Commands.size());
+    for (auto &Command : Request.Commands) {
+        Writer.writeString(Command.Directory);
+        Writer.writeInt(Command.CommandLine.size());
+        for (auto &Arg : Command.CommandLine) {
+            Writer.writeString(Arg);
+        }
+    }
+
+    return Writer.take();
+}
+
+bool decodeRequest(StringRef Message, ServerRequest &Request) {
+    MessageReader Reader(Message);
+    if (Reader.readInt() != ProtocolVersion) {
+        return false;
+    }
+
+    MixedPreprocessorOptions &Options = Request.Options;
+    Options.Format = Reader.readInt() == MixedPreprocessorOptions::Binary ? MixedPreprocessorOptions::Binary
+                                                                           : MixedPreprocessorOptions::Text;
+    Options.CacheDir = Reader.readString();
+    Options.MemoryBudgetMB = Reader.readInt();
+    Options.Stats = Reader.readInt();
+    Options.StatsTopN = Reader.readInt();
+    Options.TraceDir = Reader.readString();
+
+    Request.SourcePath = Reader.readString();
+    uint32_t NumCommands = Reader.readInt();
+    for (uint32_t i = 0; i != NumCommands && !Reader.failed(); ++i) {
+        tooling::CompileCommand Command;
+        Command.Directory = Reader.readString();
+        uint32_t NumArgs = Reader.readInt();
+        for (uint32_t j = 0; j != NumArgs && !Reader.failed(); ++j) {
+            Command.CommandLine.push_back(Reader.readString());
+        }
+        Request.Commands.push_back(std::move(Command));
+    }
+
+    return !Reader.failed();
+}
+
+std::string encodeReply(const ServerReply &Reply) {
+    MessageWriter Writer;
+    Writer.writeInt(ProtocolVersion);
+    Writer.writeInt(Reply.Status);
+    Writer.writeString(Reply.Output);
+    Writer.writeString(Reply.Errors);
+    return Writer.take();
+}
+
+bool decodeReply(StringRef Message, ServerReply &Reply) {
+    MessageReader Reader(Message);
+    if (Reader.readInt() != ProtocolVersion) {
+        return false;
+    }
+
+    Reply.Status = Reader.readInt();
+    Reply.Output = Reader.readString();
+    Reply.Errors = Reader.readString();
+    return !Reader.failed();
+}
+
+
+static bool writeAll(int FD, const char *Data, size_t Size) {
+    while (Size) {
+        ssize_t Written = ::write(FD, Data, Size);
+        if (Written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        Data += Written;
+        Size -= Written;
+    }
+    return true;
+}
+
+static bool readAll(int FD, char *Data, size_t Size) {
+    while (Size) {
+        ssize_t Read = ::read(FD, Data, Size);
+        if (Read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (Read == 0) {
+            return false;
+        }
+        Data += Read;
+        Size -= Read;
+    }
+    return true;
+}
+
+bool sendMessage(int FD, StringRef Message) {
+    if (Message.size() > MaxMessageSize) {
+        return false;
+    }
+
+    uint32_t Length = Message.size();
+    return writeAll(FD, reinterpret_cast<const char *>(&Length), sizeof(Length)) &&
+           writeAll(FD, Message.data(), Message.size());
+}
+
+bool receiveMessage(int FD, std::string &Message) {
+    uint32_t Length;
+    if (!readAll(FD, reinterpret_cast<char *>(&Length), sizeof(Length))) {
+        return false;
+    }
+    if (Length > MaxMessageSize) {
+        return false;
+    }
+
+    // The buffer grows with the data actually received, so that a peer does
+    // not get a large allocation for a length it never sends.
+    const size_t ChunkSize = 1 << 20;
+    Message.clear();
+    while (Message.size() != Length) {
+        size_t Begin = Message.size();
+        size_t Size = std::min<size_t>(Length - Begin, ChunkSize);
+        Message.resize(Begin + Size);
+        if (!readAll(FD, &Message[Begin], Size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool getAddress(StringRef Path, sockaddr_un &Address) {
+    memset(&Address, 0, sizeof(Address));
+    Address.sun_family = AF_UNIX;
+    if (Path.empty() || Path.size() >= sizeof(Address.sun_path)) {
+        return false;
+    }
+    memcpy(Address.sun_path, Path.data(), Path.size());
+    return true;
+}
+
+int connectSocket(StringRef Path) {
+    sockaddr_un Address;
+    if (!getAddress(Path, Address)) {
+        return -1;
+    }
+
+    int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (FD < 0) {
+        return -1;
+    }
+    if (connect(FD, reinterpret_cast<sockaddr *>(&Address), sizeof(Address)) < 0) {
+        close(FD);
+        return -1;
+    }
+    return FD;
+}
+
+int listenSocket(StringRef Path, std::string &Error) {
+    sockaddr_un Address;
+    if (!getAddress(Path, Address)) {
+        Error = "invalid socket path";
+        return -1;
+    }
+
+    // A socket nobody listens on anymore is left by a killed server, any
+    // other file is left alone.
+    int Existing = connectSocket(Path);
+    if (Existing >= 0) {
+        close(Existing);
+        Error = "a server is already listening";
+        return -1;
+    }
+    struct stat Stat;
+    if (lstat(Address.sun_path, &Stat) == 0 && S_ISSOCK(Stat.st_mode)) {
+        unlink(Address.sun_path);
+    }
+
+    int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (FD < 0) {
+        Error = strerror(errno);
+        return -1;
+    }
+    if (bind(FD, reinterpret_cast<sockaddr *>(&Address), sizeof(Address)) < 0 || listen(FD, SOMAXCONN) < 0) {
+        Error = strerror(errno);
+        close(FD);
+        return -1;
+    }
+    return FD;
+}
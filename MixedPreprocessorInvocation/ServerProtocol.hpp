@@ -0,0 +1,60 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_SERVERPROTOCOL_HPP
+#define MIXED_PREPROCESSOR_SERVERPROTOCOL_HPP
+
+
+#include "FrontendActions.hpp"
+
+#include "clang/Tooling/CompilationDatabase.h"
+
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// A client sends one request per connection and reads one reply.  Both are
+// a single message, a uint32 length followed by that many bytes, in native
+// byte order: the client and the server always run on the same machine.
+
+// Longer messages are neither sent nor received: the length field of a peer
+// is not trusted further than that.
+const uint32_t MaxMessageSize = 1u << 30;
+
+// Preprocess SourcePath with Options, once per compile command.
+struct ServerRequest {
+    MixedPreprocessorOptions Options;
+    std::string SourcePath;
+    std::vector<clang::tooling::CompileCommand> Commands;
+};
+
+// What the command line tool would have written to stdout and stderr.
+struct ServerReply {
+    int Status = 0;
+    std::string Output;
+    std::string Errors;
+};
+
+std::string encodeRequest(const ServerRequest &Request);
+bool decodeRequest(llvm::StringRef Message, ServerRequest &Request);
+
+std::string encodeReply(const ServerReply &Reply);
+bool decodeReply(llvm::StringRef Message, ServerReply &Reply);
+
+// Both return false on an error, a message over MaxMessageSize, or a peer
+// that went away before the whole message was through.
+bool sendMessage(int FD, llvm::StringRef Message);
+bool receiveMessage(int FD, std::string &Message);
+
+// A socket connected to the server listening on Path, -1 if there is none.
+int connectSocket(llvm::StringRef Path);
+
+// A socket listening on Path, replacing a stale one, -1 on error.
+int listenSocket(llvm::StringRef Path, std::string &Error);
+
+
+#endif //MIXED_PREPROCESSOR_SERVERPROTOCOL_HPP
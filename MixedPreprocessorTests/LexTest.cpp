@@ -0,0 +1,141 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "MixedComputations.hpp"
+
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Lex/Preprocessor.h"
+#include "clang/Tooling/Tooling.h"
+
+#include "gtest/gtest.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace clang;
+
+
+namespace {
+
+// Lexes the whole main file through the stock Preprocessor if Batch is 0,
+// through MixedComputations::Lex if it is 1, through LexBatch Batch tokens at
+// a time otherwise.  Every token is printed as a line of Output.
+class LexAction : public PreprocessorFrontendAction {
+    const size_t Batch;
+    std::string &Output;
+
+    void print(Preprocessor &PP, const Token &Tok) {
+        Output += tok::getTokenName(Tok.getKind());
+        Output += " '" + PP.getSpelling(Tok) + "'\n";
+    }
+
+protected:
+    void ExecuteAction() override {
+        Preprocessor &PP = getCompilerInstance().getPreprocessor();
+
+        std::unique_ptr<MixedComputations> MC;
+        if (Batch) {
+            MC = llvm::make_unique<MixedComputations>(PP);
+        }
+
+        PP.EnterMainSourceFile();
+
+        Token Tok;
+        if (Batch > 1) {
+            std::vector<Token> Tokens(Batch);
+            size_t Count;
+            do {
+                Count = MC->LexBatch(Tokens.data(), Tokens.size());
+                ASSERT_GT(Count, 0u);
+                for (size_t i = 0; i != Count; ++i) {
+                    print(PP, Tokens[i]);
+                }
+            } while (Tokens[Count - 1].isNot(tok::eof));
+        } else {
+            do {
+                if (MC) {
+                    MC->Lex(Tok);
+                } else {
+                    PP.Lex(Tok);
+                }
+                print(PP, Tok);
+            } while (Tok.isNot(tok::eof));
+        }
+    }
+
+public:
+    LexAction(size_t Batch, std::string &Output) : Batch(Batch), Output(Output) {}
+};
+
+std::string lex(const std::string &Code, size_t Batch) {
+    std::string Output;
+    tooling::runToolOnCodeWithArgs(new LexAction(Batch, Output), Code, {"-x", "c++"}, "test.cpp");
+    return Output;
+}
+
+// Token by token, in batches of every size around the chunks of a streamed
+// expansion, the tokens are the ones of the stock Preprocessor.
+void expectSameTokens(const std::string &Code) {
+    std::string Expected = lex(Code, 0);
+    ASSERT_FALSE(Expected.empty());
+
+    for (size_t Batch : {1, 2, 3, 7, 255, 256, 257, 1024}) {
+        EXPECT_EQ(Expected, lex(Code, Batch)) << "batch " << Batch << " of\n" << Code;
+    }
+}
+
+}
+
+
+TEST(LexTest, PlainTokens) {
+    expectSameTokens("");
+    expectSameTokens("int x = 1;\n");
+}
+
+TEST(LexTest, Expansions) {
+    expectSameTokens(
+            "#define E\n"
+            "#define ONE 1\n"
+            "#define ADD(x, y) ((x) + (y))\n"
+            "E E int E a = ONE; E\n"
+            "int b = ADD(ONE, ADD(2, ONE)) E;\n"
+            "E\n");
+}
+
+TEST(LexTest, StreamedExpansions) {
+    // X8 is 1024 tokens, more than a chunk of a streamed expansion.
+    std::string Code = "#define X0 a, b\n";
+    for (unsigned i = 1; i != 10; ++i) {
+        Code += "#define X" + std::to_string(i) + " X" + std::to_string(i - 1) + " X" + std::to_string(i - 1) + "\n";
+    }
+    Code += "#define F(x) { x X8 x }\n";
+
+    expectSameTokens(Code + "X8 X9 F(1) x F(X7)\n");
+}
+
+TEST(LexTest, TrailingMacroName) {
+    // C11 6.10.3.4p4: the name ending an expansion is invoked by the
+    // following tokens, even at the end of a batch.
+    expectSameTokens(
+            "#define f(a) a*g\n"
+            "#define g(a) f(a)\n"
+            "#define h g\n"
+            "f(2)(9) f(2) x h(1) h\n");
+}
+
+TEST(LexTest, FunctionLikeNameAtEof) {
+    // The lookahead for a ( hits the end of the file.
+    const std::string Definitions =
+            "#define f(x) [x]\n"
+            "#define g f\n"
+            "#define h(x) x f\n";
+
+    expectSameTokens(Definitions + "f");
+    expectSameTokens(Definitions + "f\n");
+    expectSameTokens(Definitions + "x g");
+    expectSameTokens(Definitions + "h(1)");
+    expectSameTokens(Definitions + "h(g)\n");
+}
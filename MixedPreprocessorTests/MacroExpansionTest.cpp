@@ -0,0 +1,244 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "TestPreprocess.hpp"
+
+#include "gtest/gtest.h"
+
+#include <string>
+#include <vector>
+
+
+// Expansions are checked against the tokens they should produce, written out:
+// the output holds kinds and spellings, not whitespace.  Both are preprocessed
+// with Args added to the command line.
+static void expectExpansion(
+        const std::string &Definitions,
+        const std::string &Use,
+        const std::string &Expected,
+        const std::vector<std::string> &Args = std::vector<std::string>()) {
+    MixedPreprocessorOptions Options;
+    EXPECT_EQ(preprocess(Expected, Options, nullptr, Args), preprocess(Definitions + Use, Options, nullptr, Args))
+            << Use;
+}
+
+
+TEST(MacroExpansionTest, PasteIdentifiers) {
+    const std::string Definitions =
+            "#define CAT(a, b) a ## b\n"
+            "#define foobar 1\n";
+
+    expectExpansion(Definitions, "CAT(foo, bar)\n", "1\n");
+    expectExpansion(Definitions, "CAT(x, y) CAT(x, y)\n", "xy xy\n");
+    // The identifier table gives a pasted keyword its kind.
+    expectExpansion(Definitions, "CAT(in, t) CAT(re, turn)\n", "int return\n");
+}
+
+TEST(MacroExpansionTest, PasteOtherTokens) {
+    const std::string Definitions = "#define CAT(a, b) a ## b\n";
+
+    expectExpansion(Definitions, "CAT(1, 2) CAT(+, =) CAT(<, <=)\n", "12 += <<=\n");
+    expectExpansion(Definitions, "CAT(x, 1) CAT(1, e5)\n", "x1 1e5\n");
+}
+
+TEST(MacroExpansionTest, FailedPasteKeepsOperands) {
+    const std::string Definitions =
+            "#define CAT(a, b) a ## b\n"
+            "#define CAT3(a, b, c) a ## b ## c\n"
+            "#define y 2\n";
+
+    expectExpansion(Definitions, "CAT(x, +)\n", "x +\n");
+    expectExpansion(Definitions, "CAT(+, -) CAT(+, -)\n", "+ - + -\n");
+    // RHS is still an operand of the next ##, both are still macro names.
+    expectExpansion(Definitions, "CAT3(x, +, y)\n", "x + 2\n");
+    expectExpansion(Definitions, "CAT(y, .)\n", "2 .\n");
+}
+
+TEST(MacroExpansionTest, EmptyArgumentList) {
+    const std::string Definitions =
+            "#define NONE() 1\n"
+            "#define ONE(a) [a]\n"
+            "#define CALL(f) f()\n";
+
+    // No argument for a macro without parameters, one empty argument for a
+    // macro with one.
+    expectExpansion(Definitions, "NONE() NONE( )\n", "1 1\n");
+    expectExpansion(Definitions, "ONE() ONE( )\n", "[] []\n");
+    expectExpansion(Definitions, "CALL(NONE) CALL(ONE)\n", "1 []\n");
+}
+
+TEST(MacroExpansionTest, SelfReference) {
+    expectExpansion("#define A A\n", "A A\n", "A A\n");
+    expectExpansion("#define f(x) x f(x)\n", "f(1)\n", "1 f(1)\n");
+}
+
+TEST(MacroExpansionTest, MutualRecursion) {
+    const std::string Objects =
+            "#define A B\n"
+            "#define B A\n";
+
+    // Each name expands to itself through the other one, whichever body is
+    // computed first.
+    expectExpansion(Objects, "A B\n", "A B\n");
+    expectExpansion(Objects, "B A\n", "B A\n");
+
+    const std::string Functions =
+            "#define f(x) g(x)\n"
+            "#define g(x) f(x)\n";
+
+    expectExpansion(Functions, "g(1)\n", "g(1)\n");
+    expectExpansion(Functions, "f(1) g(1)\n", "f(1) g(1)\n");
+    expectExpansion(Functions, "g(f(1))\n", "g(f(1))\n");
+}
+
+TEST(MacroExpansionTest, RescanWithRestOfFile) {
+    // C11 6.10.3.4p4: the last name of an expansion is invoked by the tokens
+    // following it.
+    const std::string Definitions =
+            "#define f(a) a*g\n"
+            "#define g(a) f(a)\n";
+
+    expectExpansion(Definitions, "f(2)(9)\n", "2*9*g\n");
+    expectExpansion(Definitions, "f(2) x\n", "2*g x\n");
+}
+
+TEST(MacroExpansionTest, Stringify) {
+    const std::string Definitions =
+            "#define S(x) #x\n"
+            "#define WRAP(y) [S(y)]\n"
+            "#define VALUE 42\n";
+
+    expectExpansion(Definitions, "S(a) S() S(VALUE)\n", "\"a\" \"\" \"VALUE\"\n");
+    // The argument of S in the body of WRAP is a placeholder while WRAP is
+    // PreComputed, it is expanded before S gets it.
+    expectExpansion(Definitions, "WRAP(a) WRAP(VALUE) WRAP()\n", "[\"a\"] [\"42\"] [\"\"]\n");
+}
+
+TEST(MacroExpansionTest, StringifySequence) {
+    // The operand of the outer S holds a placeholder of T along with a
+    // nested invocation, which is stringified as written.
+    const std::string Definitions =
+            "#define S(x) #x\n"
+            "#define T(y) S(S(y))\n"
+            "#define U(y) S(y S(y) y)\n";
+
+    expectExpansion(Definitions, "T(a) T(b  c)\n", "\"S(a)\" \"S(b c)\"\n");
+    expectExpansion(Definitions, "U(1) U(1) U(2)\n", "\"1 S(1) 1\" \"1 S(1) 1\" \"2 S(2) 2\"\n");
+}
+
+TEST(MacroExpansionTest, StringifySpacingAndEscapes) {
+    const std::string Definitions =
+            "#define S(x) #x\n"
+            "#define WRAP(y) S(y)\n";
+
+    // C99 6.10.3.2p2: leading and trailing white space is deleted, internal
+    // white space becomes a single space.
+    expectExpansion(Definitions, "S(  a   b  ) S(a+ b)\n", "\"a b\" \"a+ b\"\n");
+    expectExpansion(Definitions, "WRAP(  a   b  ) WRAP(a+ b)\n", "\"a b\" \"a+ b\"\n");
+
+    // \\ and \" are escaped in string and character literals.
+    expectExpansion(Definitions, "S(\"a\\n\" '\\'')\n", "\"\\\"a\\\\n\\\" '\\\\''\"\n");
+    expectExpansion(Definitions, "WRAP(\"a\\n\" '\\'')\n", "\"\\\"a\\\\n\\\" '\\\\''\"\n");
+}
+
+TEST(MacroExpansionTest, Charify) {
+    // #@ is a Microsoft extension.
+    const std::vector<std::string> Args = {"-fms-extensions"};
+    const std::string Definitions =
+            "#define C(x) #@x\n"
+            "#define WRAP(y) C(y)\n";
+
+    expectExpansion(Definitions, "C(a) WRAP(b)\n", "'a' 'b'\n", Args);
+}
+
+namespace {
+
+// OUTER has a PreComputed body holding INNER.  CALL(F) goes through the
+// expansion cache, its argument has to be rescanned with the body.
+const char *Dependents =
+        "#define INNER 1\n"
+        "#define OUTER(x) [INNER x]\n"
+        "#define F(a) <a INNER>\n"
+        "#define CALL(f) f(0)\n";
+
+}
+
+TEST(MacroExpansionTest, RedefinitionInvalidatesDependents) {
+    expectExpansion(Dependents,
+                    "OUTER(a) CALL(F) CALL(F)\n"
+                    "#undef INNER\n"
+                    "OUTER(a) CALL(F) CALL(F)\n"
+                    "#define INNER 2\n"
+                    "OUTER(a) CALL(F) CALL(F)\n",
+                    "[1 a] <0 1> <0 1>\n"
+                    "[INNER a] <0 INNER> <0 INNER>\n"
+                    "[2 a] <0 2> <0 2>\n");
+}
+
+TEST(MacroExpansionTest, IdenticalRedefinitionKeepsWork) {
+    MixedPreprocessorOptions Options;
+    Options.Stats = true;
+
+    // C99 6.10.3p2: nothing changes, the body of OUTER and the cached
+    // invocation of CALL are used again.
+    std::string Reports;
+    preprocess(std::string(Dependents) +
+               "OUTER(a) CALL(F)\n"
+               "#define INNER 1\n"
+               "OUTER(a) CALL(F)\n",
+               Options, &Reports);
+    EXPECT_EQ(1u, getCounter(Reports, "OUTER", "precomputes"));
+    EXPECT_EQ(1u, getCounter(Reports, "CALL", "cache_hits"));
+
+    Reports.clear();
+    preprocess(std::string(Dependents) +
+               "OUTER(a) CALL(F)\n"
+               "#define INNER 2\n"
+               "OUTER(a) CALL(F)\n",
+               Options, &Reports);
+    EXPECT_EQ(2u, getCounter(Reports, "OUTER", "precomputes"));
+    EXPECT_EQ(0u, getCounter(Reports, "CALL", "cache_hits"));
+}
+
+TEST(MacroExpansionTest, BodyShapes) {
+    const std::string Definitions =
+            "#define CONSTANT 1 + 2\n"
+            "#define SUBST(a, b) a + b\n"
+            "#define F(x) [x]\n"
+            "#define RESCAN(a) F a\n"
+            "#define APPLY(f, x) f(x)\n";
+
+    // The first invocation of each macro rewrites its body, the next ones
+    // take the path of its shape: either has to give the same tokens.
+    const std::string Use =
+            "CONSTANT CONSTANT CONSTANT\n"
+            "SUBST(x, 1) SUBST(x, 1) SUBST(F(y), CONSTANT)\n"
+            "RESCAN((1)) RESCAN((1)) RESCAN((SUBST(1, 2)))\n"
+            "APPLY(F, 1) APPLY(F, 1) APPLY(RESCAN, (2))\n";
+    const std::string Expected =
+            "1 + 2 1 + 2 1 + 2\n"
+            "x + 1 x + 1 [y] + 1 + 2\n"
+            "[1] [1] [1 + 2]\n"
+            "[1] [1] [2]\n";
+
+    expectExpansion(Definitions, Use, Expected);
+
+    MixedPreprocessorOptions Options;
+    Options.Stats = true;
+    std::string Reports;
+    preprocess(Definitions + Use, Options, &Reports);
+
+    // BS_Constant and BS_Substitution bodies are expanded in place, only
+    // their first invocation looks the cache up.
+    EXPECT_EQ(1u, getCounter(Reports, "CONSTANT", "cache_misses"));
+    EXPECT_EQ(0u, getCounter(Reports, "CONSTANT", "cache_hits"));
+    EXPECT_EQ(1u, getCounter(Reports, "SUBST", "cache_misses"));
+    EXPECT_EQ(0u, getCounter(Reports, "SUBST", "cache_hits"));
+
+    // A BS_Rescan body, here with a name F the body leaves to its rescan, and
+    // an argument naming a macro rescanned along with the body, go through
+    // the cache.
+    EXPECT_EQ(1u, getCounter(Reports, "RESCAN", "cache_hits"));
+    EXPECT_EQ(1u, getCounter(Reports, "APPLY", "cache_hits"));
+}
@@ -0,0 +1,75 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "TestPreprocess.hpp"
+
+#include "gtest/gtest.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+
+namespace {
+
+// A counter of the memory report, which follows the budget.
+uint64_t getMemoryCounter(const std::string &Reports, const std::string &Counter) {
+    const std::string Key = "\"" + Counter + "\": ";
+    size_t Pos = Reports.find(Key, Reports.find("\"budget\": "));
+    return Pos == std::string::npos ? 0 : strtoull(Reports.c_str() + Pos + Key.size(), nullptr, 10);
+}
+
+// X9 is 2048 tokens, so is every PreComputed Yn.  Their bodies are several
+// megabytes in all, the definitions a few kilobytes.  ALL is streamed and
+// invokes every Yn in turn.
+std::string getCode() {
+    const unsigned NumY = 48;
+
+    std::string Code = "#define X0 a b c d\n";
+    for (unsigned i = 1; i != 10; ++i) {
+        Code += "#define X" + std::to_string(i) + " X" + std::to_string(i - 1) + " X" + std::to_string(i - 1) + "\n";
+    }
+
+    std::string All = "#define ALL";
+    for (unsigned n = 0; n != NumY; ++n) {
+        Code += "#define Y" + std::to_string(n) + "(x) x X9\n";
+        All += " Y" + std::to_string(n) + "(" + std::to_string(n) + ")";
+    }
+    Code += All + "\n";
+
+    return Code + "ALL\nY0(0) Y1(1)\n";
+}
+
+}
+
+
+TEST(MemoryBudgetTest, TinyBudgetKeepsOutput) {
+    const std::string Code = getCode();
+    const std::string Expected = preprocess(Code);
+
+    MixedPreprocessorOptions Options;
+    Options.Stats = true;
+    Options.MemoryBudgetMB = 1;
+
+    // Bodies are evicted while the body of ALL is streamed and those of the
+    // invocations in it are read: they are pinned, anything else would read
+    // freed tokens.  Evicted bodies used again are PreComputed again.
+    std::string Reports;
+    EXPECT_EQ(Expected, preprocess(Code, Options, &Reports));
+    EXPECT_GT(getMemoryCounter(Reports, "evictions"), 0u);
+    EXPECT_EQ(0u, getMemoryCounter(Reports, "budget_unreachable"));
+    EXPECT_EQ(2u, getCounter(Reports, "Y0", "precomputes"));
+}
+
+TEST(MemoryBudgetTest, UnboundedKeepsEverything) {
+    const std::string Code = getCode();
+
+    MixedPreprocessorOptions Options;
+    Options.Stats = true;
+
+    std::string Reports;
+    preprocess(Code, Options, &Reports);
+    EXPECT_EQ(0u, getMemoryCounter(Reports, "evictions"));
+    EXPECT_EQ(1u, getCounter(Reports, "Y0", "precomputes"));
+}
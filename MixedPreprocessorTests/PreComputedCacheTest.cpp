@@ -0,0 +1,218 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "PreComputedCache.hpp"
+#include "TestPreprocess.hpp"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+
+namespace {
+
+const char *Code =
+        "#define CAT(a, b) a ## b\n"
+        "#define ADD(x, y) ((x) + (y))\n"
+        "#define VALUE 42\n"
+        "#define TWICE(x) ADD(x, x)\n"
+        "#define GREETING \"hello\" L'w'\n"
+        "int CAT(var, 1) = TWICE(VALUE);\n"
+        "const char *s = GREETING;\n"
+        "double z = ADD(CAT(var, 1), 3.5e2) + TWICE(CAT(var, 1));\n";
+
+// Offsets into the file, as PreComputedCache.cpp lays it out.
+const size_t VersionOffset = 4;
+const size_t ByteOrderOffset = 8;
+const size_t TokenTableHashOffset = 12;
+const size_t HeaderSize = 20;
+
+// Sum of the precomputes_shared counters of a statistics report.
+uint64_t countShared(StringRef Reports) {
+    const StringRef Key = "\"precomputes_shared\": ";
+    uint64_t Shared = 0;
+    for (size_t Pos = Reports.find(Key); Pos != StringRef::npos; Pos = Reports.find(Key, Pos + 1)) {
+        Shared += strtoull(Reports.data() + Pos + Key.size(), nullptr, 10);
+    }
+    return Shared;
+}
+
+class PreComputedCacheTest : public ::testing::Test {
+protected:
+    SmallString<256> Dir;
+    SmallString<256> File;
+    std::string Expected;
+
+    void SetUp() override {
+        ASSERT_FALSE(llvm::sys::fs::createUniqueDirectory("mixed-preprocessor-test", Dir));
+        File = Dir;
+        llvm::sys::path::append(File, "precomputed.cache");
+        Expected = preprocess(Code);
+        ASSERT_FALSE(Expected.empty());
+    }
+
+    void TearDown() override {
+        llvm::sys::fs::remove(File);
+        llvm::sys::fs::remove(Dir);
+    }
+
+    // Statistics of the last run.
+    std::string Reports;
+
+    // Preprocesses Source with a store opened on Dir, which is saved when the
+    // run is over, and returns the number of bodies taken from it.
+    uint64_t run(std::string &Output, StringRef Source = Code) {
+        MixedPreprocessorOptions Options;
+        Options.Stats = true;
+        Options.Store = std::make_shared<PreComputedStore>(Dir);
+
+        Reports.clear();
+        Output = preprocess(Source, Options, &Reports);
+        return countShared(Reports);
+    }
+
+    std::string readFile() {
+        auto Buffer = llvm::MemoryBuffer::getFile(File);
+        EXPECT_TRUE(bool(Buffer));
+        return Buffer ? Buffer.get()->getBuffer().str() : std::string();
+    }
+
+    void writeFile(StringRef Data) {
+        std::error_code EC;
+        llvm::raw_fd_ostream OS(File, EC, llvm::sys::fs::F_None);
+        ASSERT_FALSE(EC);
+        OS << Data;
+    }
+
+    // Writes the file saved by a first run.
+    std::string populate() {
+        std::string Output;
+        EXPECT_EQ(0u, run(Output));
+        EXPECT_EQ(Expected, Output);
+
+        std::string Data = readFile();
+        EXPECT_GT(Data.size(), HeaderSize);
+        return Data;
+    }
+};
+
+}
+
+
+TEST_F(PreComputedCacheTest, RoundTrip) {
+    populate();
+
+    std::string Output;
+    EXPECT_GT(run(Output), 0u);
+    EXPECT_EQ(Expected, Output);
+}
+
+TEST_F(PreComputedCacheTest, ChangedDependency) {
+    populate();
+
+    // TWICE is stored along with the definition of ADD it was computed with.
+    std::string Source = Code;
+    Source.replace(Source.find("(x) + (y)"), 9, "(x) * (y)");
+
+    std::string Output;
+    EXPECT_GT(run(Output, Source), 0u);
+    EXPECT_EQ(preprocess(Source), Output);
+
+    EXPECT_EQ(0u, getCounter(Reports, "ADD", "precomputes_shared"));
+    EXPECT_EQ(0u, getCounter(Reports, "TWICE", "precomputes_shared"));
+    EXPECT_GT(getCounter(Reports, "TWICE", "precomputes"), 0u);
+    EXPECT_GT(getCounter(Reports, "CAT", "precomputes_shared"), 0u);
+}
+
+TEST_F(PreComputedCacheTest, InMemoryStore) {
+    MixedPreprocessorOptions Options;
+    Options.Stats = true;
+    Options.Store = std::make_shared<PreComputedStore>();
+
+    std::string Reports;
+    EXPECT_EQ(Expected, preprocess(Code, Options, &Reports));
+    EXPECT_EQ(0u, countShared(Reports));
+
+    Reports.clear();
+    EXPECT_EQ(Expected, preprocess(Code, Options, &Reports));
+    EXPECT_GT(countShared(Reports), 0u);
+}
+
+TEST_F(PreComputedCacheTest, MismatchedHeaderIsIgnored) {
+    std::string Data = populate();
+
+    for (size_t Offset : {size_t(0), VersionOffset, ByteOrderOffset, TokenTableHashOffset}) {
+        std::string Corrupt = Data;
+        Corrupt[Offset] ^= 0x5a;
+        writeFile(Corrupt);
+
+        std::string Output;
+        EXPECT_EQ(0u, run(Output)) << "offset " << Offset;
+        EXPECT_EQ(Expected, Output) << "offset " << Offset;
+    }
+}
+
+TEST_F(PreComputedCacheTest, ForeignByteOrderIsIgnored) {
+    std::string Data = populate();
+
+    // As a machine of the other byte order would have written the header.
+    std::reverse(&Data[ByteOrderOffset], &Data[ByteOrderOffset + 4]);
+    writeFile(Data);
+
+    std::string Output;
+    EXPECT_EQ(0u, run(Output));
+    EXPECT_EQ(Expected, Output);
+}
+
+TEST_F(PreComputedCacheTest, TruncatedFile) {
+    std::string Data = populate();
+
+    for (size_t Length = 0; Length != Data.size(); ++Length) {
+        writeFile(StringRef(Data).substr(0, Length));
+
+        std::string Output;
+        run(Output);
+        EXPECT_EQ(Expected, Output) << "length " << Length;
+    }
+}
+
+TEST_F(PreComputedCacheTest, HugeEntrySize) {
+    std::string Data = populate();
+
+    const uint32_t Size = 0xffffffff;
+    memcpy(&Data[HeaderSize], &Size, sizeof(Size));
+    writeFile(Data);
+
+    std::string Output;
+    EXPECT_EQ(0u, run(Output));
+    EXPECT_EQ(Expected, Output);
+}
+
+TEST_F(PreComputedCacheTest, CorruptEntries) {
+    std::string Data = populate();
+
+    // A byte of a spelling or a kind may change into another valid one, so
+    // the output is not checked: entries must only never be read out of
+    // bounds nor turned into tokens the engine cannot handle.
+    for (size_t Offset = HeaderSize; Offset != Data.size(); ++Offset) {
+        std::string Corrupt = Data;
+        Corrupt[Offset] ^= 0xff;
+        writeFile(Corrupt);
+
+        std::string Output;
+        run(Output);
+        EXPECT_FALSE(Output.empty()) << "offset " << Offset;
+    }
+}
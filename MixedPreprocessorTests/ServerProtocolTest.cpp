@@ -0,0 +1,401 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "Client.hpp"
+#include "ServerProtocol.hpp"
+
+#include "clang/Tooling/CompilationDatabase.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "gtest/gtest.h"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+namespace {
+
+ServerRequest makeRequest() {
+    ServerRequest Request;
+    Request.Options.Format = MixedPreprocessorOptions::Binary;
+    Request.Options.CacheDir = "/tmp/cache";
+    Request.Options.MemoryBudgetMB = 512;
+    Request.Options.Stats = true;
+    Request.Options.StatsTopN = 7;
+    Request.Options.TraceDir = "/tmp/trace";
+    Request.SourcePath = "/src/a.cpp";
+
+    for (unsigned i = 0; i != 3; ++i) {
+        clang::tooling::CompileCommand Command;
+        Command.Directory = "/build/" + std::to_string(i);
+        Command.CommandLine = {"clang++", "-DN=" + std::to_string(i), "-c", "/src/a.cpp"};
+        Request.Commands.push_back(Command);
+    }
+    // An empty command line and an empty argument.
+    Request.Commands.push_back(clang::tooling::CompileCommand());
+    Request.Commands.back().CommandLine.push_back("");
+
+    return Request;
+}
+
+ServerReply makeReply() {
+    ServerReply Reply;
+    Reply.Status = 3;
+    Reply.Output = std::string("identifier 'x'\n\0binary", 22);
+    Reply.Errors = "error: something\n";
+    return Reply;
+}
+
+// Sets the first uint32 of a message, where the version is.
+std::string withVersion(std::string Message, uint32_t Version) {
+    memcpy(&Message[0], &Version, sizeof(Version));
+    return Message;
+}
+
+uint32_t getVersion(const std::string &Message) {
+    uint32_t Version;
+    memcpy(&Version, Message.data(), sizeof(Version));
+    return Version;
+}
+
+class ServerProtocolSocketTest : public ::testing::Test {
+protected:
+    int Sender;
+    int Receiver;
+
+    void SetUp() override {
+        int FDs[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, FDs));
+        Sender = FDs[0];
+        Receiver = FDs[1];
+    }
+
+    void TearDown() override {
+        closeSender();
+        close(Receiver);
+    }
+
+    void closeSender() {
+        if (Sender >= 0) {
+            close(Sender);
+            Sender = -1;
+        }
+    }
+
+    void sendRaw(const void *Data, size_t Size) {
+        ASSERT_EQ(ssize_t(Size), write(Sender, Data, Size));
+    }
+
+    void sendLength(uint32_t Length) {
+        sendRaw(&Length, sizeof(Length));
+    }
+};
+
+// runRemote against a server of one connection, played by the test.
+class ClientTest : public ::testing::Test {
+protected:
+    llvm::SmallString<128> Dir;
+    std::string SocketPath;
+    int ListenFD;
+
+    void SetUp() override {
+        ASSERT_FALSE(llvm::sys::fs::createUniqueDirectory("mixed-preprocessor-client", Dir));
+        llvm::SmallString<128> Path(Dir);
+        llvm::sys::path::append(Path, "socket");
+        SocketPath = Path.str().str();
+
+        std::string Error;
+        ListenFD = listenSocket(SocketPath, Error);
+        ASSERT_GE(ListenFD, 0) << Error;
+    }
+
+    void TearDown() override {
+        stopListening();
+        llvm::sys::fs::remove(Dir);
+    }
+
+    void stopListening() {
+        if (ListenFD >= 0) {
+            close(ListenFD);
+            ListenFD = -1;
+            llvm::sys::fs::remove(SocketPath);
+        }
+    }
+
+    // Accepts one connection, reads its request and leaves the reply to
+    // Serve.
+    std::thread serve(std::function<void(int FD, const ServerRequest &Request)> Serve) {
+        return std::thread([this, Serve] {
+            int FD = accept(ListenFD, nullptr, nullptr);
+            ASSERT_GE(FD, 0);
+
+            std::string Message;
+            ServerRequest Request;
+            EXPECT_TRUE(receiveMessage(FD, Message));
+            EXPECT_TRUE(decodeRequest(Message, Request));
+
+            Serve(FD, Request);
+            close(FD);
+        });
+    }
+
+    // Diagnostics are kept in Errors.
+    std::string Errors;
+
+    bool run(std::string &Output, int &Status) {
+        clang::tooling::FixedCompilationDatabase Compilations(".", std::vector<std::string>{"-DX"});
+        llvm::raw_string_ostream OS(Output);
+        llvm::raw_string_ostream ErrOS(Errors);
+        bool Served = runRemote(SocketPath, Compilations, "a.cpp", MixedPreprocessorOptions(), OS, ErrOS, Status);
+        OS.flush();
+        ErrOS.flush();
+        return Served;
+    }
+};
+
+}
+
+
+TEST(ServerProtocolTest, RequestRoundTrip) {
+    ServerRequest Expected = makeRequest();
+
+    ServerRequest Actual;
+    ASSERT_TRUE(decodeRequest(encodeRequest(Expected), Actual));
+
+    EXPECT_EQ(Expected.Options.Format, Actual.Options.Format);
+    EXPECT_EQ(Expected.Options.CacheDir, Actual.Options.CacheDir);
+    EXPECT_EQ(Expected.Options.MemoryBudgetMB, Actual.Options.MemoryBudgetMB);
+    EXPECT_EQ(Expected.Options.Stats, Actual.Options.Stats);
+    EXPECT_EQ(Expected.Options.StatsTopN, Actual.Options.StatsTopN);
+    EXPECT_EQ(Expected.Options.TraceDir, Actual.Options.TraceDir);
+    EXPECT_EQ(Expected.SourcePath, Actual.SourcePath);
+
+    ASSERT_EQ(Expected.Commands.size(), Actual.Commands.size());
+    for (size_t i = 0; i != Expected.Commands.size(); ++i) {
+        EXPECT_EQ(Expected.Commands[i].Directory, Actual.Commands[i].Directory);
+        EXPECT_EQ(Expected.Commands[i].CommandLine, Actual.Commands[i].CommandLine);
+    }
+}
+
+TEST(ServerProtocolTest, DefaultRequestRoundTrip) {
+    ServerRequest Expected;
+
+    ServerRequest Actual;
+    ASSERT_TRUE(decodeRequest(encodeRequest(Expected), Actual));
+    EXPECT_EQ(MixedPreprocessorOptions::Text, Actual.Options.Format);
+    EXPECT_FALSE(Actual.Options.Stats);
+    EXPECT_TRUE(Actual.Commands.empty());
+}
+
+TEST(ServerProtocolTest, ReplyRoundTrip) {
+    ServerReply Expected = makeReply();
+
+    ServerReply Actual;
+    ASSERT_TRUE(decodeReply(encodeReply(Expected), Actual));
+    EXPECT_EQ(Expected.Status, Actual.Status);
+    EXPECT_EQ(Expected.Output, Actual.Output);
+    EXPECT_EQ(Expected.Errors, Actual.Errors);
+}
+
+TEST(ServerProtocolTest, VersionMismatch) {
+    std::string Request = encodeRequest(makeRequest());
+    std::string Reply = encodeReply(makeReply());
+    ASSERT_EQ(getVersion(Request), getVersion(Reply));
+
+    for (uint32_t Version : {getVersion(Request) - 1, getVersion(Request) + 1, 0u}) {
+        ServerRequest DecodedRequest;
+        EXPECT_FALSE(decodeRequest(withVersion(Request, Version), DecodedRequest)) << Version;
+
+        ServerReply DecodedReply;
+        EXPECT_FALSE(decodeReply(withVersion(Reply, Version), DecodedReply)) << Version;
+    }
+}
+
+TEST(ServerProtocolTest, TruncatedMessages) {
+    std::string Request = encodeRequest(makeRequest());
+    for (size_t Length = 0; Length != Request.size(); ++Length) {
+        ServerRequest Decoded;
+        EXPECT_FALSE(decodeRequest(Request.substr(0, Length), Decoded)) << Length;
+    }
+
+    std::string Reply = encodeReply(makeReply());
+    for (size_t Length = 0; Length != Reply.size(); ++Length) {
+        ServerReply Decoded;
+        EXPECT_FALSE(decodeReply(Reply.substr(0, Length), Decoded)) << Length;
+    }
+}
+
+TEST(ServerProtocolTest, HugeCounts) {
+    // A command count and a string length no message holds.
+    std::string Request = encodeRequest(ServerRequest());
+    uint32_t Huge = 0xffffffff;
+    memcpy(&Request[Request.size() - sizeof(Huge)], &Huge, sizeof(Huge));
+
+    ServerRequest Decoded;
+    EXPECT_FALSE(decodeRequest(Request, Decoded));
+
+    std::string Reply = encodeReply(ServerReply());
+    memcpy(&Reply[Reply.size() - sizeof(Huge)], &Huge, sizeof(Huge));
+
+    ServerReply DecodedReply;
+    EXPECT_FALSE(decodeReply(Reply, DecodedReply));
+}
+
+TEST_F(ServerProtocolSocketTest, Framing) {
+    std::vector<std::string> Messages = {
+            encodeRequest(makeRequest()),
+            std::string(),
+            encodeReply(makeReply()),
+            // Larger than the buffer of the socket, so that it is sent and
+            // received in pieces.
+            std::string(3 << 20, 'x'),
+            "last"};
+
+    std::thread Writer([&] {
+        for (auto &Message : Messages) {
+            EXPECT_TRUE(sendMessage(Sender, Message));
+        }
+    });
+
+    for (auto &Expected : Messages) {
+        std::string Message;
+        ASSERT_TRUE(receiveMessage(Receiver, Message));
+        EXPECT_EQ(Expected, Message);
+    }
+    Writer.join();
+
+    // The peer is gone once every message is through.
+    closeSender();
+    std::string Message;
+    EXPECT_FALSE(receiveMessage(Receiver, Message));
+}
+
+TEST_F(ServerProtocolSocketTest, ReceivedMessagesDecode) {
+    std::thread Writer([&] {
+        EXPECT_TRUE(sendMessage(Sender, encodeRequest(makeRequest())));
+    });
+
+    std::string Message;
+    ASSERT_TRUE(receiveMessage(Receiver, Message));
+    Writer.join();
+
+    ServerRequest Request;
+    ASSERT_TRUE(decodeRequest(Message, Request));
+    EXPECT_EQ("/src/a.cpp", Request.SourcePath);
+}
+
+TEST_F(ServerProtocolSocketTest, DisconnectInLength) {
+    const char Partial[2] = {4, 0};
+    sendRaw(Partial, sizeof(Partial));
+    closeSender();
+
+    std::string Message;
+    EXPECT_FALSE(receiveMessage(Receiver, Message));
+}
+
+TEST_F(ServerProtocolSocketTest, DisconnectInMessage) {
+    sendLength(100);
+    sendRaw("0123456789", 10);
+    closeSender();
+
+    std::string Message;
+    EXPECT_FALSE(receiveMessage(Receiver, Message));
+}
+
+TEST_F(ServerProtocolSocketTest, DisconnectAfterLargeLength) {
+    // Only what is received is allocated for.
+    sendLength(MaxMessageSize);
+    sendRaw("0123456789", 10);
+    closeSender();
+
+    std::string Message;
+    EXPECT_FALSE(receiveMessage(Receiver, Message));
+    EXPECT_LT(Message.capacity(), size_t(MaxMessageSize));
+}
+
+TEST_F(ServerProtocolSocketTest, OversizedLength) {
+    sendLength(MaxMessageSize + 1);
+    sendRaw("0123456789", 10);
+
+    std::string Message;
+    EXPECT_FALSE(receiveMessage(Receiver, Message));
+    EXPECT_TRUE(Message.empty());
+}
+
+TEST_F(ClientTest, Reply) {
+    std::thread Server = serve([](int FD, const ServerRequest &Request) {
+        // The server does not run in the directory of the client.
+        EXPECT_TRUE(llvm::sys::path::is_absolute(Request.SourcePath));
+        EXPECT_EQ(1u, Request.Commands.size());
+
+        ServerReply Reply;
+        Reply.Status = 2;
+        Reply.Output = "identifier 'x'\n";
+        Reply.Errors = "a.cpp:1:1: warning: w\n";
+        EXPECT_TRUE(sendMessage(FD, encodeReply(Reply)));
+    });
+
+    std::string Output;
+    int Status = 0;
+    EXPECT_TRUE(run(Output, Status));
+    Server.join();
+
+    EXPECT_EQ(2, Status);
+    EXPECT_EQ("identifier 'x'\n", Output);
+    EXPECT_EQ("a.cpp:1:1: warning: w\n", Errors);
+}
+
+TEST_F(ClientTest, ServerOfAnotherVersion) {
+    std::thread Server = serve([](int FD, const ServerRequest &) {
+        ServerReply Reply;
+        Reply.Output = "identifier 'x'\n";
+        std::string Message = encodeReply(Reply);
+        EXPECT_TRUE(sendMessage(FD, withVersion(Message, getVersion(Message) + 1)));
+    });
+
+    std::string Output;
+    int Status = 0;
+    EXPECT_TRUE(run(Output, Status));
+    Server.join();
+
+    EXPECT_EQ(1, Status);
+    EXPECT_EQ("", Output);
+}
+
+TEST_F(ClientTest, ServerDisconnectsInReply) {
+    std::thread Server = serve([](int FD, const ServerRequest &) {
+        uint32_t Length = 100;
+        EXPECT_EQ(ssize_t(sizeof(Length)), write(FD, &Length, sizeof(Length)));
+        EXPECT_EQ(10, write(FD, "0123456789", 10));
+    });
+
+    std::string Output;
+    int Status = 0;
+    EXPECT_TRUE(run(Output, Status));
+    Server.join();
+
+    EXPECT_EQ(1, Status);
+    EXPECT_EQ("", Output);
+    EXPECT_NE(std::string::npos, Errors.find("lost the server"));
+}
+
+TEST_F(ClientTest, NoServer) {
+    stopListening();
+
+    std::string Output;
+    int Status = 0;
+    EXPECT_FALSE(run(Output, Status));
+    EXPECT_EQ("", Output);
+}
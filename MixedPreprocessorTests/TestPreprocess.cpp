@@ -0,0 +1,53 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "TestPreprocess.hpp"
+
+#include "clang/Tooling/Tooling.h"
+
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdlib>
+
+
+std::string preprocess(
+        llvm::StringRef Code,
+        const MixedPreprocessorOptions &Options,
+        std::string *Errors,
+        const std::vector<std::string> &Args) {
+    std::vector<std::string> CommandLine = {"-x", "c++"};
+    CommandLine.insert(CommandLine.end(), Args.begin(), Args.end());
+
+    std::string Output;
+    std::string Reports;
+    {
+        llvm::raw_string_ostream OS(Output);
+        llvm::raw_string_ostream ErrOS(Reports);
+        clang::tooling::runToolOnCodeWithArgs(
+                new MixedPrintPreprocessedAction(Options, &OS, &ErrOS), Code, CommandLine, "test.cpp");
+    }
+
+    if (Errors) {
+        *Errors += Reports;
+    }
+    return Output;
+}
+
+std::string preprocess(llvm::StringRef Code) {
+    return preprocess(Code, MixedPreprocessorOptions());
+}
+
+uint64_t getCounter(const std::string &Reports, const std::string &Name, const std::string &Counter) {
+    const std::string Entry = "{\"name\": \"" + Name + "\"";
+    const std::string Key = "\"" + Counter + "\": ";
+
+    uint64_t Sum = 0;
+    for (size_t Pos = Reports.find(Entry); Pos != std::string::npos; Pos = Reports.find(Entry, Pos + 1)) {
+        size_t Value = Reports.find(Key, Pos);
+        if (Value < Reports.find('}', Pos)) {
+            Sum += strtoull(Reports.c_str() + Value + Key.size(), nullptr, 10);
+        }
+    }
+    return Sum;
+}
@@ -0,0 +1,33 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_TESTPREPROCESS_HPP
+#define MIXED_PREPROCESSOR_TESTPREPROCESS_HPP
+
+
+#include "FrontendActions.hpp"
+
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// Preprocesses Code as a C++ source with MixedPrintPreprocessedAction and
+// returns the text output.  Reports, statistics included, are appended to
+// Errors if not null.  Args are added to the command line.
+std::string preprocess(
+        llvm::StringRef Code,
+        const MixedPreprocessorOptions &Options,
+        std::string *Errors = nullptr,
+        const std::vector<std::string> &Args = std::vector<std::string>());
+
+std::string preprocess(llvm::StringRef Code);
+
+// Sum of a counter of the macros named Name in a statistics report.
+uint64_t getCounter(const std::string &Reports, const std::string &Name, const std::string &Counter);
+
+
+#endif //MIXED_PREPROCESSOR_TESTPREPROCESS_HPP
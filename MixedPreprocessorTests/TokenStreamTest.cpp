@@ -0,0 +1,220 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "TokenStreamReader.hpp"
+#include "TokenStreamWriter.hpp"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "gtest/gtest.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace tokenstream;
+
+
+namespace {
+
+const llvm::StringRef KindNames[] = {"unknown", "identifier", "numeric_constant", "l_paren", "r_paren", "eof"};
+
+struct Token {
+    uint16_t Kind;
+    uint16_t Flags;
+    std::string Spelling;
+};
+
+std::string write(const std::vector<Token> &Tokens, unsigned ChunkSize = 256) {
+    std::string Data;
+    {
+        llvm::raw_string_ostream OS(Data);
+        TokenStreamWriter Writer(OS, KindNames, ChunkSize);
+        for (auto &Tok : Tokens) {
+            Writer.add(Tok.Kind, Tok.Flags, Tok.Spelling);
+        }
+    }
+    return Data;
+}
+
+// The reader gets a copy of exactly Data, so that reading past its end is
+// caught by the sanitizers.
+std::unique_ptr<TokenStreamReader> open(llvm::StringRef Data, std::string &Error) {
+    return TokenStreamReader::create(llvm::MemoryBuffer::getMemBufferCopy(Data), Error);
+}
+
+// Reads the whole stream, returns false on an error.
+bool read(llvm::StringRef Data, std::vector<Token> &Tokens, std::string &Error) {
+    auto Reader = open(Data, Error);
+    if (!Reader) {
+        return false;
+    }
+
+    TokenRecord Record;
+    while (Reader->next(Record)) {
+        Tokens.push_back({Record.Kind, Record.Flags, Record.Spelling.str()});
+    }
+
+    Error = Reader->getError();
+    return Error.empty();
+}
+
+std::vector<Token> makeTokens(unsigned Count) {
+    std::vector<Token> Tokens;
+    for (unsigned i = 0; i != Count; ++i) {
+        // Spellings repeat, a chunk refers to strings of the previous ones.
+        Tokens.push_back({uint16_t(i % 5), uint16_t(i & 3), "t" + std::to_string(i % 37)});
+    }
+    return Tokens;
+}
+
+void expectEqual(const std::vector<Token> &Expected, const std::vector<Token> &Actual) {
+    ASSERT_EQ(Expected.size(), Actual.size());
+    for (size_t i = 0; i != Expected.size(); ++i) {
+        EXPECT_EQ(Expected[i].Kind, Actual[i].Kind) << "token " << i;
+        EXPECT_EQ(Expected[i].Flags, Actual[i].Flags) << "token " << i;
+        EXPECT_EQ(Expected[i].Spelling, Actual[i].Spelling) << "token " << i;
+    }
+}
+
+void expectRoundTrip(const std::vector<Token> &Tokens, unsigned ChunkSize = 256) {
+    std::vector<Token> Actual;
+    std::string Error;
+    EXPECT_TRUE(read(write(Tokens, ChunkSize), Actual, Error)) << Error;
+    expectEqual(Tokens, Actual);
+}
+
+}
+
+
+TEST(TokenStreamTest, Empty) {
+    std::string Data = write({});
+
+    std::vector<Token> Tokens;
+    std::string Error;
+    EXPECT_TRUE(read(Data, Tokens, Error)) << Error;
+    EXPECT_TRUE(Tokens.empty());
+
+    auto Reader = open(Data, Error);
+    ASSERT_TRUE(bool(Reader));
+    for (unsigned Kind = 0; Kind != llvm::array_lengthof(KindNames); ++Kind) {
+        EXPECT_EQ(KindNames[Kind], Reader->getKindName(Kind));
+    }
+    EXPECT_EQ("", Reader->getKindName(llvm::array_lengthof(KindNames)));
+}
+
+TEST(TokenStreamTest, EmptyFile) {
+    std::string Error;
+    EXPECT_FALSE(open("", Error));
+    EXPECT_FALSE(Error.empty());
+}
+
+TEST(TokenStreamTest, EmptySpelling) {
+    expectRoundTrip({{0, 0, ""}, {1, 1, "a"}, {5, 0, ""}});
+}
+
+TEST(TokenStreamTest, ChunkBoundary) {
+    for (unsigned Count : {255u, 256u, 257u, 512u, 513u}) {
+        SCOPED_TRACE(Count);
+        expectRoundTrip(makeTokens(Count), 256);
+    }
+}
+
+TEST(TokenStreamTest, FullChunkOnly) {
+    // Exactly one chunk, and nothing left to flush at the end.
+    std::vector<Token> Tokens = makeTokens(256);
+    std::string OneChunk = write(Tokens, 256);
+    std::string Larger = write(Tokens, 1024);
+    EXPECT_EQ(OneChunk, Larger);
+}
+
+TEST(TokenStreamTest, SharedStrings) {
+    std::vector<Token> Tokens;
+    for (unsigned i = 0; i != 1000; ++i) {
+        Tokens.push_back({1, 0, i % 2 ? "shared_spelling" : "other_spelling"});
+    }
+    std::string Data = write(Tokens, 256);
+    expectRoundTrip(Tokens, 256);
+
+    // Every distinct spelling is written once.
+    size_t Count = 0;
+    for (size_t Pos = Data.find("shared_spelling"); Pos != std::string::npos;
+         Pos = Data.find("shared_spelling", Pos + 1)) {
+        ++Count;
+    }
+    EXPECT_EQ(1u, Count);
+}
+
+TEST(TokenStreamTest, Truncated) {
+    std::vector<Token> Tokens = makeTokens(600);
+    std::string Data = write(Tokens, 256);
+
+    // A stream cut at a chunk boundary is a valid shorter stream, anywhere
+    // else it is an error, and only tokens read before are returned.
+    for (size_t Length = 0; Length != Data.size(); ++Length) {
+        std::vector<Token> Actual;
+        std::string Error;
+        if (!read(llvm::StringRef(Data).substr(0, Length), Actual, Error)) {
+            EXPECT_FALSE(Error.empty()) << "length " << Length;
+        }
+        ASSERT_LE(Actual.size(), Tokens.size());
+        expectEqual(std::vector<Token>(Tokens.begin(), Tokens.begin() + Actual.size()), Actual);
+    }
+}
+
+TEST(TokenStreamTest, Corrupt) {
+    std::string Data = write(makeTokens(300), 256);
+
+    for (size_t Offset = 0; Offset != Data.size(); ++Offset) {
+        for (uint8_t Mask : {uint8_t(0x01), uint8_t(0x80), uint8_t(0xff)}) {
+            std::string Corrupt = Data;
+            Corrupt[Offset] ^= Mask;
+
+            std::vector<Token> Actual;
+            std::string Error;
+            read(Corrupt, Actual, Error);
+        }
+    }
+}
+
+TEST(TokenStreamTest, HugeCounts) {
+    std::string Header = write({});
+    const char Huge[4] = {'\xff', '\xff', '\xff', '\xff'};
+
+    // A kind count no file can hold.
+    std::string Kinds = Header.substr(0, 8) + std::string(Huge, 4);
+    std::string Error;
+    EXPECT_FALSE(open(Kinds, Error));
+    EXPECT_FALSE(Error.empty());
+
+    // Chunks claiming more tokens or strings than there are bytes left.
+    for (unsigned Field = 0; Field != 2; ++Field) {
+        std::string Chunk = Header + std::string(8, '\0');
+        memcpy(&Chunk[Header.size() + Field * 4], Huge, 4);
+
+        std::vector<Token> Actual;
+        Error.clear();
+        EXPECT_FALSE(read(Chunk, Actual, Error));
+        EXPECT_FALSE(Error.empty());
+        EXPECT_TRUE(Actual.empty());
+    }
+}
+
+TEST(TokenStreamTest, SpellingOutOfRange) {
+    std::string Data = write({{1, 0, "a"}, {1, 0, "b"}});
+
+    // The spelling column of the only chunk follows its kinds and flags.
+    size_t Spellings = write({}).size() + 8 + 2 * 2 + 2 * 2;
+    Data[Spellings + 4] = 2;
+
+    std::vector<Token> Actual;
+    std::string Error;
+    EXPECT_FALSE(read(Data, Actual, Error));
+    EXPECT_FALSE(Error.empty());
+    EXPECT_EQ(1u, Actual.size());
+}
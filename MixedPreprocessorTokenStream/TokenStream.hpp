@@ -0,0 +1,50 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_TOKENSTREAM_HPP
+#define MIXED_PREPROCESSOR_TOKENSTREAM_HPP
+
+
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+
+
+// Binary token stream, as written by mixed-preprocessor --format=binary.
+//
+// All integers are little-endian.
+//
+//   Header:
+//     char   Magic[4]              "MPTS"
+//     uint32 Version
+//     uint32 NumKinds
+//     {uint32 Length, char Name[Length]} * NumKinds
+//
+//   Chunks, until the end of the stream:
+//     uint32 NumTokens
+//     uint32 NumStrings            strings added to the string table
+//     uint16 Kind[NumTokens]
+//     uint16 Flags[NumTokens]
+//     uint32 Spelling[NumTokens]   index into the string table
+//     uint32 Length[NumStrings]
+//     char   Data[sum of Length]
+//
+// The string table is shared by the whole stream: every distinct spelling is
+// written once, by the chunk where it first occurs, and gets the next index.
+// Kinds index the name table of the header, flags are clang::Token flags.
+namespace tokenstream {
+
+const char Magic[4] = {'M', 'P', 'T', 'S'};
+const uint32_t Version = 1;
+
+struct TokenRecord {
+    uint16_t Kind;
+    uint16_t Flags;
+    llvm::StringRef Spelling;
+};
+
+}
+
+
+#endif //MIXED_PREPROCESSOR_TOKENSTREAM_HPP
@@ -0,0 +1,145 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "TokenStreamReader.hpp"
+
+#include "llvm/Support/Endian.h"
+
+#include <cstring>
+
+
+using namespace tokenstream;
+
+
+static uint16_t read16(const char *Ptr) {
+    return llvm::support::endian::read16le(Ptr);
+}
+
+static uint32_t read32(const char *Ptr) {
+    return llvm::support::endian::read32le(Ptr);
+}
+
+
+TokenStreamReader::TokenStreamReader(std::unique_ptr<llvm::MemoryBuffer> Buffer) :
+        Buffer(std::move(Buffer)),
+        Ptr(this->Buffer->getBufferStart()),
+        End(this->Buffer->getBufferEnd()),
+        Kinds(nullptr),
+        Flags(nullptr),
+        Spellings(nullptr),
+        NumTokens(0),
+        Current(0) {}
+
+std::unique_ptr<TokenStreamReader> TokenStreamReader::open(llvm::StringRef Path, std::string &Error) {
+    auto File = llvm::MemoryBuffer::getFile(Path, -1, false);
+    if (!File) {
+        Error = File.getError().message();
+        return nullptr;
+    }
+
+    return create(std::move(File.get()), Error);
+}
+
+std::unique_ptr<TokenStreamReader> TokenStreamReader::create(
+        std::unique_ptr<llvm::MemoryBuffer> Buffer, std::string &Error) {
+    std::unique_ptr<TokenStreamReader> Reader(new TokenStreamReader(std::move(Buffer)));
+    if (!Reader->readHeader()) {
+        Error = Reader->Error;
+        return nullptr;
+    }
+
+    return Reader;
+}
+
+bool TokenStreamReader::fail(const char *Message) {
+    Error = Message;
+    Ptr = End;
+    NumTokens = Current = 0;
+    return false;
+}
+
+bool TokenStreamReader::readHeader() {
+    if (size_t(End - Ptr) < sizeof(Magic) + 8 || memcmp(Ptr, Magic, sizeof(Magic))) {
+        return fail("not a token stream");
+    }
+    Ptr += sizeof(Magic);
+
+    if (read32(Ptr) != Version) {
+        return fail("unsupported token stream version");
+    }
+
+    uint32_t NumKinds = read32(Ptr + 4);
+    Ptr += 8;
+
+    // Every name takes at least its length field, the count is not trusted
+    // further than that.
+    if (NumKinds > size_t(End - Ptr) / 4) {
+        return fail("truncated kind table");
+    }
+    KindNames.reserve(NumKinds);
+    for (uint32_t i = 0; i != NumKinds; ++i) {
+        if (size_t(End - Ptr) < 4 || size_t(End - Ptr - 4) < read32(Ptr)) {
+            return fail("truncated kind table");
+        }
+        uint32_t Length = read32(Ptr);
+        KindNames.emplace_back(Ptr + 4, Length);
+        Ptr += 4 + Length;
+    }
+
+    return true;
+}
+
+bool TokenStreamReader::readChunk() {
+    if (size_t(End - Ptr) < 8) {
+        return Ptr == End ? false : fail("truncated chunk header");
+    }
+
+    uint32_t Tokens = read32(Ptr);
+    uint32_t NumStrings = read32(Ptr + 4);
+    Ptr += 8;
+
+    uint64_t ColumnsSize = uint64_t(Tokens) * (2 + 2 + 4) + uint64_t(NumStrings) * 4;
+    if (uint64_t(End - Ptr) < ColumnsSize) {
+        return fail("truncated chunk");
+    }
+
+    Kinds = Ptr;
+    Flags = Kinds + size_t(Tokens) * 2;
+    Spellings = Flags + size_t(Tokens) * 2;
+    const char *Lengths = Spellings + size_t(Tokens) * 4;
+    Ptr = Lengths + size_t(NumStrings) * 4;
+
+    for (uint32_t i = 0; i != NumStrings; ++i) {
+        uint32_t Length = read32(Lengths + size_t(i) * 4);
+        if (size_t(End - Ptr) < Length) {
+            return fail("truncated string table");
+        }
+        Strings.emplace_back(Ptr, Length);
+        Ptr += Length;
+    }
+
+    NumTokens = Tokens;
+    Current = 0;
+    return true;
+}
+
+bool TokenStreamReader::next(TokenRecord &Tok) {
+    while (Current == NumTokens) {
+        if (!readChunk()) {
+            return false;
+        }
+    }
+
+    uint32_t Spelling = read32(Spellings + size_t(Current) * 4);
+    if (Spelling >= Strings.size()) {
+        return fail("spelling out of range");
+    }
+
+    Tok.Kind = read16(Kinds + size_t(Current) * 2);
+    Tok.Flags = read16(Flags + size_t(Current) * 2);
+    Tok.Spelling = Strings[Spelling];
+
+    ++Current;
+    return true;
+}
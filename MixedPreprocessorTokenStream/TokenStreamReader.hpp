@@ -0,0 +1,76 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_TOKENSTREAMREADER_HPP
+#define MIXED_PREPROCESSOR_TOKENSTREAMREADER_HPP
+
+
+#include "TokenStream.hpp"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace tokenstream {
+
+// Reads a token stream from a memory-mapped file.
+//
+// Spellings and kind names point into the mapped file and stay valid for the
+// lifetime of the reader.
+//
+//   std::string Error;
+//   auto Reader = TokenStreamReader::open(Path, Error);
+//   TokenRecord Tok;
+//   while (Reader->next(Tok)) { ... }
+class TokenStreamReader {
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+    const char *Ptr;
+    const char *End;
+
+    std::vector<llvm::StringRef> KindNames;
+    std::vector<llvm::StringRef> Strings;
+
+    // Columns of the current chunk.
+    const char *Kinds;
+    const char *Flags;
+    const char *Spellings;
+    uint32_t NumTokens;
+    uint32_t Current;
+
+    std::string Error;
+
+    explicit TokenStreamReader(std::unique_ptr<llvm::MemoryBuffer> Buffer);
+
+    bool fail(const char *Message);
+    bool readHeader();
+    bool readChunk();
+
+public:
+    // Returns nullptr and sets Error if the file cannot be read or is not a
+    // token stream.
+    static std::unique_ptr<TokenStreamReader> open(llvm::StringRef Path, std::string &Error);
+
+    // Same as open, over a stream already in memory.
+    static std::unique_ptr<TokenStreamReader> create(std::unique_ptr<llvm::MemoryBuffer> Buffer, std::string &Error);
+
+    // Returns false at the end of the stream, or on a malformed chunk, in
+    // which case getError is not empty.
+    bool next(TokenRecord &Tok);
+
+    llvm::StringRef getKindName(uint16_t Kind) const {
+        return Kind < KindNames.size() ? KindNames[Kind] : llvm::StringRef();
+    }
+
+    const std::string & getError() const { return Error; }
+};
+
+}
+
+
+#endif //MIXED_PREPROCESSOR_TOKENSTREAMREADER_HPP
@@ -0,0 +1,90 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#include "TokenStreamWriter.hpp"
+
+#include "llvm/Support/Endian.h"
+
+
+using namespace tokenstream;
+
+
+template <typename T>
+static void write(llvm::raw_ostream &OS, T Value) {
+    Value = llvm::support::endian::byte_swap<T, llvm::support::little>(Value);
+    OS.write(reinterpret_cast<const char *>(&Value), sizeof(T));
+}
+
+template <typename T>
+static void write(llvm::raw_ostream &OS, const std::vector<T> &Values) {
+    if (llvm::sys::IsLittleEndianHost) {
+        OS.write(reinterpret_cast<const char *>(Values.data()), Values.size() * sizeof(T));
+        return;
+    }
+    for (auto Value : Values) {
+        write(OS, Value);
+    }
+}
+
+
+TokenStreamWriter::TokenStreamWriter(
+        llvm::raw_ostream &OS, llvm::ArrayRef<llvm::StringRef> KindNames, unsigned ChunkSize) :
+        OS(OS), ChunkSize(ChunkSize) {
+    OS.write(Magic, sizeof(Magic));
+    write(OS, Version);
+
+    write(OS, static_cast<uint32_t>(KindNames.size()));
+    for (auto Name : KindNames) {
+        write(OS, static_cast<uint32_t>(Name.size()));
+        OS << Name;
+    }
+
+    Kinds.reserve(ChunkSize);
+    Flags.reserve(ChunkSize);
+    Spellings.reserve(ChunkSize);
+}
+
+TokenStreamWriter::~TokenStreamWriter() {
+    flush();
+}
+
+void TokenStreamWriter::add(uint16_t Kind, uint16_t TokenFlags, llvm::StringRef Spelling) {
+    auto Inserted = Strings.insert(std::make_pair(Spelling, static_cast<uint32_t>(Strings.size())));
+    if (Inserted.second) {
+        NewLengths.push_back(Spelling.size());
+        NewData.append(Spelling.data(), Spelling.size());
+    }
+
+    Kinds.push_back(Kind);
+    Flags.push_back(TokenFlags);
+    Spellings.push_back(Inserted.first->second);
+
+    if (Kinds.size() == ChunkSize) {
+        writeChunk();
+    }
+}
+
+void TokenStreamWriter::flush() {
+    if (!Kinds.empty()) {
+        writeChunk();
+    }
+    OS.flush();
+}
+
+void TokenStreamWriter::writeChunk() {
+    write(OS, static_cast<uint32_t>(Kinds.size()));
+    write(OS, static_cast<uint32_t>(NewLengths.size()));
+
+    write(OS, Kinds);
+    write(OS, Flags);
+    write(OS, Spellings);
+    write(OS, NewLengths);
+    OS << NewData;
+
+    Kinds.clear();
+    Flags.clear();
+    Spellings.clear();
+    NewLengths.clear();
+    NewData.clear();
+}
@@ -0,0 +1,52 @@
+// Copyright (c) Timur Iskhakov.
+// Distributed under the terms of the GNU GPL v3 License.
+
+
+#ifndef MIXED_PREPROCESSOR_TOKENSTREAMWRITER_HPP
+#define MIXED_PREPROCESSOR_TOKENSTREAMWRITER_HPP
+
+
+#include "TokenStream.hpp"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdint>
+#include <vector>
+
+
+namespace tokenstream {
+
+// Buffers tokens column by column and writes them a chunk at a time.
+class TokenStreamWriter {
+    llvm::raw_ostream &OS;
+    const unsigned ChunkSize;
+
+    llvm::StringMap<uint32_t> Strings;
+
+    std::vector<uint16_t> Kinds;
+    std::vector<uint16_t> Flags;
+    std::vector<uint32_t> Spellings;
+    std::vector<uint32_t> NewLengths;
+    std::string NewData;
+
+    void writeChunk();
+
+public:
+    TokenStreamWriter(llvm::raw_ostream &OS, llvm::ArrayRef<llvm::StringRef> KindNames, unsigned ChunkSize = 1 << 16);
+    TokenStreamWriter(const TokenStreamWriter &) = delete;
+    TokenStreamWriter & operator=(const TokenStreamWriter &) = delete;
+    ~TokenStreamWriter();
+
+    void add(uint16_t Kind, uint16_t Flags, llvm::StringRef Spelling);
+
+    // Writes the pending tokens out.
+    void flush();
+};
+
+}
+
+
+#endif //MIXED_PREPROCESSOR_TOKENSTREAMWRITER_HPP